@@ -9,6 +9,7 @@
 #include <openssl/crypto.h>
 #include <random>
 #include <regex>
+#include <set>
 #include <string>
 #include <sys/stat.h>
 
@@ -25,6 +26,7 @@
 #include <aws/sts/model/GetAccessKeyInfoRequest.h>
 #include <aws/sts/model/GetCallerIdentityRequest.h>
 #endif
+#include "lease_registry.hpp"
 #include "util.hpp"
 
 #define LEASE_ID_LENGTH 10
@@ -141,6 +143,24 @@ bool IsTestInvocationForUnitTests( std::string arn )
     return false;
 }
 
+/**
+ * Reports the lifetime the KDC granted to the TGT of a lease, which can be shorter than
+ * requested when the KDC policy caps it
+ * @param krb_cc_name - lease ccache
+ * @param granted_lifetime - response field to fill
+ */
+static void set_granted_lifetime( const std::string& krb_cc_name,
+                                  credentialsfetcher::KerberosTicketLifetime* granted_lifetime )
+{
+    krb5_ticket_times times;
+    granted_lifetime->set_krb_file_path( krb_cc_name );
+    if ( get_tgt_times( krb_cc_name, &times ) )
+    {
+        granted_lifetime->set_endtime( (int64_t)times.endtime );
+        granted_lifetime->set_renew_till( (int64_t)times.renew_till );
+    }
+}
+
 volatile sig_atomic_t* pthread_shutdown_signal = nullptr;
 
 /**
@@ -338,6 +358,324 @@ class CredentialsFetcherImpl final
         CallStatus status_; // The current serving state.
     };
 
+    // Class encompasing the state and logic needed to serve a request.
+    class CallDataGetRenewalForecast
+    {
+      public:
+        std::string cookie;
+
+#define CLASS_NAME_CallDataGetRenewalForecast "CallDataGetRenewalForecast"
+#define DEFAULT_RENEWAL_FORECAST_HOURS 24
+        // Take in the "service" instance (in this case representing an asynchronous
+        // server) and the completion queue "cq" used for asynchronous communication
+        // with the gRPC runtime.
+        CallDataGetRenewalForecast(
+            credentialsfetcher::CredentialsFetcherService::AsyncService* service,
+            grpc::ServerCompletionQueue* cq )
+            : service_( service )
+            , cq_( cq )
+            , forecast_responder_( &forecast_ctx_ )
+            , status_( CREATE )
+        {
+            cookie = CLASS_NAME_CallDataGetRenewalForecast;
+            // Invoke the serving logic right away.
+            Proceed();
+        }
+
+        void Proceed()
+        {
+            if ( cookie.compare( CLASS_NAME_CallDataGetRenewalForecast ) != 0 )
+            {
+                return;
+            }
+            std::cerr << Util::getCurrentTime() << '\t' << "INFO: CallDataGetRenewalForecast "
+                      << this << "status: " << status_ << std::endl;
+
+            if ( status_ == CREATE )
+            {
+                // Make this instance progress to the PROCESS state.
+                status_ = PROCESS;
+
+                // As part of the initial CREATE state, we *request* that the system
+                // start processing RequestGetRenewalForecast requests. In this request, "this"
+                // acts are the tag uniquely identifying the request (so that different CallData
+                // instances can serve different requests concurrently), in this case
+                // the memory address of this CallData instance.
+
+                service_->RequestGetRenewalForecast( &forecast_ctx_, &forecast_request_,
+                                                     &forecast_responder_, cq_, cq_, this );
+            }
+            else if ( status_ == PROCESS )
+            {
+                // Spawn a new CallData instance to serve new clients while we process
+                // the one for this CallData. The instance will deallocate itself as
+                // part of its FINISH state.
+                new CallDataGetRenewalForecast( service_, cq_ );
+
+                // The actual processing.
+                uint32_t hours = forecast_request_.hours();
+                for ( auto& forecast : get_renewal_forecast(
+                          hours == 0 ? DEFAULT_RENEWAL_FORECAST_HOURS : hours ) )
+                {
+                    credentialsfetcher::RenewalForecastBucket* bucket =
+                        forecast_reply_.add_buckets();
+                    bucket->set_domain( forecast.domain_name );
+                    bucket->set_domain_controller( forecast.domain_controller );
+                    bucket->set_bucket_start( (int64_t)forecast.bucket_start );
+                    bucket->set_renewals( forecast.renewals );
+                    bucket->set_ldap_operations( forecast.ldap_operations );
+                    bucket->set_kdc_operations( forecast.kdc_operations );
+                }
+
+                // And we are done! Let the gRPC runtime know we've finished, using the
+                // memory address of this instance as the uniquely identifying tag for
+                // the event.
+                status_ = FINISH;
+                forecast_responder_.Finish( forecast_reply_, grpc::Status::OK, this );
+            }
+            else
+            {
+                GPR_ASSERT( status_ == FINISH );
+                // Once in the FINISH state, deallocate ourselves (CallData).
+                delete this;
+            }
+
+            return;
+        }
+
+      private:
+        // The means of communication with the gRPC runtime for an asynchronous
+        // server.
+        credentialsfetcher::CredentialsFetcherService::AsyncService* service_;
+        // The producer-consumer queue where for asynchronous server notifications.
+        grpc::ServerCompletionQueue* cq_;
+        // Context for the rpc, allowing to tweak aspects of it such as the use
+        // of compression, authentication, as well as to send metadata back to the
+        // client.
+        grpc::ServerContext forecast_ctx_;
+
+        // What we get from the client.
+        credentialsfetcher::RenewalForecastRequest forecast_request_;
+        // What we send back to the client.
+        credentialsfetcher::RenewalForecastResponse forecast_reply_;
+
+        // The means to get back to the client.
+        grpc::ServerAsyncResponseWriter<credentialsfetcher::RenewalForecastResponse>
+            forecast_responder_;
+
+        // Let's implement a tiny state machine with the following states.
+        enum CallStatus
+        {
+            CREATE,
+            PROCESS,
+            FINISH
+        };
+        CallStatus status_; // The current serving state.
+    };
+
+    // Class encompasing the state and logic needed to serve a request.
+    class CallDataRenewLease
+    {
+      public:
+        std::string cookie;
+
+#define CLASS_NAME_CallDataRenewLease "CallDataRenewLease"
+// how long the renewals of a RenewLease call may take before they are reported pending
+#define RENEW_LEASE_TIMEOUT_SECS 60
+        // Take in the "service" instance (in this case representing an asynchronous
+        // server) and the completion queue "cq" used for asynchronous communication
+        // with the gRPC runtime.
+        CallDataRenewLease( credentialsfetcher::CredentialsFetcherService::AsyncService* service,
+                            grpc::ServerCompletionQueue* cq )
+            : service_( service )
+            , cq_( cq )
+            , renew_lease_responder_( &renew_lease_ctx_ )
+            , status_( CREATE )
+        {
+            cookie = CLASS_NAME_CallDataRenewLease;
+            // Invoke the serving logic right away.
+            Proceed();
+        }
+
+        void Proceed()
+        {
+            if ( cookie.compare( CLASS_NAME_CallDataRenewLease ) != 0 )
+            {
+                return;
+            }
+            std::cerr << Util::getCurrentTime() << '\t' << "INFO: CallDataRenewLease " << this
+                      << "status: " << status_ << std::endl;
+
+            if ( status_ == CREATE )
+            {
+                // Make this instance progress to the PROCESS state.
+                status_ = PROCESS;
+
+                // As part of the initial CREATE state, we *request* that the system
+                // start processing RequestRenewLease requests. In this request, "this" acts
+                // are the tag uniquely identifying the request (so that different CallData
+                // instances can serve different requests concurrently), in this case
+                // the memory address of this CallData instance.
+
+                service_->RequestRenewLease( &renew_lease_ctx_, &renew_lease_request_,
+                                             &renew_lease_responder_, cq_, cq_, this );
+            }
+            else if ( status_ == PROCESS )
+            {
+                // Spawn a new CallData instance to serve new clients while we process
+                // the one for this CallData. The instance will deallocate itself as
+                // part of its FINISH state.
+                new CallDataRenewLease( service_, cq_ );
+
+                // The actual processing.
+                std::string lease_id = renew_lease_request_.lease_id();
+                grpc::Status status = grpc::Status::OK;
+                std::vector<krb_ticket_info_t> krb_tickets =
+                    LeaseRegistry::instance().find_by_lease_id( lease_id );
+                if ( lease_id.empty() || krb_tickets.empty() )
+                {
+                    std::string err_msg = "Error: lease_id is not valid";
+                    std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                    status = grpc::Status( grpc::StatusCode::NOT_FOUND, err_msg );
+                }
+                else
+                {
+                    renew_lease_reply_.set_lease_id( lease_id );
+                    // The renewal thread finishes the call, this instance may be gone once
+                    // the renewals are requested
+                    status_ = FINISH;
+                    renew_lease( krb_tickets, &status );
+                    if ( status.ok() )
+                    {
+                        return;
+                    }
+                }
+
+                // And we are done! Let the gRPC runtime know we've finished, using the
+                // memory address of this instance as the uniquely identifying tag for
+                // the event.
+                status_ = FINISH;
+                renew_lease_responder_.Finish( renew_lease_reply_, status, this );
+            }
+            else
+            {
+                GPR_ASSERT( status_ == FINISH );
+                // Once in the FINISH state, deallocate ourselves (CallData).
+                delete this;
+            }
+
+            return;
+        }
+
+      private:
+        /**
+         * Renews the tickets of the lease through the renewal thread, so a renewal that is
+         * already in flight is shared instead of repeated. The completion queue thread does
+         * not wait, the call is finished with the new expiry times once the renewals are
+         * done or RENEW_LEASE_TIMEOUT_SECS have passed.
+         * @param krb_tickets - tickets of the lease
+         * @param status - set when the renewal thread is not running, the call is then
+         *                 left for the caller to finish
+         */
+        void renew_lease( const std::vector<krb_ticket_info_t>& krb_tickets,
+                          grpc::Status* status )
+        {
+            std::vector<std::string> krb_cc_names;
+            for ( auto& krb_ticket : krb_tickets )
+            {
+                if ( is_scheduled_lease( krb_ticket ) &&
+                     ( renew_lease_request_.force() || is_ticket_in_renewal_window( krb_ticket ) ) )
+                {
+                    krb_cc_names.push_back( krb_ticket.krb_file_path );
+                }
+            }
+
+            if ( !renew_leases_async( krb_cc_names, RENEW_LEASE_TIMEOUT_SECS,
+                                      [this, krb_tickets,
+                                       krb_cc_names]( const std::set<std::string>& renewed,
+                                                      const std::set<std::string>& pending ) {
+                                          finish_renew_lease( krb_tickets, krb_cc_names, renewed,
+                                                              pending );
+                                      } ) )
+            {
+                std::string err_msg = "Error: lease renewal is not running";
+                std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                *status = grpc::Status( grpc::StatusCode::UNAVAILABLE, err_msg );
+            }
+        }
+
+        /**
+         * Reports the outcome of every ticket of the lease and finishes the call
+         * @param krb_tickets - tickets of the lease
+         * @param krb_cc_names - tickets asked for renewal
+         * @param renewed - tickets for which a new ticket was acquired
+         * @param pending - tickets whose renewal did not finish in time
+         */
+        void finish_renew_lease( const std::vector<krb_ticket_info_t>& krb_tickets,
+                                 const std::vector<std::string>& krb_cc_names,
+                                 const std::set<std::string>& renewed,
+                                 const std::set<std::string>& pending )
+        {
+            for ( auto& krb_ticket : krb_tickets )
+            {
+                const std::string& krb_cc_name = krb_ticket.krb_file_path;
+                credentialsfetcher::KerberosTicketRenewal* renewal =
+                    renew_lease_reply_.add_renewed_tickets();
+                renewal->set_krb_file_path( krb_cc_name );
+                renewal->set_credspec_arn( krb_ticket.credspec_info );
+                if ( !is_scheduled_lease( krb_ticket ) )
+                {
+                    // domainless user leases are renewed with the user's credentials
+                    renewal->set_status( "not renewable" );
+                }
+                else if ( std::find( krb_cc_names.begin(), krb_cc_names.end(), krb_cc_name ) ==
+                          krb_cc_names.end() )
+                {
+                    renewal->set_status( "not due" );
+                }
+                else if ( pending.count( krb_cc_name ) )
+                {
+                    // Still renewing, the renewal thread keeps the lease in its schedule
+                    renewal->set_status( "pending" );
+                }
+                else
+                {
+                    renewal->set_status( renewed.count( krb_cc_name ) ? "renewed" : "failed" );
+                }
+                set_granted_lifetime( krb_cc_name, renewal->mutable_granted_lifetime() );
+            }
+            renew_lease_responder_.Finish( renew_lease_reply_, grpc::Status::OK, this );
+        }
+
+        // The means of communication with the gRPC runtime for an asynchronous
+        // server.
+        credentialsfetcher::CredentialsFetcherService::AsyncService* service_;
+        // The producer-consumer queue where for asynchronous server notifications.
+        grpc::ServerCompletionQueue* cq_;
+        // Context for the rpc, allowing to tweak aspects of it such as the use
+        // of compression, authentication, as well as to send metadata back to the
+        // client.
+        grpc::ServerContext renew_lease_ctx_;
+
+        // What we get from the client.
+        credentialsfetcher::RenewLeaseRequest renew_lease_request_;
+        // What we send back to the client.
+        credentialsfetcher::RenewLeaseResponse renew_lease_reply_;
+
+        // The means to get back to the client.
+        grpc::ServerAsyncResponseWriter<credentialsfetcher::RenewLeaseResponse>
+            renew_lease_responder_;
+
+        // Let's implement a tiny state machine with the following states.
+        enum CallStatus
+        {
+            CREATE,
+            PROCESS,
+            FINISH
+        };
+        CallStatus status_; // The current serving state.
+    };
+
 #if AMAZON_LINUX_DISTRO
 
     // Class encompasing the state and logic needed to serve a request.
@@ -396,8 +734,8 @@ class CredentialsFetcherImpl final
                 new CallDataCreateKerberosArnLease( service_, cq_ );
                 // The actual processing.
                 std::string lease_id = "";
-                std::list<krb_ticket_info_t*> krb_ticket_info_list;
-                std::list<krb_ticket_arn_mapping_t*> krb_ticket_arn_mapping_list;
+                std::vector<krb_ticket_info_t> krb_ticket_info_list;
+                std::vector<krb_ticket_arn_mapping_t> krb_ticket_arn_mapping_list;
                 std::unordered_set<std::string> krb_ticket_dirs;
                 std::string accessId = create_arn_krb_request_.access_key_id();
                 std::string secretKey = create_arn_krb_request_.secret_access_key();
@@ -418,8 +756,8 @@ class CredentialsFetcherImpl final
                 {
                     for ( int i = 0; i < create_arn_krb_request_.credspec_arns_size(); i++ )
                     {
-                        krb_ticket_info_t* krb_ticket_info = new krb_ticket_info_t;
-                        krb_ticket_arn_mapping_t* krb_ticket_arns = new krb_ticket_arn_mapping_t;
+                        krb_ticket_info_t krb_ticket_info;
+                        krb_ticket_arn_mapping_t krb_ticket_arns;
 
                         std::string credspecarn = create_arn_krb_request_.credspec_arns( i );
                         if ( credspecarn.empty() )
@@ -481,9 +819,9 @@ class CredentialsFetcherImpl final
                                 std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
                                 break;
                             }
-                            krb_ticket_arns->credential_spec_arn = results[0];
+                            krb_ticket_arns.credential_spec_arn = results[0];
                             int parse_result = parse_cred_spec_domainless(
-                                response, krb_ticket_info, krb_ticket_arns );
+                                response, &krb_ticket_info, &krb_ticket_arns );
                             if ( parse_result != 0 )
                             {
                                 err_msg = "ERROR: invalid credentialspec fields";
@@ -491,11 +829,34 @@ class CredentialsFetcherImpl final
                                 break;
                             }
 
+                            if ( add_prefetch_spns(
+                                     std::vector<std::string>(
+                                         create_arn_krb_request_.prefetch_spns().begin(),
+                                         create_arn_krb_request_.prefetch_spns().end() ),
+                                     &krb_ticket_info ) != 0 )
+                            {
+                                err_msg = "ERROR: invalid prefetch_spns";
+                                std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                                break;
+                            }
+
+                            if ( set_ticket_lifetimes(
+                                     create_arn_krb_request_.ticket_lifetime_secs(),
+                                     create_arn_krb_request_.renew_lifetime_secs(),
+                                     &krb_ticket_info ) != 0 )
+                            {
+                                err_msg = "ERROR: invalid ticket lifetimes";
+                                std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                                break;
+                            }
+                            krb_ticket_info.keytab_output =
+                                create_arn_krb_request_.keytab_output();
+
                             // only add the ticket info if the parsing is successful
                             if ( parse_result == 0 )
                             {
                                 std::string secretsArn =
-                                    krb_ticket_arns->credential_domainless_user_arn;
+                                    krb_ticket_arns.credential_domainless_user_arn;
                                 if ( secretsArn.empty() )
                                 {
                                     err_msg = "ERROR: invalid secrets manager arn";
@@ -506,7 +867,7 @@ class CredentialsFetcherImpl final
                                 // retrieve domainless user credentials
                                 std::tuple<std::string, std::string, std::string, std::string>
                                     userCreds = retrieve_credspec_from_secrets_manager(
-                                        krb_ticket_arns->credential_domainless_user_arn, region,
+                                        krb_ticket_arns.credential_domainless_user_arn, region,
                                         creds );
 
                                 username = std::get<0>( userCreds );
@@ -532,10 +893,10 @@ class CredentialsFetcherImpl final
                                         // get taskid information
                                         lease_id = mountpath[0];
 
-                                        krb_ticket_info->krb_file_path = krb_files_path;
-                                        krb_ticket_info->domainless_user = username;
-                                        krb_ticket_arns->krb_file_path = krb_files_path;
-                                        krb_ticket_info->distinguished_name = distinguished_name;
+                                        krb_ticket_info.krb_file_path = krb_files_path;
+                                        krb_ticket_info.domainless_user = username;
+                                        krb_ticket_arns.krb_file_path = krb_files_path;
+                                        krb_ticket_info.distinguished_name = distinguished_name;
 
                                         // handle duplicate service accounts
                                         if ( !krb_ticket_dirs.count( krb_files_path ) )
@@ -597,7 +958,7 @@ class CredentialsFetcherImpl final
                 if ( err_msg.empty() && !isTest )
                 {
                     // create the kerberos tickets for the service accounts
-                    for ( auto krb_ticket : krb_ticket_info_list )
+                    for ( auto& krb_ticket : krb_ticket_info_list )
                     {
                         // invoke to get machine ticket
                         std::pair<int, std::string> status;
@@ -622,21 +983,21 @@ class CredentialsFetcherImpl final
                             break;
                         }
 
-                        std::string krb_file_path = krb_ticket->krb_file_path;
+                        std::string krb_file_path = krb_ticket.krb_file_path;
                         std::filesystem::create_directories( krb_file_path );
 
-                        std::string krb_ccname_str = krb_ticket->krb_file_path + "/krb5cc";
+                        std::string krb_ccname_str = krb_ticket.krb_file_path + "/krb5cc";
 
                         if ( !std::filesystem::exists( krb_ccname_str ) )
                         {
                             std::ofstream file( krb_ccname_str );
                             file.close();
 
-                            krb_ticket->krb_file_path = krb_ccname_str;
+                            krb_ticket.krb_file_path = krb_ccname_str;
                         }
 
                         std::pair<int, std::string> gmsa_ticket_result =
-                            fetch_gmsa_password_and_create_krb_ticket( domain, krb_ticket,
+                            fetch_gmsa_password_and_create_krb_ticket( domain, &krb_ticket,
                                                                        krb_ccname_str, cf_logger );
                         if ( gmsa_ticket_result.first != 0 )
                         {
@@ -670,9 +1031,9 @@ class CredentialsFetcherImpl final
                     secureClearString( secretKey );
 
                     // remove the directories on failure
-                    for ( auto krb_ticket : krb_ticket_info_list )
+                    for ( auto& krb_ticket : krb_ticket_info_list )
                     {
-                        std::filesystem::remove_all( krb_ticket->krb_file_path );
+                        std::filesystem::remove_all( krb_ticket.krb_file_path );
                     }
                     status_ = FINISH;
                     create_arn_krb_responder_.Finish(
@@ -683,13 +1044,15 @@ class CredentialsFetcherImpl final
                 {
                     if ( !isTest )
                     {
-                        for ( auto arn_mapping : krb_ticket_arn_mapping_list )
+                        for ( auto& arn_mapping : krb_ticket_arn_mapping_list )
                         {
                             credentialsfetcher::KerberosTicketArnResponse krb_ticket_response;
                             krb_ticket_response.set_credspec_arns(
-                                arn_mapping->credential_spec_arn );
+                                arn_mapping.credential_spec_arn );
                             krb_ticket_response.set_created_kerberos_file_paths(
-                                arn_mapping->krb_file_path );
+                                arn_mapping.krb_file_path );
+                            set_granted_lifetime( arn_mapping.krb_file_path + "/krb5cc",
+                                                  krb_ticket_response.mutable_granted_lifetime() );
                             create_arn_krb_reply_.add_krb_ticket_response_map()->CopyFrom(
                                 krb_ticket_response );
                         }
@@ -699,8 +1062,8 @@ class CredentialsFetcherImpl final
                         secureClearString( accessId );
                         secureClearString( sessionToken );
                         secureClearString( secretKey );
-                        // write the ticket information to meta data file
-                        write_meta_data_json( krb_ticket_info_list, lease_id, krb_files_dir );
+                        // register the lease, the registry records it in the lease store
+                        LeaseRegistry::instance().add_lease( lease_id, krb_ticket_info_list );
                     }
                     status_ = FINISH;
                     create_arn_krb_responder_.Finish( create_arn_krb_reply_, grpc::Status::OK,
@@ -861,104 +1224,129 @@ class CredentialsFetcherImpl final
                 if ( !accessId.empty() && !secretKey.empty() && !sessionToken.empty() &&
                      !region.empty() )
                 {
-                    std::vector<std::string> metadatafiles =
-                        get_meta_data_file_paths( krb_files_dir );
-                    for ( auto file_path : metadatafiles )
+                    Aws::Auth::AWSCredentials creds =
+                        get_credentials( accessId, secretKey, sessionToken );
+                    std::set<std::string> requested_paths(
+                        renew_krb_arn_request_.krb_file_paths().begin(),
+                        renew_krb_arn_request_.krb_file_paths().end() );
+                    for ( auto& krb_file_path : requested_paths )
                     {
-                        krb_ticket_info_t* krb_ticket_info = new krb_ticket_info_t;
-                        krb_ticket_arn_mapping_t* krb_ticket_arns = new krb_ticket_arn_mapping_t;
-                        std::list<krb_ticket_info_t*> krb_ticket_info_list =
-                            read_meta_data_json( file_path );
-                        // refresh the kerberos tickets for the service accounts, if tickets ready
-                        // for renewal
-                        for ( auto krb_ticket : krb_ticket_info_list )
+                        krb_ticket_info_t krb_ticket;
+                        if ( !LeaseRegistry::instance().get_ticket( krb_file_path, &krb_ticket ) ||
+                             krb_ticket.credspec_info.empty() )
                         {
-                            std::string credspec_info = krb_ticket->credspec_info;
-                            if ( !credspec_info.empty() )
+                            add_ticket_renewal( krb_file_path, "", "not found" );
+                        }
+                    }
+
+                    // only the tickets named in the request, or else the ones inside their
+                    // renewal window, are renewed; each credspec is fetched once and the
+                    // tickets are grouped by the secret of their domainless user, so each
+                    // secret is fetched and each user logs in once per call
+                    std::map<std::string, std::vector<krb_ticket_info_t>> tickets_by_secret;
+                    for ( auto& credspec_info : LeaseRegistry::instance().get_credspec_arns() )
+                    {
+                        std::vector<krb_ticket_info_t> krb_tickets;
+                        for ( auto& krb_ticket :
+                              LeaseRegistry::instance().find_by_credspec_arn( credspec_info ) )
+                        {
+                            if ( requested_paths.empty()
+                                     ? is_ticket_in_renewal_window( krb_ticket )
+                                     : requested_paths.count( krb_ticket.krb_file_path ) != 0 )
+                            {
+                                krb_tickets.push_back( krb_ticket );
+                            }
+                            else if ( requested_paths.empty() )
                             {
-                                // get credentialspec contents:
-                                Aws::Auth::AWSCredentials creds =
-                                    get_credentials( accessId, secretKey, sessionToken );
-                                std::string response = retrieve_credspec_from_s3(
-                                    credspec_info, region, creds, false );
+                                add_ticket_renewal( krb_ticket.krb_file_path, credspec_info,
+                                                    "not due" );
+                            }
+                        }
+                        if ( krb_tickets.empty() )
+                        {
+                            continue;
+                        }
 
-                                if ( response.empty() )
-                                {
-                                    err_msg = "ERROR: credentialspec cannot be retrieved from s3";
-                                    std::cerr << Util::getCurrentTime() << '\t' << err_msg
-                                              << std::endl;
-                                    break;
-                                }
+                        // get credentialspec contents:
+                        std::string response =
+                            retrieve_credspec_from_s3( credspec_info, region, creds, false );
 
-                                int parse_result = parse_cred_spec_domainless(
-                                    response, krb_ticket_info, krb_ticket_arns );
+                        if ( response.empty() )
+                        {
+                            err_msg = "ERROR: credentialspec cannot be retrieved from s3";
+                            std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                            add_ticket_renewals( krb_tickets, {} );
+                            continue;
+                        }
 
-                                if ( parse_result != 0 )
-                                {
-                                    err_msg = "ERROR: invalid credentialspec fields";
-                                    std::cerr << Util::getCurrentTime() << '\t' << err_msg
-                                              << std::endl;
-                                    break;
-                                }
+                        krb_ticket_info_t krb_ticket_info;
+                        krb_ticket_arn_mapping_t krb_ticket_arns;
+                        int parse_result =
+                            parse_cred_spec_domainless( response, &krb_ticket_info,
+                                                        &krb_ticket_arns );
 
-                                // only add the ticket info if the parsing is successful
-                                if ( parse_result == 0 )
-                                {
-                                    std::string secretsArn =
-                                        krb_ticket_arns->credential_domainless_user_arn;
-                                    if ( secretsArn.empty() )
-                                    {
-                                        err_msg = "ERROR: invalid secrets manager arn";
-                                        std::cerr << Util::getCurrentTime() << '\t' << err_msg
-                                                  << std::endl;
-                                        break;
-                                    }
+                        if ( parse_result != 0 )
+                        {
+                            err_msg = "ERROR: invalid credentialspec fields";
+                            std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                            add_ticket_renewals( krb_tickets, {} );
+                            continue;
+                        }
 
-                                    // retrieve domainless user credentials
-                                    std::tuple<std::string, std::string, std::string, std::string>
-                                        userCreds = retrieve_credspec_from_secrets_manager(
-                                            krb_ticket_arns->credential_domainless_user_arn, region,
-                                            creds );
+                        std::string secretsArn = krb_ticket_arns.credential_domainless_user_arn;
+                        if ( secretsArn.empty() )
+                        {
+                            err_msg = "ERROR: invalid secrets manager arn";
+                            std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                            add_ticket_renewals( krb_tickets, {} );
+                            continue;
+                        }
 
-                                    username = std::get<0>( userCreds );
-                                    password = std::get<1>( userCreds );
-                                    std::string domain = std::get<2>( userCreds );
-                                    // std::string distinguished_name = std::get<3>( userCreds );
+                        std::vector<krb_ticket_info_t>& secret_tickets =
+                            tickets_by_secret[secretsArn];
+                        secret_tickets.insert( secret_tickets.end(), krb_tickets.begin(),
+                                               krb_tickets.end() );
+                    }
 
-                                    if ( isValidDomain( domain ) &&
-                                         !contains_invalid_characters_in_ad_account_name(
-                                             username ) )
-                                    {
-                                        if ( !username.empty() && !password.empty() &&
-                                             !domain.empty() &&
-                                             username.length() < INPUT_CREDENTIALS_LENGTH &&
-                                             password.length() < INPUT_CREDENTIALS_LENGTH &&
-                                             domain.length() < DOMAIN_LENGTH )
-                                        {
-                                            std::string renewal_path = renew_gmsa_ticket(
-                                                krb_ticket, domain, username, password, cf_logger );
-                                        }
-                                        else
-                                        {
-                                            err_msg =
-                                                "ERROR: domainless AD user credentials is not "
-                                                "valid/ "
-                                                "credentials should not be more than 256 charaters";
-                                            std::cerr << Util::getCurrentTime() << '\t' << err_msg
-                                                      << std::endl;
-                                            break;
-                                        }
-                                    }
-                                    else
-                                    {
-                                        err_msg = "ERROR: invalid domainName/username";
-                                        std::cerr << Util::getCurrentTime() << '\t' << err_msg
-                                                  << std::endl;
-                                        break;
-                                    }
-                                }
-                            }
+                    for ( auto& secret : tickets_by_secret )
+                    {
+                        std::vector<krb_ticket_info_t>& krb_tickets = secret.second;
+
+                        // retrieve domainless user credentials
+                        std::tuple<std::string, std::string, std::string, std::string> userCreds =
+                            retrieve_credspec_from_secrets_manager( secret.first, region, creds );
+
+                        username = std::get<0>( userCreds );
+                        password = std::get<1>( userCreds );
+                        std::string domain = std::get<2>( userCreds );
+
+                        if ( !isValidDomain( domain ) ||
+                             contains_invalid_characters_in_ad_account_name( username ) )
+                        {
+                            err_msg = "ERROR: invalid domainName/username";
+                            std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                            add_ticket_renewals( krb_tickets, {} );
+                            continue;
+                        }
+                        if ( username.empty() || password.empty() || domain.empty() ||
+                             username.length() >= INPUT_CREDENTIALS_LENGTH ||
+                             password.length() >= INPUT_CREDENTIALS_LENGTH ||
+                             domain.length() >= DOMAIN_LENGTH )
+                        {
+                            err_msg = "ERROR: domainless AD user credentials is not valid/ "
+                                      "credentials should not be more than 256 charaters";
+                            std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                            add_ticket_renewals( krb_tickets, {} );
+                            continue;
                         }
+
+                        std::list<std::string> renewed_krb_ticket_paths =
+                            renew_gmsa_tickets( krb_tickets, domain, username, password, cf_logger );
+                        add_ticket_renewals( krb_tickets,
+                                             std::set<std::string>(
+                                                 renewed_krb_ticket_paths.begin(),
+                                                 renewed_krb_ticket_paths.end() ) );
+                        secureClearString( password );
                     }
                 }
                 else
@@ -1050,6 +1438,43 @@ class CredentialsFetcherImpl final
         }
 
       private:
+        /**
+         * Reports the outcome of the renewal of one ticket
+         * @param krb_file_path - lease ccache
+         * @param credspec_arn - credspec the lease was created from
+         * @param status - "renewed", "not due", "failed" or "not found"
+         */
+        void add_ticket_renewal( const std::string& krb_file_path,
+                                 const std::string& credspec_arn, const std::string& status )
+        {
+            credentialsfetcher::KerberosTicketRenewal* renewal =
+                renew_krb_arn_reply_.add_renewed_tickets();
+            renewal->set_krb_file_path( krb_file_path );
+            renewal->set_credspec_arn( credspec_arn );
+            renewal->set_status( status );
+            if ( status == "renewed" )
+            {
+                set_granted_lifetime( krb_file_path, renewal->mutable_granted_lifetime() );
+            }
+        }
+
+        /**
+         * Reports the outcome of the renewal of a group of tickets
+         * @param krb_tickets - tickets the renewal was attempted for
+         * @param renewed_krb_ticket_paths - ccache paths of the tickets that were renewed
+         */
+        void add_ticket_renewals( const std::vector<krb_ticket_info_t>& krb_tickets,
+                                  const std::set<std::string>& renewed_krb_ticket_paths )
+        {
+            for ( auto& krb_ticket : krb_tickets )
+            {
+                add_ticket_renewal( krb_ticket.krb_file_path, krb_ticket.credspec_info,
+                                    renewed_krb_ticket_paths.count( krb_ticket.krb_file_path )
+                                        ? "renewed"
+                                        : "failed" );
+            }
+        }
+
         // The means of communication with the gRPC runtime for an asynchronous
         // server.
         credentialsfetcher::CredentialsFetcherService::AsyncService* service_;
@@ -1136,16 +1561,16 @@ class CredentialsFetcherImpl final
                 new CallDataCreateKerberosLease( service_, cq_ );
                 // The actual processing.
                 std::string lease_id = generate_lease_id();
-                std::list<krb_ticket_info_t*> krb_ticket_info_list;
+                std::vector<krb_ticket_info_t> krb_ticket_info_list;
                 std::unordered_set<std::string> krb_ticket_dirs;
 
                 std::string err_msg;
                 create_krb_reply_.set_lease_id( lease_id );
                 for ( int i = 0; i < create_krb_request_.credspec_contents_size(); i++ )
                 {
-                    krb_ticket_info_t* krb_ticket_info = new krb_ticket_info_t;
+                    krb_ticket_info_t krb_ticket_info;
                     int parse_result = parse_cred_spec( create_krb_request_.credspec_contents( i ),
-                                                        krb_ticket_info );
+                                                        &krb_ticket_info );
 
                     if ( parse_result != 0 )
                     {
@@ -1154,13 +1579,33 @@ class CredentialsFetcherImpl final
                         break;
                     }
 
+                    if ( add_prefetch_spns(
+                             std::vector<std::string>( create_krb_request_.prefetch_spns().begin(),
+                                                       create_krb_request_.prefetch_spns().end() ),
+                             &krb_ticket_info ) != 0 )
+                    {
+                        err_msg = "ERROR: invalid prefetch_spns";
+                        std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                        break;
+                    }
+
+                    if ( set_ticket_lifetimes( create_krb_request_.ticket_lifetime_secs(),
+                                               create_krb_request_.renew_lifetime_secs(),
+                                               &krb_ticket_info ) != 0 )
+                    {
+                        err_msg = "ERROR: invalid ticket lifetimes";
+                        std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                        break;
+                    }
+                    krb_ticket_info.keytab_output = create_krb_request_.keytab_output();
+
                     // only add the ticket info if the parsing is successful
                     if ( parse_result == 0 )
                     {
                         std::string krb_files_path = krb_files_dir + "/" + lease_id + "/" +
-                                                     krb_ticket_info->service_account_name;
-                        krb_ticket_info->krb_file_path = krb_files_path;
-                        krb_ticket_info->domainless_user = "";
+                                                     krb_ticket_info.service_account_name;
+                        krb_ticket_info.krb_file_path = krb_files_path;
+                        krb_ticket_info.domainless_user = "";
 
                         // handle duplicate service accounts
                         if ( !krb_ticket_dirs.count( krb_files_path ) )
@@ -1179,21 +1624,21 @@ class CredentialsFetcherImpl final
                 if ( err_msg.empty() )
                 {
                     // create the kerberos tickets for the service accounts
-                    for ( auto krb_ticket : krb_ticket_info_list )
+                    for ( auto& krb_ticket : krb_ticket_info_list )
                     {
                         // invoke to get machine ticket
                         std::pair<int, std::string> status;
                         if ( aws_sm_secret_name.length() != 0 )
                         {
                             status = Util::generate_krb_ticket_using_secret_vault(
-                                krb_ticket->domain_name, aws_sm_secret_name, cf_logger );
-                            krb_ticket->domainless_user =
+                                krb_ticket.domain_name, aws_sm_secret_name, cf_logger );
+                            krb_ticket.domainless_user =
                                 "awsdomainlessusersecret:" + aws_sm_secret_name;
                         }
                         else
                         {
                             status = generate_krb_ticket_from_machine_keytab(
-                                krb_ticket->domain_name, cf_logger );
+                                krb_ticket.domain_name, cf_logger );
                         }
                         if ( status.first < 0 )
                         {
@@ -1204,7 +1649,7 @@ class CredentialsFetcherImpl final
                             break;
                         }
 
-                        std::string krb_file_path = krb_ticket->krb_file_path;
+                        std::string krb_file_path = krb_ticket.krb_file_path;
                         if ( std::filesystem::exists( krb_file_path ) )
                         {
                             cf_logger.logger( LOG_INFO,
@@ -1215,19 +1660,19 @@ class CredentialsFetcherImpl final
                         }
                         std::filesystem::create_directories( krb_file_path );
 
-                        std::string krb_ccname_str = krb_ticket->krb_file_path + "/krb5cc";
+                        std::string krb_ccname_str = krb_ticket.krb_file_path + "/krb5cc";
 
                         if ( !std::filesystem::exists( krb_ccname_str ) )
                         {
                             std::ofstream file( krb_ccname_str );
                             file.close();
 
-                            krb_ticket->krb_file_path = krb_ccname_str;
+                            krb_ticket.krb_file_path = krb_ccname_str;
                         }
 
                         std::pair<int, std::string> gmsa_ticket_result =
                             fetch_gmsa_password_and_create_krb_ticket(
-                                krb_ticket->domain_name, krb_ticket, krb_ccname_str, cf_logger );
+                                krb_ticket.domain_name, &krb_ticket, krb_ccname_str, cf_logger );
                         if ( gmsa_ticket_result.first != 0 )
                         {
                             err_msg = "ERROR: Cannot get gMSA krb ticket";
@@ -1245,6 +1690,8 @@ class CredentialsFetcherImpl final
                                       << std::endl;
                         }
                         create_krb_reply_.add_created_kerberos_file_paths( krb_file_path );
+                        set_granted_lifetime( krb_ccname_str,
+                                              create_krb_reply_.add_granted_lifetimes() );
                     }
                 }
                 // And we are done! Let the gRPC runtime know we've finished, using the
@@ -1253,9 +1700,9 @@ class CredentialsFetcherImpl final
                 if ( !err_msg.empty() )
                 {
                     // remove the directories on failure
-                    for ( auto krb_ticket : krb_ticket_info_list )
+                    for ( auto& krb_ticket : krb_ticket_info_list )
                     {
-                        std::filesystem::remove_all( krb_ticket->krb_file_path );
+                        std::filesystem::remove_all( krb_ticket.krb_file_path );
                     }
                     status_ = FINISH;
                     create_krb_responder_.Finish(
@@ -1264,8 +1711,8 @@ class CredentialsFetcherImpl final
                 }
                 else
                 {
-                    // write the ticket information to meta data file
-                    write_meta_data_json( krb_ticket_info_list, lease_id, krb_files_dir );
+                    // register the lease, the registry records it in the lease store
+                    LeaseRegistry::instance().add_lease( lease_id, krb_ticket_info_list );
                     status_ = FINISH;
                     create_krb_responder_.Finish( create_krb_reply_, grpc::Status::OK, this );
                 }
@@ -1415,7 +1862,7 @@ class CredentialsFetcherImpl final
                 new CallDataAddNonDomainJoinedKerberosLease( service_, cq_ );
                 // The actual processing.
                 std::string lease_id = generate_lease_id();
-                std::list<krb_ticket_info_t*> krb_ticket_info_list;
+                std::vector<krb_ticket_info_t> krb_ticket_info_list;
                 std::unordered_set<std::string> krb_ticket_dirs;
                 std::string username = create_domainless_krb_request_.username();
                 std::string password = create_domainless_krb_request_.password();
@@ -1444,11 +1891,11 @@ class CredentialsFetcherImpl final
                                 std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
                                 break;
                             }
-                            krb_ticket_info_t* krb_ticket_info = new krb_ticket_info_t;
+                            krb_ticket_info_t krb_ticket_info;
 
                             int parse_result = parse_cred_spec(
                                 create_domainless_krb_request_.credspec_contents( i ),
-                                krb_ticket_info );
+                                &krb_ticket_info );
 
                             if ( parse_result != 0 )
                             {
@@ -1457,13 +1904,36 @@ class CredentialsFetcherImpl final
                                 break;
                             }
 
+                            if ( add_prefetch_spns(
+                                     std::vector<std::string>(
+                                         create_domainless_krb_request_.prefetch_spns().begin(),
+                                         create_domainless_krb_request_.prefetch_spns().end() ),
+                                     &krb_ticket_info ) != 0 )
+                            {
+                                err_msg = "ERROR: invalid prefetch_spns";
+                                std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                                break;
+                            }
+
+                            if ( set_ticket_lifetimes(
+                                     create_domainless_krb_request_.ticket_lifetime_secs(),
+                                     create_domainless_krb_request_.renew_lifetime_secs(),
+                                     &krb_ticket_info ) != 0 )
+                            {
+                                err_msg = "ERROR: invalid ticket lifetimes";
+                                std::cerr << Util::getCurrentTime() << '\t' << err_msg << std::endl;
+                                break;
+                            }
+                            krb_ticket_info.keytab_output =
+                                create_domainless_krb_request_.keytab_output();
+
                             // only add the ticket info if the parsing is successful
                             if ( parse_result == 0 )
                             {
                                 std::string krb_files_path = krb_files_dir + "/" + lease_id + "/" +
-                                                             krb_ticket_info->service_account_name;
-                                krb_ticket_info->krb_file_path = krb_files_path;
-                                krb_ticket_info->domainless_user = username;
+                                                             krb_ticket_info.service_account_name;
+                                krb_ticket_info.krb_file_path = krb_files_path;
+                                krb_ticket_info.domainless_user = username;
 
                                 // handle duplicate service accounts
                                 if ( !krb_ticket_dirs.count( krb_files_path ) )
@@ -1496,7 +1966,7 @@ class CredentialsFetcherImpl final
                 if ( err_msg.empty() )
                 {
                     // create the kerberos tickets for the service accounts
-                    for ( auto krb_ticket : krb_ticket_info_list )
+                    for ( auto& krb_ticket : krb_ticket_info_list )
                     {
                         // invoke to get machine ticket
                         std::pair<int, std::string> status;
@@ -1521,7 +1991,7 @@ class CredentialsFetcherImpl final
                             break;
                         }
 
-                        std::string krb_file_path = krb_ticket->krb_file_path;
+                        std::string krb_file_path = krb_ticket.krb_file_path;
                         if ( std::filesystem::exists( krb_file_path ) )
                         {
                             cf_logger.logger( LOG_INFO,
@@ -1532,14 +2002,14 @@ class CredentialsFetcherImpl final
                         }
                         std::filesystem::create_directories( krb_file_path );
 
-                        std::string krb_ccname_str = krb_ticket->krb_file_path + "/krb5cc";
+                        std::string krb_ccname_str = krb_ticket.krb_file_path + "/krb5cc";
 
                         if ( !std::filesystem::exists( krb_ccname_str ) )
                         {
                             std::ofstream file( krb_ccname_str );
                             file.close();
 
-                            krb_ticket->krb_file_path = krb_ccname_str;
+                            krb_ticket.krb_file_path = krb_ccname_str;
                         }
 
                         std::string distinguished_name =
@@ -1548,16 +2018,16 @@ class CredentialsFetcherImpl final
                         {
                             // Read value from secrets manager
                             std::pair<int, std::string> v =
-                                Util::get_base_dn_from_secret( krb_ticket->credential_arn );
+                                Util::get_base_dn_from_secret( krb_ticket.credential_arn );
                             if ( v.first == 0 )
                             {
                                 distinguished_name = v.second;
                             }
                         }
-                        krb_ticket->distinguished_name = distinguished_name;
+                        krb_ticket.distinguished_name = distinguished_name;
 
                         std::pair<int, std::string> gmsa_ticket_result =
-                            fetch_gmsa_password_and_create_krb_ticket( domain, krb_ticket,
+                            fetch_gmsa_password_and_create_krb_ticket( domain, &krb_ticket,
                                                                        krb_ccname_str, cf_logger );
                         if ( gmsa_ticket_result.first != 0 )
                         {
@@ -1576,6 +2046,8 @@ class CredentialsFetcherImpl final
                         }
                         create_domainless_krb_reply_.add_created_kerberos_file_paths(
                             krb_file_path );
+                        set_granted_lifetime(
+                            krb_ccname_str, create_domainless_krb_reply_.add_granted_lifetimes() );
                     }
                 }
                 // And we are done! Let the gRPC runtime know we've finished, using the
@@ -1586,9 +2058,9 @@ class CredentialsFetcherImpl final
                     secureClearString( username );
                     secureClearString( password );
                     // remove the directories on failure
-                    for ( auto krb_ticket : krb_ticket_info_list )
+                    for ( auto& krb_ticket : krb_ticket_info_list )
                     {
-                        std::filesystem::remove_all( krb_ticket->krb_file_path );
+                        std::filesystem::remove_all( krb_ticket.krb_file_path );
                     }
                     status_ = FINISH;
                     handle_krb_responder_.Finish(
@@ -1599,8 +2071,8 @@ class CredentialsFetcherImpl final
                 {
                     secureClearString( username );
                     secureClearString( password );
-                    // write the ticket information to meta data file
-                    write_meta_data_json( krb_ticket_info_list, lease_id, krb_files_dir );
+                    // register the lease, the registry records it in the lease store
+                    LeaseRegistry::instance().add_lease( lease_id, krb_ticket_info_list );
                     status_ = FINISH;
                     handle_krb_responder_.Finish( create_domainless_krb_reply_, grpc::Status::OK,
                                                   this );
@@ -2094,6 +2566,8 @@ class CredentialsFetcherImpl final
         new CallDataRenewNonDomainJoinedKerberosLease( &service_, cq_.get() );
         new CallDataDeleteKerberosLease( &service_, cq_.get() );
         new CallDataHealthCheck( &service_, cq_.get() );
+        new CallDataGetRenewalForecast( &service_, cq_.get() );
+        new CallDataRenewLease( &service_, cq_.get() );
 
 #if AMAZON_LINUX_DISTRO
         new CallDataCreateKerberosArnLease( &service_, cq_.get() );
@@ -2120,6 +2594,8 @@ class CredentialsFetcherImpl final
             static_cast<CallDataDeleteKerberosLease*>( got_tag )->Proceed( krb_files_dir, cf_logger,
                                                                            aws_sm_secret_name );
             static_cast<CallDataHealthCheck*>( got_tag )->Proceed( cf_logger );
+            static_cast<CallDataGetRenewalForecast*>( got_tag )->Proceed();
+            static_cast<CallDataRenewLease*>( got_tag )->Proceed();
 
 #if AMAZON_LINUX_DISTRO
             static_cast<CallDataCreateKerberosArnLease*>( got_tag )->Proceed(
@@ -2221,6 +2697,155 @@ std::string generate_lease_id()
     return lease_id.str();
 }
 
+/**
+ * Adds SPNs whose service tickets are prefetched next to the TGT
+ * @param spns - Like 'MSSQLSvc/sql01.contoso.com:1433' or 'HTTP/web01.contoso.com@CONTOSO.COM'
+ * @param krb_ticket_info - ticket info to update
+ * @return - 0 on success, -1 if a SPN is malformed
+ */
+int add_prefetch_spns( const std::vector<std::string>& spns, krb_ticket_info_t* krb_ticket_info )
+{
+    for ( auto& spn : spns )
+    {
+        if ( spn.empty() || spn.length() > 256 || spn.find( '/' ) == std::string::npos ||
+             std::find_if( spn.begin(), spn.end(),
+                           []( unsigned char c ) {
+                               return !std::isalnum( c ) &&
+                                      std::string( "/:.-_@$" ).find( c ) == std::string::npos;
+                           } ) != spn.end() )
+        {
+            std::cerr << Util::getCurrentTime() << '\t' << "ERROR: invalid SPN " << spn
+                      << std::endl;
+            return -1;
+        }
+        if ( std::find( krb_ticket_info->prefetch_spns.begin(),
+                        krb_ticket_info->prefetch_spns.end(),
+                        spn ) == krb_ticket_info->prefetch_spns.end() )
+        {
+            krb_ticket_info->prefetch_spns.push_back( spn );
+        }
+    }
+    return 0;
+}
+
+/**
+ * Default TGT lifetime from the shell or /etc/ecs/ecs.config
+ * @param env_name - ENV_CF_TICKET_LIFETIME or ENV_CF_RENEW_LIFETIME
+ * @return - lifetime in seconds, 0 if not configured
+ */
+static uint32_t get_default_ticket_lifetime( const char* env_name )
+{
+    std::string value;
+    const char* env_value = getenv( env_name );
+    if ( env_value != nullptr )
+    {
+        value = env_value;
+    }
+    else
+    {
+        value = Util::retrieve_variable_from_ecs_config( env_name );
+    }
+    if ( value.empty() || value.length() > 10 ||
+         !std::all_of( value.begin(), value.end(), ::isdigit ) )
+    {
+        return 0;
+    }
+    return (uint32_t)std::min( std::stoull( value ), (unsigned long long)UINT32_MAX );
+}
+
+/**
+ * Sets the TGT lifetime and renewable lifetime of a lease
+ * Non-zero request values override the credspec, unset values fall back to the
+ * daemon defaults and then to krb5.conf.
+ * The lifetime must leave room for the renewal window, otherwise the ticket would be
+ * renewed on every pass of the renewal thread.
+ *
+ * @param ticket_lifetime - requested lifetime in seconds, 0 if not requested
+ * @param renew_lifetime - requested renewable lifetime in seconds, 0 if not requested
+ * @param krb_ticket_info - ticket info to update
+ * @return - 0 on success, -1 if the lifetimes are out of range
+ */
+int set_ticket_lifetimes( uint32_t ticket_lifetime, uint32_t renew_lifetime,
+                          krb_ticket_info_t* krb_ticket_info )
+{
+    if ( ticket_lifetime > 0 )
+    {
+        krb_ticket_info->ticket_lifetime = ticket_lifetime;
+    }
+    if ( renew_lifetime > 0 )
+    {
+        krb_ticket_info->renew_lifetime = renew_lifetime;
+    }
+    if ( krb_ticket_info->ticket_lifetime == 0 )
+    {
+        krb_ticket_info->ticket_lifetime = get_default_ticket_lifetime( ENV_CF_TICKET_LIFETIME );
+    }
+    if ( krb_ticket_info->renew_lifetime == 0 )
+    {
+        krb_ticket_info->renew_lifetime = get_default_ticket_lifetime( ENV_CF_RENEW_LIFETIME );
+    }
+
+    uint32_t min_lifetime = 2 * RENEW_TICKET_HOURS * SECONDS_IN_HOUR;
+    if ( krb_ticket_info->ticket_lifetime != 0 &&
+         ( krb_ticket_info->ticket_lifetime < min_lifetime ||
+           krb_ticket_info->ticket_lifetime > MAX_TICKET_LIFETIME_SECS ) )
+    {
+        std::cerr << Util::getCurrentTime() << '\t' << "ERROR: ticket lifetime "
+                  << krb_ticket_info->ticket_lifetime << "s is not between " << min_lifetime
+                  << "s and " << MAX_TICKET_LIFETIME_SECS << "s" << std::endl;
+        return -1;
+    }
+    if ( krb_ticket_info->renew_lifetime != 0 &&
+         ( krb_ticket_info->renew_lifetime < krb_ticket_info->ticket_lifetime ||
+           krb_ticket_info->renew_lifetime > MAX_TICKET_LIFETIME_SECS ) )
+    {
+        std::cerr << Util::getCurrentTime() << '\t' << "ERROR: renewable lifetime "
+                  << krb_ticket_info->renew_lifetime << "s is shorter than the ticket lifetime"
+                  << " or longer than " << MAX_TICKET_LIFETIME_SECS << "s" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads the optional lifetime extension of the credspec
+ * "ActiveDirectoryConfig": { "TicketLifetimeSeconds": 36000, "RenewableLifetimeSeconds": 604800 }
+ * @param root - parsed credspec
+ * @param krb_ticket_info - ticket info to update
+ */
+static void parse_cred_spec_ticket_lifetimes( const Json::Value& root,
+                                              krb_ticket_info_t* krb_ticket_info )
+{
+    const Json::Value& ad_config = root["ActiveDirectoryConfig"];
+    if ( ad_config.isMember( "TicketLifetimeSeconds" ) )
+    {
+        krb_ticket_info->ticket_lifetime = ad_config["TicketLifetimeSeconds"].asUInt();
+    }
+    if ( ad_config.isMember( "RenewableLifetimeSeconds" ) )
+    {
+        krb_ticket_info->renew_lifetime = ad_config["RenewableLifetimeSeconds"].asUInt();
+    }
+}
+
+/**
+ * Reads the optional credentials-fetcher extension of the credspec
+ * "ActiveDirectoryConfig": { "PrefetchServicePrincipalNames": [ "MSSQLSvc/sql01:1433" ] }
+ * @param root - parsed credspec
+ * @param krb_ticket_info - ticket info to update
+ * @return - 0 on success, -1 if a SPN is malformed
+ */
+static int parse_cred_spec_prefetch_spns( const Json::Value& root,
+                                          krb_ticket_info_t* krb_ticket_info )
+{
+    std::vector<std::string> spns;
+    for ( const Json::Value& spn :
+          root["ActiveDirectoryConfig"]["PrefetchServicePrincipalNames"] )
+    {
+        spns.push_back( spn.asString() );
+    }
+    return add_prefetch_spns( spns, krb_ticket_info );
+}
+
 /**
  * This function parses the cred spec file.
  * The cred spec file is in json format.
@@ -2276,6 +2901,11 @@ int parse_cred_spec( std::string credspec_data, krb_ticket_info_t* krb_ticket_in
         krb_ticket_info->domain_name = domain_name;
         krb_ticket_info->service_account_name = service_account_name;
         krb_ticket_info->credential_arn = credential_arn;
+        if ( parse_cred_spec_prefetch_spns( root, krb_ticket_info ) != 0 )
+        {
+            return -1;
+        }
+        parse_cred_spec_ticket_lifetimes( root, krb_ticket_info );
     }
     catch ( ... )
     {
@@ -2353,6 +2983,11 @@ int parse_cred_spec_domainless( std::string credspec_data, krb_ticket_info_t* kr
         krb_ticket_info->domain_name = domain_name;
         krb_ticket_info->service_account_name = service_account_name;
         krb_ticket_info->credspec_info = krb_ticket_mapping->credential_spec_arn;
+        if ( parse_cred_spec_prefetch_spns( root, krb_ticket_info ) != 0 )
+        {
+            return -1;
+        }
+        parse_cred_spec_ticket_lifetimes( root, krb_ticket_info );
 
         krb_ticket_mapping->credential_domainless_user_arn = domainless_user_arn;
         krb_ticket_mapping->krb_file_path = krb_ticket_info->krb_file_path;
@@ -2413,17 +3048,17 @@ int ProcessCredSpecFile( std::string krb_files_dir, std::string credspec_filepat
         return EXIT_FAILURE;
     }
 
-    krb_ticket_info_t* krb_ticket_info = new krb_ticket_info_t;
-    int parse_result = parse_cred_spec( credspec_contents, krb_ticket_info );
+    krb_ticket_info_t krb_ticket_info;
+    int parse_result = parse_cred_spec( credspec_contents, &krb_ticket_info );
 
     // only add the ticket info if the parsing is successful
     if ( parse_result == EXIT_SUCCESS )
     {
         std::string krb_files_path =
-            krb_files_dir + "/" + cred_file_lease_id + "/" + krb_ticket_info->service_account_name;
-        krb_ticket_info->krb_file_path = krb_files_path;
-        krb_ticket_info->domainless_user = "";
-        krb_ticket_info->credspec_info = "";
+            krb_files_dir + "/" + cred_file_lease_id + "/" + krb_ticket_info.service_account_name;
+        krb_ticket_info.krb_file_path = krb_files_path;
+        krb_ticket_info.domainless_user = "";
+        krb_ticket_info.credspec_info = "";
     }
     else
     {
@@ -2435,16 +3070,15 @@ int ProcessCredSpecFile( std::string krb_files_dir, std::string credspec_filepat
     {
         std::pair<int, std::string> status;
         // invoke to get machine ticket
-        status = generate_krb_ticket_from_machine_keytab( krb_ticket_info->domain_name, cf_logger );
+        status = generate_krb_ticket_from_machine_keytab( krb_ticket_info.domain_name, cf_logger );
         if ( status.first < 0 )
         {
-            cf_logger.logger( LOG_ERR, "Error %d: Cannot get machine krb ticket", status );
-            delete krb_ticket_info;
+            cf_logger.logger( LOG_ERR, "Error %d: Cannot get machine krb ticket", status.first );
 
             return EXIT_FAILURE;
         }
 
-        std::string krb_file_path = krb_ticket_info->krb_file_path;
+        std::string krb_file_path = krb_ticket_info.krb_file_path;
         if ( std::filesystem::exists( krb_file_path ) )
         {
             cf_logger.logger( LOG_INFO, "Deleting existing credential file directory %s",
@@ -2454,18 +3088,18 @@ int ProcessCredSpecFile( std::string krb_files_dir, std::string credspec_filepat
         }
         std::filesystem::create_directories( krb_file_path );
 
-        std::string krb_ccname_str = krb_ticket_info->krb_file_path + "/krb5cc";
+        std::string krb_ccname_str = krb_ticket_info.krb_file_path + "/krb5cc";
 
         if ( !std::filesystem::exists( krb_ccname_str ) )
         {
             std::ofstream file( krb_ccname_str );
             file.close();
 
-            krb_ticket_info->krb_file_path = krb_ccname_str;
+            krb_ticket_info.krb_file_path = krb_ccname_str;
         }
 
         std::pair<int, std::string> gmsa_ticket_result = fetch_gmsa_password_and_create_krb_ticket(
-            krb_ticket_info->domain_name, krb_ticket_info, krb_ccname_str, cf_logger );
+            krb_ticket_info.domain_name, &krb_ticket_info, krb_ccname_str, cf_logger );
         if ( gmsa_ticket_result.first != 0 )
         {
             err_msg = "ERROR: Cannot get gMSA krb ticket";
@@ -2488,19 +3122,16 @@ int ProcessCredSpecFile( std::string krb_files_dir, std::string credspec_filepat
     if ( !err_msg.empty() )
     {
         // remove the directory on failure
-        std::filesystem::remove_all( krb_ticket_info->krb_file_path );
+        std::filesystem::remove_all( krb_ticket_info.krb_file_path );
 
         std::cerr << err_msg << std::endl;
         cf_logger.logger( LOG_ERR, "%s", err_msg.c_str() );
-        delete krb_ticket_info;
 
         return EXIT_FAILURE;
     }
 
-    // write the ticket information to meta data file
-    write_meta_data_json( krb_ticket_info, cred_file_lease_id, krb_files_dir );
-
-    delete krb_ticket_info;
+    // register the lease, the registry records it in the lease store
+    LeaseRegistry::instance().add_lease( cred_file_lease_id, { krb_ticket_info } );
 
     return EXIT_SUCCESS;
 }
@@ -271,6 +271,11 @@ class CredentialsFetcherClient
             std::string msg =
                         "Renewal of ticket for gMSA " + response.status();
                 std::cout << msg << std::endl;
+            for ( int i = 0; i < response.renewed_tickets_size(); i++ )
+            {
+                std::cout << response.renewed_tickets( i ).krb_file_path() << " "
+                          << response.renewed_tickets( i ).status() << std::endl;
+            }
             result =
                     std::pair<std::string, std::string>( "RPC OK", response.status() );
         }
@@ -370,6 +375,88 @@ class CredentialsFetcherClient
         }
     }
 
+    /**
+     * Test method to forecast the renewal load
+     * @param hours - forecast horizon, 0 for the default
+     * @return - one line per hour, domain and domain controller
+     */
+    std::list<std::string> GetRenewalForecastMethod( uint32_t hours )
+    {
+        std::list<std::string> forecast;
+        // Prepare request
+        credentialsfetcher::RenewalForecastRequest request;
+        request.set_hours( hours );
+
+        credentialsfetcher::RenewalForecastResponse response;
+        grpc::ClientContext context;
+        grpc::Status status;
+
+        // Send request
+        status = _stub->GetRenewalForecast( &context, request, &response );
+
+        // Handle response
+        if ( !status.ok() )
+        {
+            std::cerr << status.error_code() << ": " << status.error_message() << std::endl;
+            return forecast;
+        }
+        for ( int i = 0; i < response.buckets_size(); i++ )
+        {
+            const credentialsfetcher::RenewalForecastBucket& bucket = response.buckets( i );
+            time_t bucket_start = (time_t)bucket.bucket_start();
+            char hour[32] = { 0 };
+            strftime( hour, sizeof( hour ), "%Y-%m-%d %H:00", localtime( &bucket_start ) );
+            std::string msg = std::string( hour ) + "\t" + bucket.domain() + "\t" +
+                              bucket.domain_controller() +
+                              "\trenewals=" + std::to_string( bucket.renewals() ) +
+                              "\tldap=" + std::to_string( bucket.ldap_operations() ) +
+                              "\tkdc=" + std::to_string( bucket.kdc_operations() );
+            forecast.push_back( msg );
+            std::cout << msg << std::endl;
+        }
+        return forecast;
+    }
+
+    /**
+     * Test method to renew the tickets of one lease
+     * @param lease_id - lease to renew
+     * @param force - renew tickets that are not yet due
+     * @return - one line per ticket with its status and expiry
+     */
+    std::list<std::string> RenewLeaseMethod( std::string lease_id, bool force )
+    {
+        std::list<std::string> renewals;
+        // Prepare request
+        credentialsfetcher::RenewLeaseRequest request;
+        request.set_lease_id( lease_id );
+        request.set_force( force );
+
+        credentialsfetcher::RenewLeaseResponse response;
+        grpc::ClientContext context;
+        grpc::Status status;
+
+        // Send request
+        status = _stub->RenewLease( &context, request, &response );
+
+        // Handle response
+        if ( !status.ok() )
+        {
+            std::cerr << status.error_code() << ": " << status.error_message() << std::endl;
+            return renewals;
+        }
+        for ( int i = 0; i < response.renewed_tickets_size(); i++ )
+        {
+            const credentialsfetcher::KerberosTicketRenewal& renewal =
+                response.renewed_tickets( i );
+            std::string msg = renewal.krb_file_path() + "\t" + renewal.status() +
+                              "\tendtime=" +
+                              std::to_string( renewal.granted_lifetime().endtime() );
+            renewals.push_back( msg );
+            std::cout << msg << std::endl;
+        }
+        return renewals;
+    }
+
   private:
     std::unique_ptr<credentialsfetcher::CredentialsFetcherService::Stub> _stub;
 };
@@ -395,6 +482,10 @@ static void show_usage( std::string name )
             << "\t --renew_kerberos_tickets_arn \t\t create tickets by getting credspecs from s3 "
                " gMSA \tprovide"
                "accessId, secretkey, sessionToken, region"
+              << "\t --renewal_forecast \t\thourly renewal load per domain controller\t"
+                 "optionally provide the hours to forecast, default 24\n"
+              << "\t --renew_lease \t\trenew the tickets of a lease\tprovide lease_id, "
+                 "optionally force\n"
               << "\t --invalidargs \t\ttest with invalid args, failure scenario\n"
               << "\t --run_stress_test \t\tstress test with multiple accounts and leases\n"
               << "\t --run_perf_test \t\tperf test with multiple accounts and leases\n"
@@ -622,13 +713,11 @@ int run_perf_test( CredentialsFetcherClient& client, int num_of_leases,
 // unit tests
 bool parse_credspec_domainless_test(std::string credspec)
 {
-    krb_ticket_info_t* krb_ticket_info =
-                new krb_ticket_info_t;
-    krb_ticket_arn_mapping_t* krb_ticket_arn_mapping  =
-                new krb_ticket_arn_mapping_t;
-    int response = parse_cred_spec_domainless(credspec, krb_ticket_info, krb_ticket_arn_mapping );
-    std::cout << krb_ticket_arn_mapping->credential_spec_arn;
-    std::cout << krb_ticket_arn_mapping->krb_file_path;
+    krb_ticket_info_t krb_ticket_info;
+    krb_ticket_arn_mapping_t krb_ticket_arn_mapping;
+    int response = parse_cred_spec_domainless(credspec, &krb_ticket_info, &krb_ticket_arn_mapping );
+    std::cout << krb_ticket_arn_mapping.credential_spec_arn;
+    std::cout << krb_ticket_arn_mapping.krb_file_path;
     if(response == 0)
     {
        return true;
@@ -871,6 +960,32 @@ int main( int argc, char** argv )
                 create_krb_ticket( client, credspec_contents );
             }
         }
+        else if ( arg == "--renewal_forecast" )
+        {
+            uint32_t hours = 0;
+            if ( i + 1 < argc )
+            {
+                hours = (uint32_t)atoi( argv[i + 1] );
+                i++;
+            }
+            client.GetRenewalForecastMethod( hours );
+        }
+        else if ( arg == "--renew_lease" )
+        {
+            if ( i + 1 >= argc )
+            {
+                std::cout << "--renew_lease option requires lease_id argument." << std::endl;
+                return 0;
+            }
+            std::string lease_id = argv[i + 1];
+            i++;
+            bool force = i + 1 < argc && std::string( argv[i + 1] ) == "force";
+            if ( force )
+            {
+                i++;
+            }
+            client.RenewLeaseMethod( lease_id, force );
+        }
         else if ( arg == "--invalidargs" )
         {
             std::cout << "test for invalid args" << std::endl;
@@ -0,0 +1,238 @@
+#include "daemon.h"
+#include <map>
+#include <mutex>
+
+/**
+ * PA-ETYPE-INFO2 cache
+ *
+ * An AS-REQ without pre-authentication is answered with KDC_ERR_PREAUTH_REQUIRED,
+ * whose only purpose is to tell the client the enctype, salt and s2kparams of its
+ * long-term key. The etype info selected for a principal is remembered here so that
+ * later AS-REQs for the same principal carry PA-ENC-TIMESTAMP right away and
+ * complete in one round trip.
+ *
+ * MIT krb5 does not expose the selected etype info, it is picked up from the
+ *     Selected etype info: etype aes256-cts, salt "...", params "..."
+ * trace message of the exchange.
+ */
+#define ETYPE_INFO_TRACE_PREFIX "Selected etype info: etype "
+#define ETYPE_INFO_TRACE_SALT ", salt \""
+#define ETYPE_INFO_TRACE_PARAMS "\", params \""
+
+// s2kparams of the AES enctypes with the default 4096 PBKDF2 iterations
+static const std::string default_aes_s2kparams( "\x00\x00\x10\x00", 4 );
+
+typedef struct etype_info_exchange_t_
+{
+    std::string principal_name;
+    bool applied = false;
+    // Backing storage of the pointers handed to krb5_get_init_creds_opt
+    etype_info_t cached;
+    krb5_data salt_data;
+    krb5_enctype etypes[3];
+    krb5_preauthtype preauth_types[1];
+    // Filled in by the trace callback
+    etype_info_t selected;
+} etype_info_exchange_t;
+
+static std::mutex etype_info_cache_mutex;
+static std::map<std::string, etype_info_t> etype_info_cache;
+
+/**
+ * Undoes the printable escaping of krb5 trace messages
+ * @param escaped - data with non-printable bytes as '\xNN'
+ * @return - raw bytes
+ */
+static std::string unescape_trace_data( const std::string& escaped )
+{
+    std::string data;
+    for ( size_t i = 0; i < escaped.length(); i++ )
+    {
+        if ( escaped[i] == '\\' && i + 3 < escaped.length() && escaped[i + 1] == 'x' &&
+             isxdigit( (unsigned char)escaped[i + 2] ) &&
+             isxdigit( (unsigned char)escaped[i + 3] ) )
+        {
+            data += (char)std::stoi( escaped.substr( i + 2, 2 ), nullptr, 16 );
+            i += 3;
+        }
+        else
+        {
+            data += escaped[i];
+        }
+    }
+    return data;
+}
+
+/**
+ * Parses the etype info selected by the krb5 library for an AS exchange
+ * @param message - krb5 trace message
+ * @param etype_info - receives enctype, salt and s2kparams
+ * @return - true if the message is a 'Selected etype info' trace
+ */
+bool parse_etype_info_trace( const std::string& message, etype_info_t* etype_info )
+{
+    size_t etype_pos = message.find( ETYPE_INFO_TRACE_PREFIX );
+    if ( etype_pos == std::string::npos )
+    {
+        return false;
+    }
+    etype_pos += strlen( ETYPE_INFO_TRACE_PREFIX );
+    size_t salt_pos = message.find( ETYPE_INFO_TRACE_SALT, etype_pos );
+    size_t params_pos = message.rfind( ETYPE_INFO_TRACE_PARAMS );
+    size_t end_pos = message.rfind( '"' );
+    if ( salt_pos == std::string::npos || params_pos == std::string::npos ||
+         params_pos < salt_pos || end_pos < params_pos + strlen( ETYPE_INFO_TRACE_PARAMS ) )
+    {
+        return false;
+    }
+
+    // Enctypes are traced by name, unknown ones by number
+    std::string etype_name = message.substr( etype_pos, salt_pos - etype_pos );
+    krb5_enctype etype = ENCTYPE_NULL;
+    if ( krb5_string_to_enctype( (char*)etype_name.c_str(), &etype ) != 0 )
+    {
+        char* end = nullptr;
+        etype = (krb5_enctype)strtol( etype_name.c_str(), &end, 10 );
+        if ( end == etype_name.c_str() || *end != '\0' )
+        {
+            return false;
+        }
+    }
+
+    salt_pos += strlen( ETYPE_INFO_TRACE_SALT );
+    size_t salt_end_pos = params_pos;
+    params_pos += strlen( ETYPE_INFO_TRACE_PARAMS );
+    etype_info->etype = etype;
+    etype_info->salt = unescape_trace_data( message.substr( salt_pos, salt_end_pos - salt_pos ) );
+    etype_info->s2kparams =
+        unescape_trace_data( message.substr( params_pos, end_pos - params_pos ) );
+    return true;
+}
+
+static void KRB5_CALLCONV etype_info_trace_callback( krb5_context context,
+                                                     const krb5_trace_info* info, void* cb_data )
+{
+    if ( info == nullptr || info->message == nullptr || cb_data == nullptr )
+    {
+        return;
+    }
+    etype_info_exchange_t* exchange = (etype_info_exchange_t*)cb_data;
+    parse_etype_info_trace( info->message, &exchange->selected );
+}
+
+/**
+ * Looks up the etype info learnt for a principal
+ * @param principal_name - Like 'webapp01$@CONTOSO.COM'
+ * @param etype_info - receives the cached etype info
+ * @return - true on cache hit
+ */
+bool get_cached_etype_info( const std::string& principal_name, etype_info_t* etype_info )
+{
+    std::lock_guard<std::mutex> lock( etype_info_cache_mutex );
+    auto it = etype_info_cache.find( principal_name );
+    if ( it == etype_info_cache.end() )
+    {
+        return false;
+    }
+    *etype_info = it->second;
+    return true;
+}
+
+/**
+ * Forgets the etype info of a principal, e.g. after its key was reset
+ * @param principal_name - Like 'webapp01$@CONTOSO.COM'
+ */
+void invalidate_cached_etype_info( const std::string& principal_name )
+{
+    std::lock_guard<std::mutex> lock( etype_info_cache_mutex );
+    etype_info_cache.erase( principal_name );
+}
+
+/**
+ * Prepares an AS exchange: pre-authenticates the first AS-REQ with the cached etype
+ * info of the principal and starts capturing the etype info the exchange selects.
+ * Must be paired with cf_etype_info_end() after krb5_get_init_creds_*().
+ *
+ * @param context - krb5 context of the exchange
+ * @param principal - client principal
+ * @param opts - options of the exchange, must outlive the exchange
+ * @return - exchange state
+ */
+extern "C" void* cf_etype_info_begin( krb5_context context, krb5_const_principal principal,
+                                      krb5_get_init_creds_opt* opts )
+{
+    etype_info_exchange_t* exchange = new etype_info_exchange_t;
+    char* principal_name = nullptr;
+    if ( krb5_unparse_name( context, principal, &principal_name ) == 0 )
+    {
+        exchange->principal_name = principal_name;
+        krb5_free_unparsed_name( context, principal_name );
+    }
+
+    // The salt can be forced but not the s2kparams, so only default iteration counts
+    if ( opts != nullptr && !exchange->principal_name.empty() &&
+         get_cached_etype_info( exchange->principal_name, &exchange->cached ) &&
+         ( exchange->cached.s2kparams.empty() ||
+           exchange->cached.s2kparams == default_aes_s2kparams ) )
+    {
+        int num_etypes = 0;
+        exchange->etypes[num_etypes++] = exchange->cached.etype;
+        for ( krb5_enctype etype :
+              { ENCTYPE_AES256_CTS_HMAC_SHA1_96, ENCTYPE_AES128_CTS_HMAC_SHA1_96 } )
+        {
+            if ( etype != exchange->cached.etype )
+            {
+                exchange->etypes[num_etypes++] = etype;
+            }
+        }
+        exchange->salt_data.magic = 0;
+        exchange->salt_data.data = (char*)exchange->cached.salt.data();
+        exchange->salt_data.length = (unsigned int)exchange->cached.salt.length();
+        exchange->preauth_types[0] = KRB5_PADATA_ENC_TIMESTAMP;
+
+        krb5_get_init_creds_opt_set_etype_list( opts, exchange->etypes, num_etypes );
+        krb5_get_init_creds_opt_set_salt( opts, &exchange->salt_data );
+        krb5_get_init_creds_opt_set_preauth_list( opts, exchange->preauth_types, 1 );
+        exchange->applied = true;
+    }
+
+    krb5_set_trace_callback( context, etype_info_trace_callback, exchange );
+    return exchange;
+}
+
+/**
+ * Completes an AS exchange started with cf_etype_info_begin(), the etype info the
+ * KDC advertised is cached on success
+ * @param context - krb5 context of the exchange
+ * @param state - from cf_etype_info_begin(), freed
+ * @param ret - result of krb5_get_init_creds_*()
+ * @return - 1 if the exchange failed on stale cached etype info and should be repeated
+ */
+extern "C" int cf_etype_info_end( krb5_context context, void* state, krb5_error_code ret )
+{
+    krb5_set_trace_callback( context, nullptr, nullptr );
+    etype_info_exchange_t* exchange = (etype_info_exchange_t*)state;
+    if ( exchange == nullptr )
+    {
+        return 0;
+    }
+
+    int retry = 0;
+    if ( ret == 0 && exchange->selected.etype != ENCTYPE_NULL &&
+         !exchange->principal_name.empty() )
+    {
+        std::lock_guard<std::mutex> lock( etype_info_cache_mutex );
+        etype_info_cache[exchange->principal_name] = exchange->selected;
+    }
+    else if ( ret != 0 && exchange->applied &&
+              ( ret == KRB5KDC_ERR_PREAUTH_FAILED || ret == KRB5KDC_ERR_ETYPE_NOSUPP ||
+                ret == KRB5KRB_AP_ERR_BAD_INTEGRITY ) )
+    {
+        // Salt or enctype changed, e.g. account renamed or keys reset
+        invalidate_cached_etype_info( exchange->principal_name );
+        retry = 1;
+    }
+
+    delete exchange;
+    return retry;
+}
@@ -0,0 +1,479 @@
+#include "daemon.h"
+#include "secure_arena.hpp"
+#include "util.hpp"
+#include <map>
+#include <mutex>
+#include <openssl/rand.h>
+
+/**
+ * Long-term keys derived from a gMSA password, one MEMORY: keytab per principal.
+ * string-to-key for the AES enctypes runs PBKDF2 with 4096 iterations, so the keytab
+ * is only rebuilt when the password generation reported by GmsaPasswordCache changes.
+ */
+typedef struct gmsa_keytab_t_
+{
+    uint64_t password_generation = 0;
+    std::string keytab_name;
+    krb5_keytab keytab = nullptr;
+} gmsa_keytab_t;
+
+static std::mutex gmsa_keytab_mutex;
+// Holds one handle to every cached keytab so that MEMORY: keytabs stay alive
+static krb5_context gmsa_keytab_context = nullptr;
+static std::map<std::string, gmsa_keytab_t> gmsa_keytabs;
+
+// Password generation last written to each lease keytab file
+static std::map<std::string, uint64_t> gmsa_keytab_file_generations;
+
+static const krb5_enctype gmsa_keytab_enctypes[] = { ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+                                                     ENCTYPE_AES128_CTS_HMAC_SHA1_96 };
+
+/**
+ * AD salt for computer and managed service accounts
+ * @param gmsa_account_name - Like 'webapp01'
+ * @param domain_name - Like 'contoso.com'
+ * @return - Like 'CONTOSO.COMhostwebapp01.contoso.com'
+ */
+std::string get_gmsa_default_salt( std::string gmsa_account_name, std::string domain_name )
+{
+    std::string realm_name = domain_name;
+    std::transform( realm_name.begin(), realm_name.end(), realm_name.begin(),
+                    []( unsigned char c ) { return std::toupper( c ); } );
+    std::transform( gmsa_account_name.begin(), gmsa_account_name.end(),
+                    gmsa_account_name.begin(),
+                    []( unsigned char c ) { return std::tolower( c ); } );
+    std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
+                    []( unsigned char c ) { return std::tolower( c ); } );
+    return realm_name + "host" + gmsa_account_name + "." + domain_name;
+}
+
+/**
+ * Derives the AES keys of a gMSA password into a MEMORY: keytab
+ * @param context - krb5 context
+ * @param principal - gMSA principal
+ * @param gmsa_password - GMSA_PASSWORD_SIZE bytes of UTF-16 password
+ * @param etype_info - salt and s2kparams of the principal, an empty s2kparams means default
+ * @param keytab_name - Like 'MEMORY:...'
+ * @param keytab - opened keytab, on success
+ * @return - 0 on success, krb5 error code otherwise
+ */
+static krb5_error_code create_gmsa_keytab( krb5_context context, krb5_principal principal,
+                                           const uint8_t* gmsa_password,
+                                           const etype_info_t& etype_info,
+                                           const std::string& keytab_name, krb5_keytab* keytab )
+{
+    SecureArena& arena = SecureArena::instance();
+    uint8_t* utf8_password = (uint8_t*)arena.allocate( 3 * GMSA_PASSWORD_SIZE / 2 );
+    if ( utf8_password == nullptr )
+    {
+        return ENOMEM;
+    }
+    krb5_data password_data;
+    password_data.magic = 0;
+    password_data.data = (char*)utf8_password;
+    password_data.length =
+        (unsigned int)Util::utf16le_to_utf8( gmsa_password, GMSA_PASSWORD_SIZE, utf8_password );
+
+    krb5_data salt_data;
+    salt_data.magic = 0;
+    salt_data.data = (char*)etype_info.salt.c_str();
+    salt_data.length = (unsigned int)etype_info.salt.length();
+
+    krb5_data s2kparams_data;
+    s2kparams_data.magic = 0;
+    s2kparams_data.data = (char*)etype_info.s2kparams.data();
+    s2kparams_data.length = (unsigned int)etype_info.s2kparams.length();
+
+    krb5_error_code ret = krb5_kt_resolve( context, keytab_name.c_str(), keytab );
+    for ( size_t i = 0; ret == 0 && i < sizeof( gmsa_keytab_enctypes ) / sizeof( krb5_enctype );
+          i++ )
+    {
+        krb5_keytab_entry entry;
+        memset( &entry, 0, sizeof( entry ) );
+        ret = krb5_c_string_to_key_with_params(
+            context, gmsa_keytab_enctypes[i], &password_data, &salt_data,
+            etype_info.s2kparams.empty() ? nullptr : &s2kparams_data, &entry.key );
+        if ( ret == 0 )
+        {
+            entry.principal = principal;
+            entry.vno = 1;
+            ret = krb5_kt_add_entry( context, *keytab, &entry );
+            krb5_free_keyblock_contents( context, &entry.key );
+        }
+    }
+    arena.release( utf8_password );
+
+    if ( ret != 0 && *keytab != nullptr )
+    {
+        krb5_kt_destroy( context, *keytab );
+        *keytab = nullptr;
+    }
+    return ret;
+}
+
+/**
+ * Creates a krb ticket for a gMSA from its derived long-term keys
+ * Keys are derived at most once per password generation, later calls for the same
+ * account only do the AS exchange.
+ *
+ * @param gmsa_password - GMSA_PASSWORD_SIZE bytes of UTF-16 password
+ * @param password_generation - generation from GmsaPasswordCache, 0 if the password is not cached
+ * @param gmsa_account_name - Like 'webapp01'
+ * @param domain_name - Like 'contoso.com'
+ * @param krb_cc_name - Like '/var/credentials_fetcher/krb_dir/krb5_cc'
+ * @param ticket_lifetime - requested TGT lifetime in seconds, 0 for the realm default
+ * @param renew_lifetime - requested renewable lifetime in seconds, 0 for the realm default
+ * @param cf_logger - log to systemd daemon
+ * @return result code and message, 0 if successful
+ */
+std::pair<int, std::string> kinit_using_gmsa_keytab( const uint8_t* gmsa_password,
+                                                     uint64_t password_generation,
+                                                     std::string gmsa_account_name,
+                                                     std::string domain_name,
+                                                     const std::string& krb_cc_name,
+                                                     krb5_deltat ticket_lifetime,
+                                                     krb5_deltat renew_lifetime,
+                                                     CF_logger& cf_logger )
+{
+    std::string realm_name = domain_name;
+    std::transform( realm_name.begin(), realm_name.end(), realm_name.begin(),
+                    []( unsigned char c ) { return std::toupper( c ); } );
+    std::string principal_name = gmsa_account_name + "$@" + realm_name;
+
+    krb5_context context = nullptr;
+    // The AS exchange goes straight to the ranked KDCs of the realm
+    krb5_error_code ret = init_krb5_context_for_domain( domain_name, &context );
+    if ( ret != 0 )
+    {
+        return std::make_pair( -1, std::string( "ERROR: krb5_init_context failed" ) );
+    }
+
+    krb5_principal principal = nullptr;
+    krb5_keytab keytab = nullptr;
+    krb5_ccache ccache = nullptr;
+    krb5_get_init_creds_opt* opts = nullptr;
+    krb5_creds creds;
+    memset( &creds, 0, sizeof( creds ) );
+    std::string keytab_name;
+    // Keys of an uncached password are thrown away after this acquisition
+    krb5_keytab one_off_keytab = nullptr;
+
+    ret = krb5_parse_name( context, principal_name.c_str(), &principal );
+    if ( ret == 0 )
+    {
+        std::lock_guard<std::mutex> lock( gmsa_keytab_mutex );
+        if ( gmsa_keytab_context == nullptr )
+        {
+            ret = krb5_init_context( &gmsa_keytab_context );
+        }
+
+        auto it = gmsa_keytabs.find( principal_name );
+        if ( ret == 0 && password_generation != 0 && it != gmsa_keytabs.end() &&
+             it->second.password_generation == password_generation )
+        {
+            keytab_name = it->second.keytab_name;
+        }
+        else if ( ret == 0 )
+        {
+            if ( it != gmsa_keytabs.end() )
+            {
+                // Password rotated, the old keys are useless
+                krb5_kt_destroy( gmsa_keytab_context, it->second.keytab );
+                gmsa_keytabs.erase( it );
+            }
+
+            uint8_t nonce[8];
+            RAND_bytes( nonce, sizeof( nonce ) );
+            char nonce_hex[2 * sizeof( nonce ) + 1];
+            for ( size_t i = 0; i < sizeof( nonce ); i++ )
+            {
+                snprintf( nonce_hex + 2 * i, 3, "%02x", nonce[i] );
+            }
+            keytab_name = "MEMORY:credentials_fetcher_" + gmsa_account_name + "_" + domain_name +
+                          "_" + nonce_hex;
+
+            // The KDC advertised salt wins over the AD default, e.g. for renamed accounts
+            etype_info_t etype_info;
+            if ( !get_cached_etype_info( principal_name, &etype_info ) )
+            {
+                etype_info.salt = get_gmsa_default_salt( gmsa_account_name, domain_name );
+            }
+            krb5_keytab cached_keytab = nullptr;
+            ret = create_gmsa_keytab( gmsa_keytab_context, principal, gmsa_password, etype_info,
+                                      keytab_name, &cached_keytab );
+            if ( ret == 0 && password_generation != 0 )
+            {
+                gmsa_keytab_t gmsa_keytab;
+                gmsa_keytab.password_generation = password_generation;
+                gmsa_keytab.keytab_name = keytab_name;
+                gmsa_keytab.keytab = cached_keytab;
+                gmsa_keytabs[principal_name] = gmsa_keytab;
+            }
+            else if ( ret == 0 )
+            {
+                one_off_keytab = cached_keytab;
+            }
+        }
+    }
+
+    if ( ret == 0 )
+    {
+        ret = krb5_kt_resolve( context, keytab_name.c_str(), &keytab );
+    }
+    if ( ret == 0 )
+    {
+        ret = krb5_cc_resolve( context, krb_cc_name.c_str(), &ccache );
+    }
+    if ( ret == 0 )
+    {
+        ret = krb5_get_init_creds_opt_alloc( context, &opts );
+    }
+    if ( ret == 0 )
+    {
+        ret = krb5_get_init_creds_opt_set_out_ccache( context, opts, ccache );
+    }
+    if ( ret == 0 && ticket_lifetime > 0 )
+    {
+        krb5_get_init_creds_opt_set_tkt_life( opts, ticket_lifetime );
+    }
+    if ( ret == 0 && renew_lifetime > 0 )
+    {
+        krb5_get_init_creds_opt_set_renew_life( opts, renew_lifetime );
+    }
+    if ( ret == 0 )
+    {
+        // Pre-authenticated from the first AS-REQ once the etype info is known
+        void* etype_info_exchange = cf_etype_info_begin( context, principal, opts );
+        ret = krb5_get_init_creds_keytab( context, &creds, principal, keytab, 0, nullptr, opts );
+        cf_etype_info_end( context, etype_info_exchange, ret );
+    }
+
+    std::string log_str;
+    if ( ret != 0 )
+    {
+        const char* err_msg = krb5_get_error_message( context, ret );
+        log_str = "ERROR: kinit from derived keys failed for " + principal_name + ": " + err_msg;
+        krb5_free_error_message( context, err_msg );
+        cf_logger.logger( LOG_WARNING, "%s", log_str.c_str() );
+        std::cerr << Util::getCurrentTime() << '\t' << log_str << std::endl;
+
+        // Stale keys, e.g. password reset out of band or a non-default salt
+        std::lock_guard<std::mutex> lock( gmsa_keytab_mutex );
+        auto it = gmsa_keytabs.find( principal_name );
+        if ( it != gmsa_keytabs.end() && it->second.keytab_name == keytab_name )
+        {
+            krb5_kt_destroy( gmsa_keytab_context, it->second.keytab );
+            gmsa_keytabs.erase( it );
+        }
+    }
+    else
+    {
+        log_str = "INFO: kinit from derived keys succeeded for " + principal_name;
+        cf_logger.logger( LOG_INFO, "%s", log_str.c_str() );
+    }
+
+    krb5_free_cred_contents( context, &creds );
+    if ( opts != nullptr )
+    {
+        krb5_get_init_creds_opt_free( context, opts );
+    }
+    if ( ccache != nullptr )
+    {
+        krb5_cc_close( context, ccache );
+    }
+    if ( keytab != nullptr )
+    {
+        krb5_kt_close( context, keytab );
+    }
+    if ( one_off_keytab != nullptr )
+    {
+        std::lock_guard<std::mutex> lock( gmsa_keytab_mutex );
+        krb5_kt_destroy( gmsa_keytab_context, one_off_keytab );
+    }
+    if ( principal != nullptr )
+    {
+        krb5_free_principal( context, principal );
+    }
+    krb5_free_context( context );
+
+    return std::make_pair( ret == 0 ? 0 : -1, log_str );
+}
+
+// version header of a FILE: keytab, krb5 appends entries after it
+static const uint8_t FILE_KEYTAB_VERSION[2] = { 0x05, 0x02 };
+
+/**
+ * Copies every entry of a keytab into a new FILE: keytab that replaces keytab_path
+ * atomically, so readers never see a partially written keytab
+ * The staging file is created 0600 before any key is written, krb5 would otherwise create
+ * it with the process umask and leave the keys readable until the rename.
+ * @param context - krb5 context
+ * @param keytab - source keytab
+ * @param keytab_path - Like '/var/credentials_fetcher/krb_dir/<lease>/webapp01/krb5.keytab'
+ * @return - 0 on success, krb5 error code otherwise
+ */
+static krb5_error_code copy_keytab_to_file( krb5_context context, krb5_keytab keytab,
+                                            const std::string& keytab_path )
+{
+    std::string keytab_tmp_path = keytab_path + ".tmp";
+    std::string keytab_tmp_name = "FILE:" + keytab_tmp_path;
+    unlink( keytab_tmp_path.c_str() );
+
+    // krb5 opens an existing keytab in place and keeps its mode
+    int fd = open( keytab_tmp_path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR );
+    if ( fd < 0 )
+    {
+        return errno;
+    }
+    krb5_error_code ret = 0;
+    if ( write( fd, FILE_KEYTAB_VERSION, sizeof( FILE_KEYTAB_VERSION ) ) !=
+         (ssize_t)sizeof( FILE_KEYTAB_VERSION ) )
+    {
+        ret = errno != 0 ? errno : EIO;
+    }
+    if ( close( fd ) != 0 && ret == 0 )
+    {
+        ret = errno;
+    }
+
+    krb5_keytab file_keytab = nullptr;
+    if ( ret == 0 )
+    {
+        ret = krb5_kt_resolve( context, keytab_tmp_name.c_str(), &file_keytab );
+    }
+    krb5_kt_cursor cursor;
+    if ( ret == 0 )
+    {
+        ret = krb5_kt_start_seq_get( context, keytab, &cursor );
+    }
+    if ( ret == 0 )
+    {
+        krb5_keytab_entry entry;
+        while ( ret == 0 && krb5_kt_next_entry( context, keytab, &entry, &cursor ) == 0 )
+        {
+            ret = krb5_kt_add_entry( context, file_keytab, &entry );
+            krb5_free_keytab_entry_contents( context, &entry );
+        }
+        krb5_kt_end_seq_get( context, keytab, &cursor );
+    }
+    if ( file_keytab != nullptr )
+    {
+        krb5_kt_close( context, file_keytab );
+    }
+
+    if ( ret == 0 && rename( keytab_tmp_path.c_str(), keytab_path.c_str() ) != 0 )
+    {
+        ret = errno;
+    }
+    if ( ret != 0 )
+    {
+        unlink( keytab_tmp_path.c_str() );
+    }
+    return ret;
+}
+
+/**
+ * Writes the long-term keys of a gMSA to a lease keytab, so the application's own
+ * GSSAPI stack can acquire tickets. The file is only rewritten when AD rotated the
+ * password or the file is gone.
+ *
+ * @param gmsa_password - GMSA_PASSWORD_SIZE bytes of UTF-16 password
+ * @param password_generation - generation from GmsaPasswordCache, 0 forces a rewrite
+ * @param gmsa_account_name - Like 'webapp01'
+ * @param domain_name - Like 'contoso.com'
+ * @param keytab_path - Like '/var/credentials_fetcher/krb_dir/<lease>/webapp01/krb5.keytab'
+ * @param cf_logger - log to systemd daemon
+ * @return - 0 on success, -1 on failure
+ */
+int write_gmsa_keytab_file( const uint8_t* gmsa_password, uint64_t password_generation,
+                            std::string gmsa_account_name, std::string domain_name,
+                            const std::string& keytab_path, CF_logger& cf_logger )
+{
+    std::string realm_name = domain_name;
+    std::transform( realm_name.begin(), realm_name.end(), realm_name.begin(),
+                    []( unsigned char c ) { return std::toupper( c ); } );
+    std::string principal_name = gmsa_account_name + "$@" + realm_name;
+
+    std::lock_guard<std::mutex> lock( gmsa_keytab_mutex );
+    auto file_it = gmsa_keytab_file_generations.find( keytab_path );
+    if ( password_generation != 0 && file_it != gmsa_keytab_file_generations.end() &&
+         file_it->second == password_generation && std::filesystem::exists( keytab_path ) )
+    {
+        return 0;
+    }
+
+    krb5_error_code ret = 0;
+    if ( gmsa_keytab_context == nullptr )
+    {
+        ret = krb5_init_context( &gmsa_keytab_context );
+    }
+    if ( ret != 0 )
+    {
+        return -1;
+    }
+
+    // Reuse the keys derived for the AS exchange when they are of this generation
+    krb5_keytab keytab = nullptr;
+    krb5_keytab one_off_keytab = nullptr;
+    auto it = gmsa_keytabs.find( principal_name );
+    if ( password_generation != 0 && it != gmsa_keytabs.end() &&
+         it->second.password_generation == password_generation )
+    {
+        keytab = it->second.keytab;
+    }
+    else
+    {
+        krb5_principal principal = nullptr;
+        ret = krb5_parse_name( gmsa_keytab_context, principal_name.c_str(), &principal );
+        if ( ret == 0 )
+        {
+            etype_info_t etype_info;
+            if ( !get_cached_etype_info( principal_name, &etype_info ) )
+            {
+                etype_info.salt = get_gmsa_default_salt( gmsa_account_name, domain_name );
+            }
+            std::string keytab_name = "MEMORY:credentials_fetcher_export_" + gmsa_account_name +
+                                      "_" + domain_name;
+            ret = create_gmsa_keytab( gmsa_keytab_context, principal, gmsa_password, etype_info,
+                                      keytab_name, &one_off_keytab );
+            krb5_free_principal( gmsa_keytab_context, principal );
+            keytab = one_off_keytab;
+        }
+    }
+
+    if ( ret == 0 )
+    {
+        ret = copy_keytab_to_file( gmsa_keytab_context, keytab, keytab_path );
+    }
+    if ( one_off_keytab != nullptr )
+    {
+        krb5_kt_destroy( gmsa_keytab_context, one_off_keytab );
+    }
+
+    if ( ret != 0 )
+    {
+        const char* err_msg = krb5_get_error_message( gmsa_keytab_context, ret );
+        std::string log_str = "ERROR: cannot write keytab " + keytab_path + ": " + err_msg;
+        krb5_free_error_message( gmsa_keytab_context, err_msg );
+        cf_logger.logger( LOG_ERR, "%s", log_str.c_str() );
+        std::cerr << Util::getCurrentTime() << '\t' << log_str << std::endl;
+        return -1;
+    }
+
+    gmsa_keytab_file_generations[keytab_path] = password_generation;
+    cf_logger.logger( LOG_INFO, "INFO: keytab of %s written to %s", principal_name.c_str(),
+                      keytab_path.c_str() );
+    return 0;
+}
+
+/**
+ * Forgets a lease keytab written by write_gmsa_keytab_file(), the file itself is
+ * removed with the lease directory
+ * @param keytab_path - Like '/var/credentials_fetcher/krb_dir/<lease>/webapp01/krb5.keytab'
+ */
+void forget_gmsa_keytab_file( const std::string& keytab_path )
+{
+    std::lock_guard<std::mutex> lock( gmsa_keytab_mutex );
+    gmsa_keytab_file_generations.erase( keytab_path );
+}
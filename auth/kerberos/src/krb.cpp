@@ -1,12 +1,23 @@
 #include "daemon.h"
+#include "dc_latency_tracker.hpp"
+#include "gmsa_password_cache.hpp"
+#include "lease_registry.hpp"
+#include "renewal_lead_time.hpp"
 #include "util.hpp"
+#include <atomic>
+#include <condition_variable>
 #include <cstdio>
-#include <dirent.h>
 #include <filesystem>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <openssl/crypto.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <thread>
+
+// gMSA tickets of one domainless user fetched concurrently during a batch renewal
+#define BATCH_RENEWAL_MAX_WORKERS 4
 
 const std::vector<char> invalid_characters = { '&',  '|', ';', ':',  '$', '*', '?', '<',
                                                '>',  '!', ' ', '\\', '.', ']', '[', '+',
@@ -84,7 +95,10 @@ std::pair<int, std::string> generate_krb_ticket_from_machine_keytab( std::string
         return result;
     }
 
-    result = Util::execute_kinit_in_domain_joined_case( machine_principal.second );
+    // The machine ticket only authorizes the LDAP query, keep it out of the default ccache
+    result = Util::execute_kinit_in_domain_joined_case(
+        machine_principal.second, get_krb5_config_for_domain( domain_name ),
+        get_bootstrap_ccache_path( domain_name, "" ) );
     if ( result.first != 0 )
     {
         cf_logger.logger( LOG_ERR, result.second.c_str() );
@@ -95,28 +109,206 @@ std::pair<int, std::string> generate_krb_ticket_from_machine_keytab( std::string
 }
 
 /**
- * This function fetches the gmsa password and creates a krb ticket
+ * Pipes a UTF-16 gMSA password through the utf16 decoder into kinit
+ * @param gmsa_password - GMSA_PASSWORD_SIZE bytes of UTF-16 password
+ * @param default_principal - Like 'webapp01$'@CONTOSO.COM
+ * @param krb_cc_name - Like '/var/credentials_fetcher/krb_dir/krb5_cc'
+ * @param krb5_config - KRB5_CONFIG for kinit, empty for the system configuration
+ * @param krb_ticket - requested lifetimes, may be NULL
+ * @param cf_logger - log to systemd daemon
+ * @return - kinit exit status, -1 if kinit could not be started
+ */
+static int kinit_using_gmsa_password( const uint8_t* gmsa_password,
+                                      const std::string& default_principal,
+                                      const std::string& krb_cc_name,
+                                      const std::string& krb5_config,
+                                      krb_ticket_info_t* krb_ticket, CF_logger& cf_logger )
+{
+    std::string kinit_env = krb5_config.empty() ? "" : "KRB5_CONFIG=" + krb5_config + " ";
+    std::string kinit_lifetimes = "";
+    if ( krb_ticket != NULL && krb_ticket->ticket_lifetime > 0 )
+    {
+        kinit_lifetimes += " -l " + std::to_string( krb_ticket->ticket_lifetime ) + "s";
+    }
+    if ( krb_ticket != NULL && krb_ticket->renew_lifetime > 0 )
+    {
+        kinit_lifetimes += " -r " + std::to_string( krb_ticket->renew_lifetime ) + "s";
+    }
+    /* Pipe password to the utf16 decoder and kinit */
+    std::string kinit_cmd = std::string( "dotnet " ) + std::string( install_path_for_decode_exe ) +
+                            std::string( " | " ) + kinit_env + std::string( "kinit " ) +
+                            std::string( " -c " ) + krb_cc_name + kinit_lifetimes + " -V " +
+                            default_principal;
+    std::cerr << Util::getCurrentTime() << '\t' << "INFO:" << kinit_cmd << std::endl;
+    FILE* fp = popen( kinit_cmd.c_str(), "w" );
+    if ( fp == nullptr )
+    {
+        perror( "kinit failed" );
+        cf_logger.logger( LOG_ERR, "ERROR: %s:%d kinit failed", __func__, __LINE__ );
+        std::cerr << Util::getCurrentTime() << '\t' << "ERROR: kinit failed" << std::endl;
+        return -1;
+    }
+    fwrite( gmsa_password, 1, GMSA_PASSWORD_SIZE, fp );
+    int error_code = pclose( fp );
+
+    // kinit output
+    std::string log_str = Util::getCurrentTime() + '\t' +
+                          "INFO: kinit return value = " + std::to_string( error_code );
+    std::cerr << log_str << std::endl;
+    cf_logger.logger( LOG_ERR, log_str.c_str() );
+
+    return error_code;
+}
+
+/**
+ * State shared by the primary and the hedged ldapsearch of one password query, the
+ * slower of the two outlives the query
+ */
+typedef struct hedged_ldapsearch_t_
+{
+    std::mutex mutex;
+    std::condition_variable done;
+    int pending = 0;
+    bool answered = false;
+    std::string answered_fqdn;
+    std::pair<int, std::string> result = std::make_pair( -1, std::string( "" ) );
+} hedged_ldapsearch_t;
+
+/**
+ * Runs one ldapsearch of a hedged query and publishes its answer if it is the first
+ * @param state - shared with hedged_ldapsearch()
+ * @param is_hedge - the hedge holds a DcLatencyTracker hedge slot
+ */
+static void run_hedged_ldapsearch( std::shared_ptr<hedged_ldapsearch_t> state,
+                                   std::string gmsa_account_name, std::string distinguished_name,
+                                   std::string fqdn, std::string search_string,
+                                   std::string krb5_config, std::string krb_cc_name,
+                                   bool is_hedge )
+{
+    auto start = std::chrono::steady_clock::now();
+    std::pair<int, std::string> result =
+        Util::execute_ldapsearch( gmsa_account_name, distinguished_name, fqdn, search_string,
+                                  krb5_config, krb_cc_name );
+    if ( result.first == 0 )
+    {
+        DcLatencyTracker::instance().record(
+            fqdn, std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::steady_clock::now() - start ) );
+    }
+    if ( is_hedge )
+    {
+        DcLatencyTracker::instance().release_hedge();
+    }
+
+    std::lock_guard<std::mutex> lock( state->mutex );
+    if ( result.first == 0 && !state->answered )
+    {
+        state->answered = true;
+        state->answered_fqdn = fqdn;
+        // Moved, not copied, so no stray copy of the password is left behind
+        state->result = std::move( result );
+    }
+    else if ( result.first == 0 )
+    {
+        // Lost the race, the password in this answer is not needed
+        OPENSSL_cleanse( (void*)result.second.c_str(), result.second.length() );
+    }
+    else if ( !state->answered )
+    {
+        state->result = result;
+    }
+    state->pending--;
+    state->done.notify_all();
+}
+
+/**
+ * Runs the password query against a domain controller and, if it has not answered within
+ * its observed p95 latency, also against the next ranked one; the first answer wins
+ * @param gmsa_account_name - Like 'webapp01'
+ * @param distinguished_name - search base
+ * @param fqdn - primary domain controller
+ * @param hedge_fqdn - next ranked domain controller, empty if there is none
+ * @param search_string - ldapsearch filter and attributes
+ * @param krb5_config - KRB5_CONFIG for ldapsearch
+ * @param krb_cc_name - bootstrap ccache
+ * @param hedge_sent - set to true if the hedge was sent
+ * @return - result of execute_ldapsearch() of the first successful domain controller
+ */
+static std::pair<int, std::string> hedged_ldapsearch(
+    const std::string& gmsa_account_name, const std::string& distinguished_name,
+    const std::string& fqdn, const std::string& hedge_fqdn, const std::string& search_string,
+    const std::string& krb5_config, const std::string& krb_cc_name, bool* hedge_sent )
+{
+    DcLatencyTracker& tracker = DcLatencyTracker::instance();
+    std::shared_ptr<hedged_ldapsearch_t> state = std::make_shared<hedged_ldapsearch_t>();
+    *hedge_sent = false;
+
+    tracker.add_request();
+    state->pending = 1;
+    std::thread( run_hedged_ldapsearch, state, gmsa_account_name, distinguished_name, fqdn,
+                 search_string, krb5_config, krb_cc_name, false )
+        .detach();
+
+    std::unique_lock<std::mutex> lock( state->mutex );
+    auto finished = [&state]() { return state->answered || state->pending == 0; };
+    if ( !state->done.wait_for( lock, tracker.get_hedge_delay( fqdn ), finished ) &&
+         !hedge_fqdn.empty() && tracker.try_acquire_hedge() )
+    {
+        std::cerr << Util::getCurrentTime() << '\t' << "INFO: " << fqdn
+                  << " is slow, hedging ldapsearch to " << hedge_fqdn << std::endl;
+        state->pending++;
+        *hedge_sent = true;
+        std::thread( run_hedged_ldapsearch, state, gmsa_account_name, distinguished_name,
+                     hedge_fqdn, search_string, krb5_config, krb_cc_name, true )
+            .detach();
+    }
+    state->done.wait( lock, finished );
+
+    std::pair<int, std::string> result = state->result;
+    if ( state->answered )
+    {
+        // The caller owns the only copy of the password from here on
+        OPENSSL_cleanse( (void*)state->result.second.c_str(), state->result.second.length() );
+        state->result.second.clear();
+        if ( state->answered_fqdn != fqdn )
+        {
+            std::cerr << Util::getCurrentTime() << '\t' << "INFO: hedged ldapsearch to "
+                      << state->answered_fqdn << " answered first" << std::endl;
+        }
+    }
+    return result;
+}
+
+/**
+ * Fetches the gmsa password and creates a krb ticket in the given ccache
  * It uses the existing krb ticket of machine to run ldap query over
  * kerberos and do the appropriate UTF decoding.
  *
  * @param domain_name - Like 'contoso.com'
- * @param gmsa_account_name - Like 'webapp01'
+ * @param krb_ticket - ticket info with the gmsa account name
  * @param krb_cc_name - Like '/var/credentials_fetcher/krb_dir/krb5_cc'
  * @param cf_logger - log to systemd daemon
  * @return result code and kinit log, 0 if successful, -1 on failure
  */
-std::pair<int, std::string> fetch_gmsa_password_and_create_krb_ticket(
-    std::string domain_name, krb_ticket_info_t* krb_ticket, const std::string& krb_cc_name,
-    CF_logger& cf_logger )
+static std::pair<int, std::string> acquire_gmsa_krb_ticket( std::string domain_name,
+                                                            krb_ticket_info_t* krb_ticket,
+                                                            const std::string& krb_cc_name,
+                                                            CF_logger& cf_logger )
 {
     std::vector<std::string> results;
     std::string gmsa_account_name = "";
     std::string distinguished_name = "";
+    std::string bootstrap_source = "";
+    krb5_deltat ticket_lifetime = 0;
+    krb5_deltat renew_lifetime = 0;
 
     if ( krb_ticket != NULL )
     {
         gmsa_account_name = krb_ticket->service_account_name;
         distinguished_name = krb_ticket->distinguished_name;
+        bootstrap_source = krb_ticket->domainless_user;
+        ticket_lifetime = (krb5_deltat)krb_ticket->ticket_lifetime;
+        renew_lifetime = (krb5_deltat)krb_ticket->renew_lifetime;
     }
 
     if ( domain_name.empty() || gmsa_account_name.empty() )
@@ -127,6 +319,46 @@ std::pair<int, std::string> fetch_gmsa_password_and_create_krb_ticket(
         return std::make_pair( -1, err_msg );
     }
 
+    std::string realm_name = domain_name;
+    std::transform( realm_name.begin(), realm_name.end(), realm_name.begin(),
+                    []( unsigned char c ) { return std::toupper( c ); } );
+    std::string default_principal = "'" + gmsa_account_name + "$'" + "@" + realm_name;
+    std::string krb5_config = get_krb5_config_for_domain( domain_name );
+    // LDAP runs on the bootstrap ticket of this lease's machine or domainless identity
+    std::string bootstrap_cc_name = get_bootstrap_ccache_path( domain_name, bootstrap_source );
+
+    // Skip the ldapsearch while AD has not rotated the password
+    uint64_t password_generation = 0;
+    uint8_t* cached_password = (uint8_t*)SecureArena::instance().allocate( GMSA_PASSWORD_SIZE );
+    if ( cached_password != nullptr &&
+         GmsaPasswordCache::instance().get( domain_name, gmsa_account_name, cached_password,
+                                            &password_generation ) )
+    {
+        int error_code = kinit_using_gmsa_keytab( cached_password, password_generation,
+                                                  gmsa_account_name, domain_name, krb_cc_name,
+                                                  ticket_lifetime, renew_lifetime, cf_logger )
+                             .first;
+        if ( error_code != 0 )
+        {
+            error_code = kinit_using_gmsa_password( cached_password, default_principal,
+                                                    krb_cc_name, krb5_config, krb_ticket,
+                                                    cf_logger );
+        }
+        SecureArena::instance().release( cached_password );
+        if ( error_code == 0 )
+        {
+            return std::make_pair( error_code, krb_cc_name );
+        }
+        // Password may have been reset out of band, fall back to ldapsearch
+        cf_logger.logger( LOG_WARNING, "WARNING: cached gMSA password rejected for %s",
+                          gmsa_account_name.c_str() );
+        GmsaPasswordCache::instance().invalidate( domain_name, gmsa_account_name );
+    }
+    else
+    {
+        SecureArena::instance().release( cached_password );
+    }
+
     std::pair<int, std::string> ldap_search_result;
     std::string base_dn = "";
 
@@ -141,13 +373,18 @@ std::pair<int, std::string> fetch_gmsa_password_and_create_krb_ticket(
         distinguished_name = std::string( getenv( ENV_CF_GMSA_OU ) );
     }
 
-    std::vector<std::string> fqdn_list_result = Util::get_FQDN_list( domain_name );
-    for ( auto fqdn : fqdn_list_result )
+    // The fastest known domain controller goes first, the next ranked one is the hedge
+    std::vector<std::string> fqdn_list_result =
+        DcLatencyTracker::instance().rank( domain_name, Util::get_FQDN_list( domain_name ) );
+    for ( size_t fqdn_index = 0; fqdn_index < fqdn_list_result.size(); fqdn_index++ )
     {
+        std::string fqdn = fqdn_list_result[fqdn_index];
+        std::string hedge_fqdn =
+            fqdn_index + 1 < fqdn_list_result.size() ? fqdn_list_result[fqdn_index + 1] : "";
         if ( distinguished_name.empty() )
         {
             std::pair<int, std::string> distinguished_name_result =
-                Util::find_dn( gmsa_account_name, base_dn, fqdn );
+                Util::find_dn( gmsa_account_name, base_dn, fqdn, krb5_config, bootstrap_cc_name );
             if ( distinguished_name_result.first == 0 && !distinguished_name_result.second.empty() )
             {
                 distinguished_name = distinguished_name_result.second;
@@ -160,8 +397,10 @@ std::pair<int, std::string> fetch_gmsa_password_and_create_krb_ticket(
         // Then find the password
         std::string search_string = std::string(
             " -s sub  '(objectClass=msDs-GroupManagedServiceAccount)' msDS-ManagedPassword" );
+        bool hedge_sent = false;
         ldap_search_result =
-            Util::execute_ldapsearch( gmsa_account_name, distinguished_name, fqdn, search_string );
+            hedged_ldapsearch( gmsa_account_name, distinguished_name, fqdn, hedge_fqdn,
+                               search_string, krb5_config, bootstrap_cc_name, &hedge_sent );
         if ( ldap_search_result.first == 0 )
         {
             std::size_t pos = ldap_search_result.second.find( "msDS-ManagedPassword:" );
@@ -181,6 +420,11 @@ std::pair<int, std::string> fetch_gmsa_password_and_create_krb_ticket(
                                   ldap_search_result.second.c_str() + " " + search_string;
             std::cerr << log_str << std::endl;
             cf_logger.logger( LOG_INFO, log_str.c_str() );
+            if ( hedge_sent )
+            {
+                // The next domain controller already failed as the hedge
+                fqdn_index++;
+            }
         }
     }
     fqdn_list_result.clear();
@@ -206,37 +450,195 @@ std::pair<int, std::string> fetch_gmsa_password_and_create_krb_ticket(
     blob_t* blob = ( (blob_t*)password_found_result.second );
     auto* blob_password = (uint8_t*)blob->current_password;
 
-    std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
-                    []( unsigned char c ) { return std::toupper( c ); } );
-    std::string default_principal = "'" + gmsa_account_name + "$'" + "@" + domain_name;
+    password_generation = 0;
+    GmsaPasswordCache::instance().put( domain_name, gmsa_account_name, blob,
+                                       password_found_result.first, &password_generation );
 
-    /* Pipe password to the utf16 decoder and kinit */
-    std::string kinit_cmd = std::string( "dotnet " ) + std::string( install_path_for_decode_exe ) +
-                            std::string( " | kinit " ) + std::string( " -c " ) + krb_cc_name +
-                            " -V " + default_principal;
-    std::cerr << Util::getCurrentTime() << '\t' << "INFO:" << kinit_cmd << std::endl;
-    FILE* fp = popen( kinit_cmd.c_str(), "w" );
-    if ( fp == nullptr )
+    // Derived keys avoid the dotnet decoder and are reused until the password rotates
+    int error_code = kinit_using_gmsa_keytab( blob_password, password_generation,
+                                              gmsa_account_name, domain_name, krb_cc_name,
+                                              ticket_lifetime, renew_lifetime, cf_logger )
+                         .first;
+    if ( error_code != 0 )
+    {
+        error_code = kinit_using_gmsa_password( blob_password, default_principal, krb_cc_name,
+                                                krb5_config, krb_ticket, cf_logger );
+    }
+    if ( error_code != 0 )
+    {
+        GmsaPasswordCache::instance().invalidate( domain_name, gmsa_account_name );
+    }
+    SecureArena::instance().release( password_found_result.second );
+
+    if ( error_code == -1 )
     {
-        perror( "kinit failed" );
-        OPENSSL_cleanse( password_found_result.second, password_found_result.first );
-        OPENSSL_free( password_found_result.second );
-        cf_logger.logger( LOG_ERR, "ERROR: %s:%d kinit failed", __func__, __LINE__ );
-        std::cerr << Util::getCurrentTime() << '\t' << "ERROR: kinit failed" << std::endl;
         return std::make_pair( -1, std::string( "kinit failed" ) );
     }
-    fwrite( blob_password, 1, GMSA_PASSWORD_SIZE, fp );
-    int error_code = pclose( fp );
+    return std::make_pair( error_code, krb_cc_name );
+}
 
-    // kinit output
-    std::string log_str = Util::getCurrentTime() + '\t' +
-                          "INFO: kinit return value = " + std::to_string( error_code );
-    std::cerr << log_str << std::endl;
-    cf_logger.logger( LOG_ERR, log_str.c_str() );
+/**
+ * Key part that separates the shared ccaches of leases of the same account: leases
+ * bootstrapped differently or asking for different ticket lifetimes never share a TGT
+ * @param krb_ticket - ticket info of the lease
+ * @return - shared ccache source
+ */
+static std::string get_shared_ccache_source( krb_ticket_info_t* krb_ticket )
+{
+    std::string source = krb_ticket->domainless_user;
+    if ( krb_ticket->ticket_lifetime > 0 || krb_ticket->renew_lifetime > 0 )
+    {
+        source += "|" + std::to_string( krb_ticket->ticket_lifetime ) + "|" +
+                  std::to_string( krb_ticket->renew_lifetime );
+    }
+    return source;
+}
 
-    OPENSSL_cleanse( password_found_result.second, password_found_result.first );
+/**
+ * Location of the keytab of a lease in keytab output mode
+ * @param krb_cc_name - lease ccache, Like '/var/credentials_fetcher/krb_dir/<lease>/<gmsa>/krb5cc'
+ * @return - Like '/var/credentials_fetcher/krb_dir/<lease>/<gmsa>/krb5.keytab'
+ */
+std::string get_lease_keytab_path( const std::string& krb_cc_name )
+{
+    return std::filesystem::path( krb_cc_name ).parent_path().string() + "/" +
+           LEASE_KEYTAB_FILE_NAME;
+}
 
-    return std::make_pair( error_code, krb_cc_name );
+/**
+ * Writes the lease keytab from the cached gMSA password, only does work when the
+ * password generation changed since the last write
+ * @param domain_name - Like 'contoso.com'
+ * @param krb_ticket - lease in keytab output mode
+ * @param krb_cc_name - lease ccache
+ * @param cf_logger - log to systemd daemon
+ * @return - 0 on success, -1 on failure
+ */
+static int export_lease_keytab( const std::string& domain_name, krb_ticket_info_t* krb_ticket,
+                                const std::string& krb_cc_name, CF_logger& cf_logger )
+{
+    uint64_t password_generation = 0;
+    uint8_t* password = (uint8_t*)SecureArena::instance().allocate( GMSA_PASSWORD_SIZE );
+    if ( password == nullptr ||
+         !GmsaPasswordCache::instance().get( domain_name, krb_ticket->service_account_name,
+                                             password, &password_generation ) )
+    {
+        // Rotation is imminent, the keytab is written after the next password fetch
+        SecureArena::instance().release( password );
+        cf_logger.logger( LOG_WARNING, "WARNING: password of %s is not cached, keytab not written",
+                          krb_ticket->service_account_name.c_str() );
+        return -1;
+    }
+
+    int result = write_gmsa_keytab_file( password, password_generation,
+                                         krb_ticket->service_account_name, domain_name,
+                                         get_lease_keytab_path( krb_cc_name ), cf_logger );
+    SecureArena::instance().release( password );
+    return result;
+}
+
+/**
+ * Acquires a gMSA ticket and records its latency and outcome for the renewal lead time
+ * of the domain
+ * @param domain_name - Like 'contoso.com'
+ * @param krb_ticket - ticket info with the gmsa account name
+ * @param krb_cc_name - ccache to write
+ * @param cf_logger - log to systemd daemon
+ * @return result code and kinit log, 0 if successful, -1 on failure
+ */
+static std::pair<int, std::string> acquire_tracked_gmsa_krb_ticket( std::string domain_name,
+                                                                    krb_ticket_info_t* krb_ticket,
+                                                                    const std::string& krb_cc_name,
+                                                                    CF_logger& cf_logger )
+{
+    auto start = std::chrono::steady_clock::now();
+    std::pair<int, std::string> result =
+        acquire_gmsa_krb_ticket( domain_name, krb_ticket, krb_cc_name, cf_logger );
+    RenewalLeadTime::instance().record(
+        domain_name,
+        std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() -
+                                                               start ),
+        result.first == 0 );
+    return result;
+}
+
+/**
+ * This function fetches the gmsa password and creates a krb ticket
+ * The ticket is acquired once per (domain, account, bootstrap source) into the shared
+ * ccache store and copied into the lease ccache, so leases of the same account cost a
+ * single LDAP and KDC exchange.
+ *
+ * @param domain_name - Like 'contoso.com'
+ * @param krb_ticket - ticket info with the gmsa account name
+ * @param krb_cc_name - Like '/var/credentials_fetcher/krb_dir/krb5_cc'
+ * @param cf_logger - log to systemd daemon
+ * @return result code and kinit log, 0 if successful, -1 on failure
+ */
+std::pair<int, std::string> fetch_gmsa_password_and_create_krb_ticket(
+    std::string domain_name, krb_ticket_info_t* krb_ticket, const std::string& krb_cc_name,
+    CF_logger& cf_logger )
+{
+    if ( krb_ticket == NULL )
+    {
+        return acquire_tracked_gmsa_krb_ticket( domain_name, krb_ticket, krb_cc_name, cf_logger );
+    }
+
+    std::string shared_ccache_path = get_shared_ccache_path(
+        domain_name, krb_ticket->service_account_name, get_shared_ccache_source( krb_ticket ) );
+    if ( shared_ccache_path.empty() )
+    {
+        std::pair<int, std::string> result =
+            acquire_tracked_gmsa_krb_ticket( domain_name, krb_ticket, krb_cc_name, cf_logger );
+        if ( result.first == 0 )
+        {
+            prefetch_service_tickets( krb_cc_name, krb_ticket->prefetch_spns, cf_logger );
+            if ( krb_ticket->keytab_output )
+            {
+                export_lease_keytab( domain_name, krb_ticket, krb_cc_name, cf_logger );
+            }
+        }
+        return result;
+    }
+
+    std::lock_guard<std::mutex> lock( get_shared_ccache_mutex( shared_ccache_path ) );
+    // Keytab output needs the password itself, not only a fresh TGT
+    if ( !is_shared_ccache_fresh( shared_ccache_path, domain_name ) ||
+         GmsaPasswordCache::instance().needs_refresh( domain_name,
+                                                      krb_ticket->service_account_name ) ||
+         ( krb_ticket->keytab_output &&
+           !GmsaPasswordCache::instance().is_current( domain_name,
+                                                      krb_ticket->service_account_name ) ) )
+    {
+        std::string staging_ccache_path = shared_ccache_path + ".new";
+        std::pair<int, std::string> result = acquire_tracked_gmsa_krb_ticket(
+            domain_name, krb_ticket, staging_ccache_path, cf_logger );
+        if ( result.first != 0 ||
+             rename( staging_ccache_path.c_str(), shared_ccache_path.c_str() ) != 0 )
+        {
+            unlink( staging_ccache_path.c_str() );
+            return std::make_pair( result.first != 0 ? result.first : -1, result.second );
+        }
+    }
+    else
+    {
+        cf_logger.logger( LOG_INFO, "INFO: reusing shared gMSA ticket of %s",
+                          krb_ticket->service_account_name.c_str() );
+    }
+
+    // Only SPNs missing from the shared ccache hit the KDC
+    prefetch_service_tickets( shared_ccache_path, krb_ticket->prefetch_spns, cf_logger );
+
+    if ( publish_shared_ccache( shared_ccache_path, krb_cc_name ) != 0 )
+    {
+        std::string err_msg = "ERROR: cannot publish shared gMSA ticket to " + krb_cc_name;
+        cf_logger.logger( LOG_ERR, err_msg.c_str() );
+        return std::make_pair( -1, err_msg );
+    }
+    if ( krb_ticket->keytab_output )
+    {
+        export_lease_keytab( domain_name, krb_ticket, krb_cc_name, cf_logger );
+    }
+    return std::make_pair( 0, krb_cc_name );
 }
 
 /**
@@ -415,12 +817,45 @@ bool is_ticket_ready_for_renewal( krb_ticket_info_t* krb_ticket_info, CF_logger&
     return is_ready_for_renewal;
 }
 
+/**
+ * Checks if a lease ticket is inside its renewal window: its TGT is missing or expires
+ * within the renewal lead time of its domain, or the cached gMSA password is due for refresh.
+ * Leases in keytab output mode only follow the password.
+ * @param krb_ticket - lease ticket info
+ * @return - true if the ticket should be renewed now
+ */
+bool is_ticket_in_renewal_window( const krb_ticket_info_t& krb_ticket )
+{
+    time_t now = time( nullptr );
+    time_t refresh_at = GmsaPasswordCache::instance().get_refresh_at(
+        krb_ticket.domain_name, krb_ticket.service_account_name );
+    if ( refresh_at != 0 && refresh_at <= now )
+    {
+        return true;
+    }
+    if ( krb_ticket.keytab_output )
+    {
+        return !std::filesystem::exists( get_lease_keytab_path( krb_ticket.krb_file_path ) );
+    }
+
+    krb5_ticket_times times;
+    if ( !get_tgt_times( krb_ticket.krb_file_path, &times ) )
+    {
+        return true;
+    }
+    time_t starttime = times.starttime != 0 ? (time_t)times.starttime : (time_t)times.authtime;
+    time_t lead_time = std::min( get_renewal_lead_time( krb_ticket.domain_name ),
+                                 ( (time_t)times.endtime - starttime ) / 2 );
+    return (time_t)times.endtime <= now + lead_time;
+}
+
 /**
  * This function does the ticket renewal in domainless mode.
  * @param krb_files_dir
  * @param domain_name
  * @param username
  * @param password
+ * @return - ccache paths of the renewed tickets
  */
 std::list<std::string> renew_kerberos_tickets_domainless( std::string krb_files_dir,
                                                           std::string domain_name,
@@ -428,34 +863,15 @@ std::list<std::string> renew_kerberos_tickets_domainless( std::string krb_files_
                                                           std::string password,
                                                           CF_logger& cf_logger )
 {
-    std::list<std::string> renewed_krb_ticket_paths;
-    // identify the metadata files in the krb directory
-    std::vector<std::string> metadatafiles = get_meta_data_file_paths( krb_files_dir );
-
-    // read the information of service account from the files
-    for ( auto file_path : metadatafiles )
+    if ( username.empty() )
     {
-        std::list<krb_ticket_info_t*> krb_ticket_info_list = read_meta_data_json( file_path );
-
-        // refresh the kerberos tickets for the service accounts, if tickets ready for
-        // renewal
-        for ( auto krb_ticket : krb_ticket_info_list )
-        {
-            std::string domainlessuser = krb_ticket->domainless_user;
-            if ( !username.empty() && username == domainlessuser )
-            {
-                std::string renewed_ticket_path =
-                    renew_gmsa_ticket( krb_ticket, domain_name, username, password, cf_logger );
-
-                if ( !renewed_krb_ticket_paths.empty() )
-                {
-                    renewed_krb_ticket_paths.push_back( renewed_ticket_path );
-                }
-            }
-        }
+        return std::list<std::string>();
     }
 
-    return renewed_krb_ticket_paths;
+    // only the leases created with this domainless user are refreshed
+    std::vector<krb_ticket_info_t> krb_tickets =
+        LeaseRegistry::instance().find_by_domainless_user( username );
+    return renew_gmsa_tickets( krb_tickets, domain_name, username, password, cf_logger );
 }
 
 /**
@@ -484,74 +900,129 @@ std::vector<std::string> get_meta_data_file_paths( std::string krbdir )
 }
 
 /**
- * renew gmsa kerberos tickets
- * @param krb_ticket_info - kerberos ticket info
- * @param domain_name
- * @param username
- * @param password
+ * Fetches the gMSA tickets of a batch in parallel
+ * @param krb_tickets - lease tickets
  * @param cf_logger - credentials fetcher logger
+ * @return - per ticket, true if the ticket was acquired
  */
-std::string renew_gmsa_ticket( krb_ticket_info_t* krb_ticket, std::string domain_name,
-                               std::string username, std::string password, CF_logger& cf_logger )
+static std::vector<char> fetch_gmsa_krb_tickets( const std::vector<krb_ticket_info_t*>& krb_tickets,
+                                                 CF_logger& cf_logger )
 {
-    std::string renewed_krb_ticket_path;
-    std::pair<int, std::string> gmsa_ticket_result;
-    std::string krb_cc_name = krb_ticket->krb_file_path;
-
-    // gMSA kerberos ticket generation needs to have ldap over kerberos
-    // if the ticket exists for the machine/user already reuse it for getting gMSA password else
-    // retry the ticket creation again after generating user/machine kerberos ticket
-    int num_retries = 2;
-    for ( int i = 0; i < num_retries; i++ )
-    {
-        gmsa_ticket_result = fetch_gmsa_password_and_create_krb_ticket(
-            krb_ticket->domain_name, krb_ticket, krb_cc_name, cf_logger );
-        if ( gmsa_ticket_result.first != 0 )
+    std::vector<char> acquired( krb_tickets.size(), 0 );
+    std::atomic<size_t> next_ticket( 0 );
+    auto worker = [&]() {
+        for ( size_t i = next_ticket++; i < krb_tickets.size(); i = next_ticket++ )
         {
-            if ( i == 0 )
-            {
-                cf_logger.logger( LOG_WARNING,
-                                  "WARNING: Cannot get gMSA krb ticket "
-                                  "because of expired user/machine ticket, "
-                                  "will be retried automatically, service_account_name = %s",
-                                  krb_ticket->service_account_name.c_str() );
-            }
-            else
-            {
-                cf_logger.logger( LOG_ERR, "ERROR: Cannot get gMSA krb ticket using account %s",
-                                  krb_ticket->service_account_name.c_str() );
+            krb_ticket_info_t* krb_ticket = krb_tickets[i];
+            acquired[i] = fetch_gmsa_password_and_create_krb_ticket( krb_ticket->domain_name,
+                                                                     krb_ticket,
+                                                                     krb_ticket->krb_file_path,
+                                                                     cf_logger )
+                              .first == 0;
+        }
+    };
 
-                std::cerr << Util::getCurrentTime() << '\t'
-                          << "ERROR: Cannot get gMSA krb ticket using account" << std::endl;
-            }
-            // if tickets are created in domainless mode
-            std::string domainless_user = krb_ticket->domainless_user;
-            if ( !domainless_user.empty() && domainless_user == username )
+    std::vector<std::thread> workers;
+    size_t num_workers = std::min( krb_tickets.size(), (size_t)BATCH_RENEWAL_MAX_WORKERS );
+    for ( size_t i = 0; i < num_workers; i++ )
+    {
+        workers.push_back( std::thread( worker ) );
+    }
+    for ( auto& worker_thread : workers )
+    {
+        worker_thread.join();
+    }
+    return acquired;
+}
+
+/**
+ * Renews the gMSA tickets of the leases of one domainless user as a batch
+ * The user TGT is acquired once, and only if the user's bootstrap ccache has no usable TGT,
+ * then all gMSA tickets are fetched in parallel. Tickets that fail are retried once after
+ * acquiring the user TGT again, in case it expired or was revoked.
+ *
+ * @param krb_tickets - tickets of the leases created with the domainless user
+ * @param domain_name - domain of the domainless user
+ * @param username - domainless user
+ * @param password - password of the domainless user
+ * @param cf_logger - credentials fetcher logger
+ * @return - ccache paths of the renewed tickets
+ */
+std::list<std::string> renew_gmsa_tickets( std::vector<krb_ticket_info_t>& krb_tickets,
+                                           const std::string& domain_name,
+                                           const std::string& username,
+                                           const std::string& password, CF_logger& cf_logger )
+{
+    std::list<std::string> renewed_krb_ticket_paths;
+    std::vector<krb_ticket_info_t*> pending;
+    for ( auto& krb_ticket : krb_tickets )
+    {
+        if ( krb_ticket.domainless_user == username )
+        {
+            pending.push_back( &krb_ticket );
+        }
+    }
+    if ( pending.empty() )
+    {
+        return renewed_krb_ticket_paths;
+    }
+
+    // gMSA kerberos ticket generation needs to have ldap over kerberos, reuse the user ticket
+    // of the bootstrap ccache while it is valid
+    bool user_ticket_acquired = false;
+    auto acquire_user_ticket = [&]() {
+        user_ticket_acquired = true;
+        std::pair<int, std::string> status = Util::generate_krb_ticket_using_username_and_password(
+            domain_name, username, password, cf_logger );
+        if ( status.first < 0 )
+        {
+            cf_logger.logger( LOG_ERR, "ERROR %d: Cannot get user krb ticket", status.first );
+            std::cerr << Util::getCurrentTime() << '\t' << "ERROR: Cannot get user krb ticket"
+                      << std::endl;
+        }
+    };
+    if ( !is_shared_ccache_fresh( get_bootstrap_ccache_path( domain_name, username ),
+                                 domain_name ) )
+    {
+        acquire_user_ticket();
+    }
+
+    while ( true )
+    {
+        std::vector<char> acquired = fetch_gmsa_krb_tickets( pending, cf_logger );
+        std::vector<krb_ticket_info_t*> failed;
+        for ( size_t i = 0; i < pending.size(); i++ )
+        {
+            if ( acquired[i] )
             {
-                std::pair<int, std::string> status =
-                    Util::generate_krb_ticket_using_username_and_password( domain_name, username,
-                                                                           password, cf_logger );
-
-                if ( status.first < 0 )
-                {
-                    cf_logger.logger( LOG_ERR, "ERROR %d: Cannot get user krb ticket", status );
-                    std::cerr << Util::getCurrentTime() << '\t'
-                              << "ERROR: Cannot get user krb ticket" << std::endl;
-                }
+                renewed_krb_ticket_paths.push_back( pending[i]->krb_file_path );
+                LeaseRegistry::instance().update_ticket( *pending[i] );
             }
             else
             {
-                break;
+                failed.push_back( pending[i] );
             }
         }
-        else
+        pending.swap( failed );
+        if ( pending.empty() || user_ticket_acquired )
         {
-            renewed_krb_ticket_path = krb_cc_name;
-            i++;
+            break;
         }
+        cf_logger.logger( LOG_WARNING,
+                          "WARNING: Cannot get %d gMSA krb tickets, "
+                          "retrying with a new user krb ticket",
+                          (int)pending.size() );
+        acquire_user_ticket();
     }
 
-    return renewed_krb_ticket_path;
+    for ( auto krb_ticket : pending )
+    {
+        cf_logger.logger( LOG_ERR, "ERROR: Cannot get gMSA krb ticket using account %s",
+                          krb_ticket->service_account_name.c_str() );
+        std::cerr << Util::getCurrentTime() << '\t'
+                  << "ERROR: Cannot get gMSA krb ticket using account" << std::endl;
+    }
+    return renewed_krb_ticket_paths;
 }
 
 /**
@@ -568,52 +1039,42 @@ std::vector<std::string> delete_krb_tickets( std::string krb_files_dir, std::str
 
     std::string krb_tickets_path = krb_files_dir + "/" + lease_id;
 
-    DIR* curr_dir;
-    struct dirent* file;
-    // open the directory
-    curr_dir = opendir( krb_tickets_path.c_str() );
+    // stop renewing the lease before its tickets are destroyed
+    std::vector<krb_ticket_info_t> krb_tickets =
+        LeaseRegistry::instance().find_by_lease_id( lease_id );
+    LeaseRegistry::instance().remove_lease( lease_id );
+
     try
     {
-        if ( curr_dir )
+        for ( auto& krb_ticket : krb_tickets )
         {
-            while ( ( file = readdir( curr_dir ) ) != NULL )
+            std::string krb_file_path = krb_ticket.krb_file_path;
+            release_shared_ccache( krb_ticket.domain_name, krb_ticket.service_account_name,
+                                   get_shared_ccache_source( &krb_ticket ), krb_file_path );
+            if ( krb_ticket.keytab_output )
             {
-                std::string filename = file->d_name;
-                if ( !filename.empty() && filename.find( "_metadata" ) != std::string::npos )
-                {
-                    std::string file_path = krb_tickets_path + "/" + filename;
-                    std::list<krb_ticket_info_t*> krb_ticket_info_list =
-                        read_meta_data_json( file_path );
-
-                    for ( auto krb_ticket : krb_ticket_info_list )
-                    {
-                        std::string krb_file_path = krb_ticket->krb_file_path;
-                        std::string cmd = "export KRB5CCNAME=" + krb_file_path + " && kdestroy";
-
-                        std::pair<int, std::string> krb_ticket_destroy_result =
-                            Util::exec_shell_cmd( cmd );
-                        if ( krb_ticket_destroy_result.first == 0 )
-                        {
-                            delete_krb_ticket_paths.push_back( krb_file_path );
-                        }
-                        else
-                        {
-                            // log ticket deletion failure
-                            std::cerr << Util::getCurrentTime() << '\t'
-                                      << "Delete kerberos ticket "
-                                         "failed" +
-                                             krb_file_path
-                                      << std::endl;
-                        }
-                    }
-                }
+                forget_gmsa_keytab_file( get_lease_keytab_path( krb_file_path ) );
             }
-            // close directory
-            closedir( curr_dir );
+            std::string cmd = "export KRB5CCNAME=" + krb_file_path + " && kdestroy";
 
-            // finally delete lease file and directory
-            std::filesystem::remove_all( krb_tickets_path );
+            std::pair<int, std::string> krb_ticket_destroy_result = Util::exec_shell_cmd( cmd );
+            if ( krb_ticket_destroy_result.first == 0 )
+            {
+                delete_krb_ticket_paths.push_back( krb_file_path );
+            }
+            else
+            {
+                // log ticket deletion failure
+                std::cerr << Util::getCurrentTime() << '\t'
+                          << "Delete kerberos ticket "
+                             "failed" +
+                                 krb_file_path
+                          << std::endl;
+            }
         }
+
+        // finally delete lease directory
+        std::filesystem::remove_all( krb_tickets_path );
     }
     catch ( ... )
     {
@@ -621,7 +1082,6 @@ std::vector<std::string> delete_krb_tickets( std::string krb_files_dir, std::str
                   << "Delete kerberos ticket "
                      "failed"
                   << std::endl;
-        closedir( curr_dir );
         return delete_krb_ticket_paths;
     }
     return delete_krb_ticket_paths;
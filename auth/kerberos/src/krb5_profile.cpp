@@ -0,0 +1,354 @@
+#include "daemon.h"
+#include "util.hpp"
+#include <chrono>
+#include <linux/memfd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <profile.h>
+#include <set>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/**
+ * Per-realm krb5 profiles
+ *
+ * The static krb5.conf makes every AS/TGS exchange locate KDCs through DNS SRV
+ * lookups, canonicalize host names and negotiate enctypes. Instead, a profile is
+ * generated per realm that pins the KDC addresses, ranked by TCP connect latency,
+ * turns off host name canonicalization and only offers the AES enctypes AD issues
+ * for gMSAs. The profile lives in a memfd, in-process contexts load it through
+ * krb5_init_context_profile() and child kinit/ldapsearch processes through
+ * KRB5_CONFIG. The system configuration is layered underneath for everything else.
+ */
+#define KRB5_SYSTEM_CONFIG "/etc/krb5.conf"
+#define KRB5_PROFILE_REFRESH_SECS ( 15 * 60 )
+// Retry sooner when no KDC could be found
+#define KRB5_PROFILE_RETRY_SECS 60
+#define KDC_PORT "88"
+#define KDC_PROBE_TIMEOUT_MS 1000
+#define KRB5_AES_ENCTYPES "aes256-cts-hmac-sha1-96 aes128-cts-hmac-sha1-96"
+
+typedef struct realm_profile_t_
+{
+    int fd = -1;
+    // Kept open for one refresh period, child processes may still be reading it
+    int previous_fd = -1;
+    time_t refresh_at = 0;
+    std::string krb5_config;
+} realm_profile_t;
+
+typedef struct kdc_probe_t_
+{
+    std::string address;
+    int fd = -1;
+    int64_t latency_us = -1;
+} kdc_probe_t;
+
+static std::mutex realm_profiles_mutex;
+static std::map<std::string, realm_profile_t> realm_profiles;
+
+/**
+ * Measures the TCP connect time to port 88 of every address of the given KDCs,
+ * all connects are in flight at the same time
+ * @param kdc_hosts - Like 'dc01.contoso.com'
+ * @return - KDC addresses, fastest first, unreachable ones last in discovery order
+ */
+static std::vector<std::string> rank_kdcs_by_latency( const std::vector<std::string>& kdc_hosts )
+{
+    std::vector<kdc_probe_t> probes;
+    std::set<std::string> seen_addresses;
+    auto start = std::chrono::steady_clock::now();
+
+    for ( auto& kdc_host : kdc_hosts )
+    {
+        if ( kdc_host.empty() )
+        {
+            continue;
+        }
+        struct addrinfo hints;
+        memset( &hints, 0, sizeof( hints ) );
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* addresses = nullptr;
+        if ( getaddrinfo( kdc_host.c_str(), KDC_PORT, &hints, &addresses ) != 0 )
+        {
+            continue;
+        }
+        for ( struct addrinfo* ai = addresses; ai != nullptr; ai = ai->ai_next )
+        {
+            char host[NI_MAXHOST];
+            if ( getnameinfo( ai->ai_addr, ai->ai_addrlen, host, sizeof( host ), nullptr, 0,
+                              NI_NUMERICHOST ) != 0 )
+            {
+                continue;
+            }
+            kdc_probe_t probe;
+            probe.address = ( ai->ai_family == AF_INET6 ) ? "[" + std::string( host ) + "]"
+                                                          : std::string( host );
+            if ( !seen_addresses.insert( probe.address ).second )
+            {
+                continue;
+            }
+            probe.fd = socket( ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+            if ( probe.fd >= 0 && connect( probe.fd, ai->ai_addr, ai->ai_addrlen ) == 0 )
+            {
+                probe.latency_us = 0;
+                close( probe.fd );
+                probe.fd = -1;
+            }
+            else if ( probe.fd >= 0 && errno != EINPROGRESS )
+            {
+                close( probe.fd );
+                probe.fd = -1;
+            }
+            probes.push_back( probe );
+        }
+        freeaddrinfo( addresses );
+    }
+
+    auto deadline = start + std::chrono::milliseconds( KDC_PROBE_TIMEOUT_MS );
+    while ( true )
+    {
+        std::vector<struct pollfd> pending;
+        for ( auto& probe : probes )
+        {
+            if ( probe.fd >= 0 )
+            {
+                pending.push_back( { probe.fd, POLLOUT, 0 } );
+            }
+        }
+        auto now = std::chrono::steady_clock::now();
+        if ( pending.empty() || now >= deadline )
+        {
+            break;
+        }
+        int timeout_ms =
+            (int)std::chrono::duration_cast<std::chrono::milliseconds>( deadline - now ).count();
+        if ( poll( pending.data(), pending.size(), timeout_ms + 1 ) <= 0 )
+        {
+            continue;
+        }
+        now = std::chrono::steady_clock::now();
+        for ( auto& probe : probes )
+        {
+            for ( auto& pfd : pending )
+            {
+                if ( pfd.fd != probe.fd || pfd.revents == 0 )
+                {
+                    continue;
+                }
+                int so_error = -1;
+                socklen_t so_error_len = sizeof( so_error );
+                if ( getsockopt( probe.fd, SOL_SOCKET, SO_ERROR, &so_error, &so_error_len ) == 0 &&
+                     so_error == 0 )
+                {
+                    probe.latency_us =
+                        std::chrono::duration_cast<std::chrono::microseconds>( now - start )
+                            .count();
+                }
+                close( probe.fd );
+                probe.fd = -1;
+            }
+        }
+    }
+
+    for ( auto& probe : probes )
+    {
+        if ( probe.fd >= 0 )
+        {
+            close( probe.fd );
+            probe.fd = -1;
+        }
+    }
+
+    std::stable_sort( probes.begin(), probes.end(),
+                      []( const kdc_probe_t& a, const kdc_probe_t& b ) {
+                          if ( a.latency_us < 0 || b.latency_us < 0 )
+                          {
+                              return a.latency_us >= 0 && b.latency_us < 0;
+                          }
+                          return a.latency_us < b.latency_us;
+                      } );
+
+    std::vector<std::string> ranked_kdcs;
+    for ( auto& probe : probes )
+    {
+        ranked_kdcs.push_back( probe.address );
+    }
+    return ranked_kdcs;
+}
+
+/**
+ * Generates the profile text of a realm
+ * @param domain_name - Like 'contoso.com'
+ * @param kdcs - KDC addresses in order of preference
+ * @return - krb5.conf formatted profile
+ */
+static std::string build_krb5_profile( const std::string& domain_name,
+                                       const std::vector<std::string>& kdcs )
+{
+    std::string realm_name = domain_name;
+    std::transform( realm_name.begin(), realm_name.end(), realm_name.begin(),
+                    []( unsigned char c ) { return std::toupper( c ); } );
+
+    // KDCs are pinned by address, so DNS is only needed for the LDAP host names
+    // udp_preference_limit = 1 skips the KRB5KRB_ERR_RESPONSE_TOO_BIG retry that AD
+    // PACs trigger over UDP
+    std::string profile = "[libdefaults]\n"
+                          "    default_realm = " +
+                          realm_name +
+                          "\n"
+                          "    dns_lookup_kdc = false\n"
+                          "    dns_lookup_realm = false\n"
+                          "    dns_canonicalize_hostname = false\n"
+                          "    rdns = false\n"
+                          "    udp_preference_limit = 1\n"
+                          "    default_tkt_enctypes = " KRB5_AES_ENCTYPES "\n"
+                          "    default_tgs_enctypes = " KRB5_AES_ENCTYPES "\n"
+                          "    permitted_enctypes = " KRB5_AES_ENCTYPES "\n"
+                          "\n"
+                          "[realms]\n"
+                          "    " +
+                          realm_name + " = {\n";
+    for ( auto& kdc : kdcs )
+    {
+        profile += "        kdc = " + kdc + ":" + KDC_PORT + "\n";
+    }
+    profile += "    }\n"
+               "\n"
+               "[domain_realm]\n"
+               "    ." +
+               domain_name + " = " + realm_name + "\n" + "    " + domain_name + " = " +
+               realm_name + "\n";
+    return profile;
+}
+
+/**
+ * Writes a profile into a new memfd
+ * @param domain_name - Like 'contoso.com'
+ * @param profile - krb5.conf formatted profile
+ * @return - file descriptor, -1 on failure
+ */
+static int create_profile_memfd( const std::string& domain_name, const std::string& profile )
+{
+    // Through syscall(), glibc < 2.27 has no memfd_create() wrapper
+    std::string memfd_name = "credentials_fetcher_krb5_" + domain_name;
+    int fd = (int)syscall( SYS_memfd_create, memfd_name.c_str(), MFD_CLOEXEC );
+    if ( fd < 0 )
+    {
+        return -1;
+    }
+    size_t written = 0;
+    while ( written < profile.length() )
+    {
+        ssize_t n = write( fd, profile.c_str() + written, profile.length() - written );
+        if ( n <= 0 )
+        {
+            close( fd );
+            return -1;
+        }
+        written += (size_t)n;
+    }
+    return fd;
+}
+
+/**
+ * KRB5_CONFIG value for a domain, the per-realm profile followed by the system
+ * configuration. The profile is (re)generated when missing or older than
+ * KRB5_PROFILE_REFRESH_SECS.
+ * @param domain_name - Like 'contoso.com'
+ * @return - Like '/proc/1234/fd/7:/etc/krb5.conf', empty if no KDC could be located
+ */
+std::string get_krb5_config_for_domain( std::string domain_name )
+{
+    std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
+                    []( unsigned char c ) { return std::tolower( c ); } );
+    if ( domain_name.empty() )
+    {
+        return std::string( "" );
+    }
+
+    std::string cached_krb5_config;
+    {
+        std::lock_guard<std::mutex> lock( realm_profiles_mutex );
+        auto it = realm_profiles.find( domain_name );
+        if ( it != realm_profiles.end() )
+        {
+            if ( time( nullptr ) < it->second.refresh_at )
+            {
+                return it->second.krb5_config;
+            }
+            cached_krb5_config = it->second.krb5_config;
+        }
+    }
+
+    // Probing takes up to KDC_PROBE_TIMEOUT_MS, other realms are not held up meanwhile
+    std::vector<std::string> kdcs = rank_kdcs_by_latency( Util::get_FQDN_list( domain_name ) );
+    int fd = -1;
+    if ( !kdcs.empty() )
+    {
+        fd = create_profile_memfd( domain_name, build_krb5_profile( domain_name, kdcs ) );
+    }
+
+    std::lock_guard<std::mutex> lock( realm_profiles_mutex );
+    realm_profile_t& realm_profile = realm_profiles[domain_name];
+    if ( fd < 0 )
+    {
+        std::cerr << Util::getCurrentTime() << '\t'
+                  << "WARNING: no reachable KDC found for " << domain_name
+                  << ", using the system krb5 configuration" << std::endl;
+        realm_profile.refresh_at = time( nullptr ) + KRB5_PROFILE_RETRY_SECS;
+        return cached_krb5_config;
+    }
+
+    if ( realm_profile.previous_fd >= 0 )
+    {
+        close( realm_profile.previous_fd );
+    }
+    realm_profile.previous_fd = realm_profile.fd;
+    realm_profile.fd = fd;
+    realm_profile.refresh_at = time( nullptr ) + KRB5_PROFILE_REFRESH_SECS;
+
+    const char* system_config = getenv( "KRB5_CONFIG" );
+    // /proc/<pid> rather than /proc/self, so that child processes resolve the same file
+    realm_profile.krb5_config = "/proc/" + std::to_string( getpid() ) + "/fd/" +
+                                std::to_string( fd ) + ":" +
+                                std::string( system_config != nullptr ? system_config
+                                                                      : KRB5_SYSTEM_CONFIG );
+
+    std::string log_str = "INFO: krb5 profile for " + domain_name + " ranks KDCs";
+    for ( auto& kdc : kdcs )
+    {
+        log_str += " " + kdc;
+    }
+    std::cerr << Util::getCurrentTime() << '\t' << log_str << std::endl;
+    return realm_profile.krb5_config;
+}
+
+/**
+ * Creates a krb5 context on the per-realm profile of a domain, or on the system
+ * configuration if there is none
+ * @param domain_name - Like 'contoso.com'
+ * @param context - receives the context
+ * @return - 0 on success, krb5 error code otherwise
+ */
+krb5_error_code init_krb5_context_for_domain( const std::string& domain_name,
+                                              krb5_context* context )
+{
+    std::string krb5_config = get_krb5_config_for_domain( domain_name );
+    if ( !krb5_config.empty() )
+    {
+        profile_t profile = nullptr;
+        if ( profile_init_path( krb5_config.c_str(), &profile ) == 0 )
+        {
+            // The context keeps its own reference to the profile
+            krb5_error_code ret = krb5_init_context_profile( profile, 0, context );
+            profile_release( profile );
+            if ( ret == 0 )
+            {
+                return 0;
+            }
+        }
+    }
+    return krb5_init_context( context );
+}
@@ -0,0 +1,298 @@
+#include "daemon.h"
+#include "util.hpp"
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <openssl/sha.h>
+#include <set>
+
+/**
+ * Shared ccache store
+ *
+ * Leases for the same (domain, gMSA account, bootstrap source) receive identical
+ * credentials, so the ticket is acquired and renewed once in
+ *     <krb dir>/.shared/<sha256 of domain|account|source>/krb5cc
+ * and every lease ccache is an atomically replaced copy of it. The lease ccache paths
+ * referencing an entry are listed in its 'refs' file; the entry is removed with its
+ * last lease.
+ *
+ * Bootstrap tickets (machine keytab, secret vault or domainless user) that authorize the
+ * LDAP query get a private ccache per (domain, bootstrap source) in
+ *     <krb dir>/.bootstrap/<sha256 of domain|source>/krb5cc
+ * so concurrent acquisitions for different bootstrap principals never share the
+ * process-default ccache.
+ */
+#define SHARED_CCACHE_DIR ".shared"
+#define SHARED_CCACHE_REFS_FILE "refs"
+#define BOOTSTRAP_CCACHE_DIR ".bootstrap"
+
+static std::mutex shared_ccache_locks_mutex;
+static std::map<std::string, std::mutex> shared_ccache_locks;
+
+/**
+ * Directory of a ccache store entry
+ * @param store_dir - SHARED_CCACHE_DIR or BOOTSTRAP_CCACHE_DIR
+ * @param key - entry key, hashed into the directory name
+ * @return - directory of the entry
+ */
+static std::string get_ccache_store_dir( const std::string& store_dir, const std::string& key )
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256( (const unsigned char*)key.c_str(), key.length(), digest );
+    char digest_hex[2 * SHA256_DIGEST_LENGTH + 1];
+    for ( int i = 0; i < SHA256_DIGEST_LENGTH; i++ )
+    {
+        snprintf( digest_hex + 2 * i, 3, "%02x", digest[i] );
+    }
+
+    return std::string( CF_KRB_DIR ) + "/" + store_dir + "/" + std::string( digest_hex );
+}
+
+/**
+ * Creates a ccache store entry directory that only the daemon can access
+ * @param dir - from get_ccache_store_dir()
+ * @return - path of the entry's ccache, empty if the directory cannot be created
+ */
+static std::string create_ccache_store_dir( const std::string& dir )
+{
+    std::error_code ec;
+    std::filesystem::create_directories( dir, ec );
+    if ( ec )
+    {
+        return std::string( "" );
+    }
+    std::filesystem::permissions( dir, std::filesystem::perms::owner_all,
+                                  std::filesystem::perm_options::replace, ec );
+    return dir + "/krb5cc";
+}
+
+/**
+ * Location of the shared ccache of an account
+ * @param domain_name - Like 'contoso.com'
+ * @param gmsa_account_name - Like 'webapp01'
+ * @param source - how the ticket is bootstrapped, the lease's domainless_user
+ * @return - directory of the shared ccache
+ */
+static std::string get_shared_ccache_dir( std::string domain_name, std::string gmsa_account_name,
+                                          const std::string& source )
+{
+    std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
+                    []( unsigned char c ) { return std::tolower( c ); } );
+    std::transform( gmsa_account_name.begin(), gmsa_account_name.end(),
+                    gmsa_account_name.begin(),
+                    []( unsigned char c ) { return std::tolower( c ); } );
+    return get_ccache_store_dir( SHARED_CCACHE_DIR,
+                                 domain_name + "|" + gmsa_account_name + "|" + source );
+}
+
+/**
+ * Location of the shared ccache of an account, the directory is created on demand
+ * @param domain_name - Like 'contoso.com'
+ * @param gmsa_account_name - Like 'webapp01'
+ * @param source - how the ticket is bootstrapped, the lease's domainless_user
+ * @return - path of the shared ccache, empty if the store is not usable
+ */
+std::string get_shared_ccache_path( const std::string& domain_name,
+                                    const std::string& gmsa_account_name,
+                                    const std::string& source )
+{
+    return create_ccache_store_dir(
+        get_shared_ccache_dir( domain_name, gmsa_account_name, source ) );
+}
+
+/**
+ * Location of the private ccache of a bootstrap principal, the directory is created on
+ * demand
+ * @param domain_name - Like 'contoso.com'
+ * @param source - bootstrap source as in the lease's domainless_user: empty for the
+ *                 machine keytab, 'awsdomainlessusersecret:<secret>' or the domainless user
+ * @return - path of the bootstrap ccache, empty if the store is not usable
+ */
+std::string get_bootstrap_ccache_path( std::string domain_name, const std::string& source )
+{
+    std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
+                    []( unsigned char c ) { return std::tolower( c ); } );
+    return create_ccache_store_dir(
+        get_ccache_store_dir( BOOTSTRAP_CCACHE_DIR, domain_name + "|" + source ) );
+}
+
+/**
+ * Serializes acquisition and publication of one shared ccache
+ * @param shared_ccache_path - from get_shared_ccache_path()
+ * @return - mutex of the entry
+ */
+std::mutex& get_shared_ccache_mutex( const std::string& shared_ccache_path )
+{
+    std::lock_guard<std::mutex> lock( shared_ccache_locks_mutex );
+    return shared_ccache_locks[shared_ccache_path];
+}
+
+/**
+ * Reads the times of the TGT in a ccache
+ * @param krb_cc_name - ccache path
+ * @param times - receives the TGT times
+ * @return - true if the ccache holds a TGT
+ */
+bool get_tgt_times( const std::string& krb_cc_name, krb5_ticket_times* times )
+{
+    if ( krb_cc_name.empty() || !std::filesystem::exists( krb_cc_name ) )
+    {
+        return false;
+    }
+
+    krb5_context context = nullptr;
+    if ( krb5_init_context( &context ) != 0 )
+    {
+        return false;
+    }
+
+    bool found = false;
+    krb5_ccache ccache = nullptr;
+    krb5_cc_cursor cursor = nullptr;
+    std::string ccache_name = "FILE:" + krb_cc_name;
+    if ( krb5_cc_resolve( context, ccache_name.c_str(), &ccache ) == 0 )
+    {
+        if ( krb5_cc_start_seq_get( context, ccache, &cursor ) == 0 )
+        {
+            krb5_creds creds;
+            while ( krb5_cc_next_cred( context, ccache, &cursor, &creds ) == 0 )
+            {
+                char* server_name = nullptr;
+                if ( !krb5_is_config_principal( context, creds.server ) &&
+                     krb5_unparse_name( context, creds.server, &server_name ) == 0 )
+                {
+                    if ( std::string( server_name ).rfind( "krbtgt/", 0 ) == 0 )
+                    {
+                        *times = creds.times;
+                        found = true;
+                    }
+                    krb5_free_unparsed_name( context, server_name );
+                }
+                krb5_free_cred_contents( context, &creds );
+            }
+            krb5_cc_end_seq_get( context, ccache, &cursor );
+        }
+        krb5_cc_close( context, ccache );
+    }
+    krb5_free_context( context );
+    return found;
+}
+
+/**
+ * Checks if a shared ccache holds a TGT that is outside of the renewal window
+ * @param shared_ccache_path - from get_shared_ccache_path()
+ * @param domain_name - domain of the TGT, its renewal lead time applies
+ * @return - true if the TGT can be handed out as is
+ */
+bool is_shared_ccache_fresh( const std::string& shared_ccache_path,
+                             const std::string& domain_name )
+{
+    krb5_ticket_times times;
+    return get_tgt_times( shared_ccache_path, &times ) &&
+           (int64_t)times.endtime >
+               (int64_t)( time( nullptr ) + get_renewal_lead_time( domain_name ) );
+}
+
+/**
+ * Rewrites the refs file of a shared ccache, dropping leases whose ccache is gone
+ * @param refs_path - refs file
+ * @param add - lease ccache path to add, may be empty
+ * @param remove - lease ccache path to remove, may be empty
+ * @return - number of remaining references
+ */
+static size_t update_shared_ccache_refs( const std::string& refs_path, const std::string& add,
+                                         const std::string& remove )
+{
+    std::set<std::string> refs;
+    std::ifstream refs_in( refs_path );
+    std::string line;
+    while ( std::getline( refs_in, line ) )
+    {
+        if ( !line.empty() && line != remove && std::filesystem::exists( line ) )
+        {
+            refs.insert( line );
+        }
+    }
+    refs_in.close();
+    if ( !add.empty() )
+    {
+        refs.insert( add );
+    }
+
+    std::string refs_tmp_path = refs_path + ".tmp";
+    std::ofstream refs_out( refs_tmp_path, std::ios::trunc );
+    for ( auto& ref : refs )
+    {
+        refs_out << ref << "\n";
+    }
+    refs_out.close();
+    rename( refs_tmp_path.c_str(), refs_path.c_str() );
+
+    return refs.size();
+}
+
+/**
+ * Atomically replaces a lease ccache with a copy of the shared ccache
+ * Caller holds get_shared_ccache_mutex()
+ *
+ * @param shared_ccache_path - from get_shared_ccache_path()
+ * @param krb_cc_name - lease ccache, Like '/var/credentials_fetcher/krb_dir/<lease>/webapp01/krb5cc'
+ * @return - 0 on success
+ */
+int publish_shared_ccache( const std::string& shared_ccache_path, const std::string& krb_cc_name )
+{
+    std::error_code ec;
+    std::string krb_cc_tmp_name = krb_cc_name + ".tmp";
+    std::filesystem::copy_file( shared_ccache_path, krb_cc_tmp_name,
+                                std::filesystem::copy_options::overwrite_existing, ec );
+    if ( ec )
+    {
+        std::cerr << Util::getCurrentTime() << '\t' << "ERROR: cannot copy " << shared_ccache_path
+                  << " to " << krb_cc_tmp_name << ": " << ec.message() << std::endl;
+        return -1;
+    }
+    chmod( krb_cc_tmp_name.c_str(), S_IRUSR | S_IWUSR );
+    if ( rename( krb_cc_tmp_name.c_str(), krb_cc_name.c_str() ) != 0 )
+    {
+        perror( "rename of lease ccache failed" );
+        unlink( krb_cc_tmp_name.c_str() );
+        return -1;
+    }
+
+    std::string refs_path =
+        std::filesystem::path( shared_ccache_path ).parent_path().string() + "/" +
+        SHARED_CCACHE_REFS_FILE;
+    update_shared_ccache_refs( refs_path, krb_cc_name, "" );
+    return 0;
+}
+
+/**
+ * Drops a lease's reference to its shared ccache, the shared ccache is destroyed
+ * together with its last reference
+ * @param domain_name - Like 'contoso.com'
+ * @param gmsa_account_name - Like 'webapp01'
+ * @param source - the lease's domainless_user
+ * @param krb_cc_name - lease ccache
+ */
+void release_shared_ccache( const std::string& domain_name, const std::string& gmsa_account_name,
+                            const std::string& source, const std::string& krb_cc_name )
+{
+    std::string shared_dir = get_shared_ccache_dir( domain_name, gmsa_account_name, source );
+    std::string shared_ccache_path = shared_dir + "/krb5cc";
+    if ( !std::filesystem::exists( shared_dir ) )
+    {
+        // Lease was not served from the shared store
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock( get_shared_ccache_mutex( shared_ccache_path ) );
+    size_t remaining_refs = update_shared_ccache_refs(
+        shared_dir + "/" + SHARED_CCACHE_REFS_FILE, "", krb_cc_name );
+    if ( remaining_refs == 0 )
+    {
+        std::string cmd = "export KRB5CCNAME=" + shared_ccache_path + " && kdestroy";
+        Util::exec_shell_cmd( cmd );
+        std::error_code ec;
+        std::filesystem::remove_all( shared_dir, ec );
+    }
+}
@@ -0,0 +1,211 @@
+#include "daemon.h"
+#include "util.hpp"
+#include <set>
+#include <thread>
+
+// Upper bound on concurrent TGS requests for one ccache
+#define MAX_PARALLEL_SPN_PREFETCH 8
+
+/**
+ * Result of one TGS exchange, done on its own krb5 context
+ */
+typedef struct spn_prefetch_result_t_
+{
+    std::string spn;
+    krb5_context context = nullptr;
+    krb5_creds* creds = nullptr;
+    krb5_error_code error = 0;
+} spn_prefetch_result_t;
+
+/**
+ * Lists the service tickets in a ccache that are outside of the renewal window
+ * @param context - krb5 context
+ * @param ccache - ccache to scan
+ * @return - unparsed server principals
+ */
+static std::set<std::string> get_fresh_service_tickets( krb5_context context, krb5_ccache ccache )
+{
+    std::set<std::string> fresh_spns;
+    krb5_cc_cursor cursor = nullptr;
+    if ( krb5_cc_start_seq_get( context, ccache, &cursor ) != 0 )
+    {
+        return fresh_spns;
+    }
+
+    krb5_timestamp renew_at = (krb5_timestamp)( time( nullptr ) +
+                                                RENEW_TICKET_HOURS * SECONDS_IN_HOUR );
+    krb5_creds creds;
+    while ( krb5_cc_next_cred( context, ccache, &cursor, &creds ) == 0 )
+    {
+        char* server_name = nullptr;
+        if ( !krb5_is_config_principal( context, creds.server ) &&
+             creds.times.endtime > renew_at &&
+             krb5_unparse_name( context, creds.server, &server_name ) == 0 )
+        {
+            fresh_spns.insert( server_name );
+            krb5_free_unparsed_name( context, server_name );
+        }
+        krb5_free_cred_contents( context, &creds );
+    }
+    krb5_cc_end_seq_get( context, ccache, &cursor );
+    return fresh_spns;
+}
+
+/**
+ * Fetches one service ticket without storing it
+ * @param ccache_name - ccache with the TGT
+ * @param domain_name - domain of the TGT realm, selects the krb5 profile
+ * @param result - spn to fetch, receives the credentials
+ */
+static void fetch_service_ticket( std::string ccache_name, std::string domain_name,
+                                  spn_prefetch_result_t* result )
+{
+    krb5_ccache ccache = nullptr;
+    krb5_creds in_creds;
+    memset( &in_creds, 0, sizeof( in_creds ) );
+
+    result->error = init_krb5_context_for_domain( domain_name, &result->context );
+    if ( result->error != 0 )
+    {
+        result->context = nullptr;
+        return;
+    }
+    result->error = krb5_cc_resolve( result->context, ccache_name.c_str(), &ccache );
+    if ( result->error == 0 )
+    {
+        result->error = krb5_cc_get_principal( result->context, ccache, &in_creds.client );
+    }
+    if ( result->error == 0 )
+    {
+        result->error = krb5_parse_name( result->context, result->spn.c_str(), &in_creds.server );
+    }
+    if ( result->error == 0 )
+    {
+        // Tickets are stored by the caller so that the ccache has a single writer
+        result->error = krb5_get_credentials( result->context, KRB5_GC_NO_STORE, ccache,
+                                              &in_creds, &result->creds );
+    }
+
+    if ( in_creds.server != nullptr )
+    {
+        krb5_free_principal( result->context, in_creds.server );
+    }
+    if ( in_creds.client != nullptr )
+    {
+        krb5_free_principal( result->context, in_creds.client );
+    }
+    if ( ccache != nullptr )
+    {
+        krb5_cc_close( result->context, ccache );
+    }
+}
+
+/**
+ * Prefetches service tickets into a ccache that holds a TGT
+ * Only SPNs without a ticket outside of the renewal window hit the KDC, the TGS
+ * requests run in parallel.
+ *
+ * @param krb_cc_name - Like '/var/credentials_fetcher/krb_dir/krb5_cc'
+ * @param spns - Like 'MSSQLSvc/sql01.contoso.com:1433', realm defaults to the TGT realm
+ * @param cf_logger - log to systemd daemon
+ * @return - number of SPNs that could not be fetched
+ */
+int prefetch_service_tickets( const std::string& krb_cc_name, const std::vector<std::string>& spns,
+                              CF_logger& cf_logger )
+{
+    if ( spns.empty() )
+    {
+        return 0;
+    }
+
+    krb5_context context = nullptr;
+    if ( krb5_init_context( &context ) != 0 )
+    {
+        return (int)spns.size();
+    }
+
+    std::string ccache_name = "FILE:" + krb_cc_name;
+    krb5_ccache ccache = nullptr;
+    krb5_principal client = nullptr;
+    if ( krb5_cc_resolve( context, ccache_name.c_str(), &ccache ) != 0 ||
+         krb5_cc_get_principal( context, ccache, &client ) != 0 )
+    {
+        if ( ccache != nullptr )
+        {
+            krb5_cc_close( context, ccache );
+        }
+        krb5_free_context( context );
+        return (int)spns.size();
+    }
+    std::string realm( client->realm.data, client->realm.length );
+    krb5_free_principal( context, client );
+    std::string domain_name = realm;
+    std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
+                    []( unsigned char c ) { return std::tolower( c ); } );
+
+    std::set<std::string> fresh_spns = get_fresh_service_tickets( context, ccache );
+    std::vector<spn_prefetch_result_t> results;
+    for ( auto spn : spns )
+    {
+        if ( spn.find( '@' ) == std::string::npos )
+        {
+            spn += "@" + realm;
+        }
+        if ( !fresh_spns.count( spn ) )
+        {
+            spn_prefetch_result_t result;
+            result.spn = spn;
+            results.push_back( result );
+            fresh_spns.insert( spn );
+        }
+    }
+
+    int num_failed = 0;
+    if ( !results.empty() )
+    {
+        // Probe the KDCs once here rather than in every worker
+        get_krb5_config_for_domain( domain_name );
+    }
+    for ( size_t start = 0; start < results.size(); start += MAX_PARALLEL_SPN_PREFETCH )
+    {
+        size_t end = std::min( results.size(), start + MAX_PARALLEL_SPN_PREFETCH );
+        std::vector<std::thread> workers;
+        for ( size_t i = start; i < end; i++ )
+        {
+            workers.push_back(
+                std::thread( fetch_service_ticket, ccache_name, domain_name, &results[i] ) );
+        }
+        for ( auto& worker : workers )
+        {
+            worker.join();
+        }
+    }
+
+    for ( auto& result : results )
+    {
+        if ( result.error == 0 && result.creds != nullptr )
+        {
+            result.error = krb5_cc_store_cred( context, ccache, result.creds );
+        }
+        if ( result.error != 0 )
+        {
+            num_failed++;
+            const char* err_msg = krb5_get_error_message( context, result.error );
+            cf_logger.logger( LOG_WARNING, "WARNING: cannot prefetch service ticket %s: %s",
+                              result.spn.c_str(), err_msg );
+            krb5_free_error_message( context, err_msg );
+        }
+        if ( result.context != nullptr )
+        {
+            if ( result.creds != nullptr )
+            {
+                krb5_free_creds( result.context, result.creds );
+            }
+            krb5_free_context( result.context );
+        }
+    }
+
+    krb5_cc_close( context, ccache );
+    krb5_free_context( context );
+    return num_failed;
+}
@@ -30,4 +30,9 @@
 krb5_error_code kinit_kdb_init(krb5_context *pcontext, char *realm);
 void kinit_kdb_fini(void);
 
+/* PA-ETYPE-INFO2 cache, see auth/kerberos/src/etype_info_cache.cpp */
+void *cf_etype_info_begin(krb5_context context, krb5_const_principal principal,
+                          krb5_get_init_creds_opt *opts);
+int cf_etype_info_end(krb5_context context, void *state, krb5_error_code ret);
+
 #endif /* KINIT_EXTERN_H */
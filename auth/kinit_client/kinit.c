@@ -35,6 +35,7 @@
 #include <time.h>
 #include <errno.h>
 #include <com_err.h>
+#include <pthread.h>
 
 #ifndef _WIN32
 #define GET_PROGNAME(x) (strrchr((x), '/') ? strrchr((x), '/') + 1 : (x))
@@ -143,6 +144,14 @@ struct userdata {
 struct userdata udata;
 
 static krb5_context errctx;
+/* Optional KRB5_CONFIG style path list used instead of the default profile */
+static const char *kinit_config_path;
+/* Optional output ccache used instead of the default ccache */
+static const char *kinit_ccache_name;
+/* Set when an AS exchange failed on stale cached etype info */
+static int kinit_etype_info_stale;
+/* kinit keeps its state in globals, bootstraps from parallel renewals take turns */
+static pthread_mutex_t kinit_mutex = PTHREAD_MUTEX_INITIALIZER;
 static void
 extended_com_err_fn(const char *myprog, errcode_t code, const char *fmt,
                     va_list args)
@@ -168,7 +177,18 @@ k5_begin(struct k_opts *opts, struct k5_data *k5)
     const char *deftype = NULL;
     char *defrealm, *name;
 
-    ret = krb5_init_context(&k5->ctx);
+    if (kinit_config_path != NULL && *kinit_config_path != '\0') {
+        profile_t profile = NULL;
+        ret = profile_init_path(kinit_config_path, &profile);
+        if (!ret) {
+            ret = krb5_init_context_profile(profile, 0, &k5->ctx);
+            profile_release(profile);
+        }
+        if (ret)
+            ret = krb5_init_context(&k5->ctx);
+    } else {
+        ret = krb5_init_context(&k5->ctx);
+    }
     if (ret) {
         com_err(progname, ret, _("while initializing Kerberos 5 library"));
         return 0;
@@ -404,6 +424,7 @@ k5_kinit(struct k_opts *opts, struct k5_data *k5)
     krb5_address **addresses = NULL;
     krb5_principal cprinc;
     krb5_ccache mcc = NULL;
+    void *etype_info = NULL;
     int i;
 
     memset(&my_creds, 0, sizeof(my_creds));
@@ -504,10 +525,12 @@ k5_kinit(struct k_opts *opts, struct k5_data *k5)
 
     switch (opts->action) {
     case INIT_PW:
+        etype_info = cf_etype_info_begin(k5->ctx, k5->me, options);
         ret = krb5_get_init_creds_password(k5->ctx, &my_creds, k5->me, 0,
                                            kinit_prompter, &pwprompt,
                                            opts->starttime, opts->service_name,
                                            options);
+        kinit_etype_info_stale = cf_etype_info_end(k5->ctx, etype_info, ret);
         break;
     case INIT_KT:
         ret = krb5_get_init_creds_keytab(k5->ctx, &my_creds, k5->me, keytab,
@@ -633,13 +656,20 @@ my_kinit_main(int argc, char *argv[])
     opts.action = INIT_PW;
     opts.principal_name = argv[1];
     opts.verbose = 1;
+    if (kinit_ccache_name != NULL && *kinit_ccache_name != '\0')
+        opts.k5_out_cache_name = (char *)kinit_ccache_name;
 
     memset(&k5, 0, sizeof(k5));
 
     set_com_err_hook(extended_com_err_fn);
 
-    if (k5_begin(&opts, &k5))
+    if (k5_begin(&opts, &k5)) {
+        kinit_etype_info_stale = 0;
         authed_k5 = k5_kinit(&opts, &k5);
+        /* The stale etype info is gone, retry with a plain AS-REQ */
+        if (!authed_k5 && kinit_etype_info_stale)
+            authed_k5 = k5_kinit(&opts, &k5);
+    }
 
     if (authed_k5 && opts.verbose)
         fprintf(stderr, _("Authenticated to Kerberos v5\n"));
@@ -653,3 +683,24 @@ my_kinit_main(int argc, char *argv[])
         return(1);
     return 0;
 }
+
+/*
+ * Same as my_kinit_main(), with the krb5 context created on the profile files in
+ * config_path (colon separated, like KRB5_CONFIG) and the ticket stored in
+ * ccache_name, each when not empty
+ */
+int
+my_kinit_main_with_options(int argc, char *argv[], const char *config_path,
+                           const char *ccache_name)
+{
+    int ret;
+
+    pthread_mutex_lock(&kinit_mutex);
+    kinit_config_path = config_path;
+    kinit_ccache_name = ccache_name;
+    ret = my_kinit_main(argc, argv);
+    kinit_config_path = NULL;
+    kinit_ccache_name = NULL;
+    pthread_mutex_unlock(&kinit_mutex);
+    return ret;
+}
@@ -1,8 +1,13 @@
 
 
-// renew the ticket 1 hrs before the expiration
+// renew the ticket 1 hrs before the expiration, until the acquisition latency and failure
+// rate of its domain are known
 #define RENEW_TICKET_HOURS 1
 #define SECONDS_IN_HOUR 3600
+// upper bound on requested ticket and renewable lifetimes
+#define MAX_TICKET_LIFETIME_SECS ( 365 * 24 * SECONDS_IN_HOUR )
+// keytab written next to the lease ccache in keytab output mode
+#define LEASE_KEYTAB_FILE_NAME "krb5.keytab"
 // Active Directory uses NetBIOS computer names that do not exceed 15 characters.
 // https://learn.microsoft.com/en-us/troubleshoot/windows-server/identity/naming-conventions-for-computer-domain-site-ou
 #define HOST_NAME_LENGTH_LIMIT 15
@@ -12,5 +17,13 @@
 #define ENV_CF_GMSA_SECRET_NAME "CREDENTIALS_FETCHER_SECRET_NAME_FOR_DOMAINLESS_GMSA"
 #define ENV_CF_DOMAIN_CONTROLLER "DOMAIN_CONTROLLER_GMSA"
 #define ENV_CF_DISTINGUISHED_NAME "CF_GMSA_DISTINGUISHED_NAME"
+/* Default TGT lifetimes in seconds for leases that do not request any */
+#define ENV_CF_TICKET_LIFETIME "CF_TICKET_LIFETIME_SECS"
+#define ENV_CF_RENEW_LIFETIME "CF_TICKET_RENEW_LIFETIME_SECS"
+/* Fraction of the ticket lifetime over which renewals are spread, 0 to 1 */
+#define ENV_CF_RENEWAL_SPREAD "CF_RENEWAL_SPREAD_FACTOR"
+/* Retries a renewal should be able to make before the ticket expires */
+#define ENV_CF_RENEWAL_RETRY_BUDGET "CF_RENEWAL_RETRY_BUDGET"
 
 extern "C" int my_kinit_main(int, char **);
+extern "C" int my_kinit_main_with_options(int, char **, const char *, const char *);
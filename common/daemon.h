@@ -9,6 +9,7 @@
 #include <cstdlib>
 #include <fcntl.h>
 #include <filesystem>
+#include <functional>
 #include <getopt.h>
 #include <glib.h>
 #include <iomanip>
@@ -17,9 +18,11 @@
 #include <krb5/krb5.h>
 #include <list>
 #include <map>
+#include <mutex>
 #include <netinet/in.h>
 #include <regex>
 #include <resolv.h>
+#include <set>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -64,6 +67,13 @@ class krb_ticket_info_t
     std::string credspec_info;
     std::string distinguished_name;
     std::string credential_arn;
+    // service tickets to keep in the ccache next to the TGT
+    std::vector<std::string> prefetch_spns;
+    // requested TGT lifetimes in seconds, 0 leaves it to the realm
+    uint32_t ticket_lifetime = 0;
+    uint32_t renew_lifetime = 0;
+    // also write the gMSA keys to a keytab next to the ccache
+    bool keytab_output = false;
 };
 
 /*
@@ -92,6 +102,9 @@ class CF_logger
     void write_log( const char* format, ... )
     {
         const int max_log_len = 10 * 1024 * 1024; // 10 MB
+        // Renewal workers log concurrently, and copies of the logger share the log file
+        static std::mutex write_log_mutex;
+        std::lock_guard<std::mutex> lock( write_log_mutex );
 
         char buffer[256];
         va_list args;
@@ -157,6 +170,11 @@ class Daemon
     /* TBD:: Fill this later */
 
   public: /* Add get methods */
+    Daemon() = default;
+    // One context is shared by all threads, copies would miss shutdown and wake ups
+    Daemon( const Daemon& ) = delete;
+    Daemon& operator=( const Daemon& ) = delete;
+
     uint64_t watchdog_interval_usecs = 0;
     char* config_file = NULL;
     std::string krb_files_dir;
@@ -168,9 +186,27 @@ class Daemon
     CF_logger cf_logger;
     bool run_diagnostic = false;
     std::string aws_sm_secret_name; /* TBD:: Extend to other secret stores */
-    // run ticket renewal every 10 minutes
+    // pick up new leases for renewal every 10 minutes, renewals run when tickets are due
     uint64_t krb_ticket_handle_interval = 10;
-    volatile sig_atomic_t got_systemd_shutdown_signal;
+    volatile sig_atomic_t got_systemd_shutdown_signal = 0;
+    volatile sig_atomic_t got_config_reload_signal = 0;
+    // eventfd polled by the renewal thread
+    int renewal_event_fd = -1;
+
+    /**
+     * Wakes the renewal thread on shutdown, reload or a renewal request, async-signal-safe
+     */
+    void wake_renewal_thread()
+    {
+        if ( renewal_event_fd >= 0 )
+        {
+            uint64_t one = 1;
+            if ( write( renewal_event_fd, &one, sizeof( one ) ) < 0 )
+            {
+                // The counter is saturated, the thread is already due to wake up
+            }
+        }
+    }
 };
 
 // https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-adts/a9019740-3d73-46ef-a9ae-3ea8eb86ac2e
@@ -189,13 +225,39 @@ typedef struct blob_t_
     /* TBD:: Add remaining fields here */
 } blob_t;
 
+// Enctype, salt and s2kparams of a principal's long-term key, from PA-ETYPE-INFO2
+typedef struct etype_info_t_
+{
+    krb5_enctype etype = ENCTYPE_NULL;
+    std::string salt;
+    std::string s2kparams;
+} etype_info_t;
+
+// Renewals expected in one hour against one domain controller
+typedef struct renewal_forecast_t_
+{
+    std::string domain_name;
+    std::string domain_controller;
+    time_t bucket_start = 0;
+    uint32_t renewals = 0;
+    uint32_t ldap_operations = 0;
+    uint32_t kdc_operations = 0;
+} renewal_forecast_t;
+
+// Outcome of renew_leases_async(): the lease ccaches renewed and the ones still pending
+typedef std::function<void( const std::set<std::string>& renewed,
+                            const std::set<std::string>& pending )>
+    lease_renewal_callback_t;
+
 /* TBD: Move to class and methods */
 /**
  * Methods in auth module
  */
 std::vector<std::string> get_meta_data_file_paths( std::string krbdir );
-std::string renew_gmsa_ticket( krb_ticket_info_t* krb_ticket, std::string domain_name,
-                               std::string username, std::string password, CF_logger& cf_logger );
+std::list<std::string> renew_gmsa_tickets( std::vector<krb_ticket_info_t>& krb_tickets,
+                                           const std::string& domain_name,
+                                           const std::string& username,
+                                           const std::string& password, CF_logger& cf_logger );
 void truncate_log_files();
 std::string getCurrentTime();
 int generate_host_machine_krb_ticket( const char* krb_ccname = "" );
@@ -212,6 +274,47 @@ std::pair<int, std::string> fetch_gmsa_password_and_create_krb_ticket(
     std::string domain_name, krb_ticket_info_t*, const std::string& krb_cc_name,
     CF_logger& cf_logger );
 
+std::pair<int, std::string> kinit_using_gmsa_keytab( const uint8_t* gmsa_password,
+                                                     uint64_t password_generation,
+                                                     std::string gmsa_account_name,
+                                                     std::string domain_name,
+                                                     const std::string& krb_cc_name,
+                                                     krb5_deltat ticket_lifetime,
+                                                     krb5_deltat renew_lifetime,
+                                                     CF_logger& cf_logger );
+std::string get_gmsa_default_salt( std::string gmsa_account_name, std::string domain_name );
+int write_gmsa_keytab_file( const uint8_t* gmsa_password, uint64_t password_generation,
+                            std::string gmsa_account_name, std::string domain_name,
+                            const std::string& keytab_path, CF_logger& cf_logger );
+void forget_gmsa_keytab_file( const std::string& keytab_path );
+std::string get_lease_keytab_path( const std::string& krb_cc_name );
+
+std::string get_shared_ccache_path( const std::string& domain_name,
+                                    const std::string& gmsa_account_name,
+                                    const std::string& source );
+std::mutex& get_shared_ccache_mutex( const std::string& shared_ccache_path );
+bool get_tgt_times( const std::string& krb_cc_name, krb5_ticket_times* times );
+bool is_shared_ccache_fresh( const std::string& shared_ccache_path,
+                             const std::string& domain_name );
+int publish_shared_ccache( const std::string& shared_ccache_path, const std::string& krb_cc_name );
+void release_shared_ccache( const std::string& domain_name, const std::string& gmsa_account_name,
+                            const std::string& source, const std::string& krb_cc_name );
+std::string get_bootstrap_ccache_path( std::string domain_name, const std::string& source );
+
+int prefetch_service_tickets( const std::string& krb_cc_name, const std::vector<std::string>& spns,
+                              CF_logger& cf_logger );
+
+std::string get_krb5_config_for_domain( std::string domain_name );
+krb5_error_code init_krb5_context_for_domain( const std::string& domain_name,
+                                              krb5_context* context );
+
+bool parse_etype_info_trace( const std::string& message, etype_info_t* etype_info );
+bool get_cached_etype_info( const std::string& principal_name, etype_info_t* etype_info );
+void invalidate_cached_etype_info( const std::string& principal_name );
+extern "C" void* cf_etype_info_begin( krb5_context context, krb5_const_principal principal,
+                                      krb5_get_init_creds_opt* opts );
+extern "C" int cf_etype_info_end( krb5_context context, void* state, krb5_error_code ret );
+
 std::list<std::string> renew_kerberos_tickets_domainless( std::string krb_files_dir,
                                                           std::string domain_name,
                                                           std::string username,
@@ -223,6 +326,8 @@ void krb_ticket_creation( const char* ldap_uri_arg, const char* gmsa_account_nam
 
 bool is_ticket_ready_for_renewal( krb_ticket_info_t* krb_ticket_info, CF_logger& cf_logger );
 
+bool is_ticket_in_renewal_window( const krb_ticket_info_t& krb_ticket );
+
 std::string get_ticket_expiration( std::string klist_ticket_info );
 
 std::vector<std::string> delete_krb_tickets( std::string krb_files_dir, std::string lease_id );
@@ -237,7 +342,12 @@ int config_parse_test();
 int read_meta_data_json_test();
 int read_meta_data_invalid_json_test();
 int write_meta_data_json_test();
+int read_meta_data_json_rss_test();
 int renewal_failure_krb_dir_not_found_test();
+int gmsa_password_cache_test();
+int renewal_lead_time_test();
+int lease_store_test();
+int lease_registry_symbols_test();
 
 /**
  * Methods in config module
@@ -260,6 +370,11 @@ bool contains_invalid_characters_in_ad_account_name( const std::string& value );
 
 int parse_cred_spec( std::string credspec_data, krb_ticket_info_t* krb_ticket_info );
 
+int add_prefetch_spns( const std::vector<std::string>& spns, krb_ticket_info_t* krb_ticket_info );
+
+int set_ticket_lifetimes( uint32_t ticket_lifetime, uint32_t renew_lifetime,
+                          krb_ticket_info_t* krb_ticket_info );
+
 int parse_cred_spec_domainless( std::string credspec_data, krb_ticket_info_t* krb_ticket_info,
                                 krb_ticket_arn_mapping_t* krb_ticket_mapping );
 
@@ -291,18 +406,34 @@ Aws::Auth::AWSCredentials get_credentials( std::string accessKeyId, std::string
 /**
  * Methods in renewal module
  */
-int krb_ticket_renew_handler( Daemon cf_daemon );
+int krb_ticket_renew_handler( Daemon& cf_daemon );
+bool request_lease_renewal( const std::string& krb_cc_name );
+bool renew_leases_async( const std::vector<std::string>& krb_cc_names, int timeout_secs,
+                         lease_renewal_callback_t on_done );
+bool is_scheduled_lease( const krb_ticket_info_t& krb_ticket );
+time_t get_renewal_lead_time( const std::string& domain_name );
+std::vector<renewal_forecast_t> get_renewal_forecast( uint32_t hours );
+int watch_krb_files_dir( const std::string& krb_files_dir );
+void resync_krb_files_dir( const std::string& krb_files_dir );
+std::vector<std::string> apply_krb_files_dir_events( int inotify_fd,
+                                                     const std::string& krb_files_dir );
 
 /**
  * Methods in metadata module
  */
 bool contains_invalid_characters( const std::string& path );
-std::list<krb_ticket_info_t*> read_meta_data_json( std::string file_path );
+std::vector<krb_ticket_info_t> read_meta_data_json( std::string file_path );
 
-int write_meta_data_json( krb_ticket_info_t* krb_ticket_info, std::string lease_id,
+int write_meta_data_json( const krb_ticket_info_t& krb_ticket_info, std::string lease_id,
                           std::string krb_files_dir );
 
-int write_meta_data_json( std::list<krb_ticket_info_t*> krb_ticket_info_list, std::string lease_id,
-                          std::string krb_files_dir );
+int write_meta_data_json( const std::vector<krb_ticket_info_t>& krb_ticket_info_list,
+                          std::string lease_id, std::string krb_files_dir );
+
+std::map<std::string, std::vector<krb_ticket_info_t>> load_lease_store(
+    const std::string& krb_files_dir );
+int put_lease_record( const std::string& krb_files_dir, const std::string& lease_id,
+                      const std::vector<krb_ticket_info_t>& krb_tickets );
+int delete_lease_record( const std::string& krb_files_dir, const std::string& lease_id );
 
 #endif // _daemon_h_
@@ -0,0 +1,208 @@
+#ifndef _dc_latency_tracker_hpp_
+#define _dc_latency_tracker_hpp_
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// latencies kept per domain controller for the percentile
+#define DC_LATENCY_SAMPLES 100
+// samples needed before the observed p95 replaces the default hedge delay
+#define DC_LATENCY_MIN_SAMPLES 20
+#define DC_HEDGE_DEFAULT_DELAY_MS 1000
+#define DC_HEDGE_MIN_DELAY_MS 50
+#define DC_HEDGE_MAX_DELAY_MS 5000
+// at most this many hedged requests in flight across the daemon
+#define DC_HEDGE_MAX_IN_FLIGHT 4
+// every primary request earns this fraction of a hedge, bounding hedges to ~10% of requests
+#define DC_HEDGE_BUDGET_PER_REQUEST 0.1
+#define DC_HEDGE_MAX_BUDGET 10.0
+
+/**
+ * DcLatencyTracker - observed latencies of domain controllers and the hedging budget
+ *
+ * A request to a domain controller that has not answered within that controller's p95
+ * latency is repeated against the next ranked one, and the first answer wins. Hedges
+ * draw from a budget that grows with the number of primary requests and are limited in
+ * flight, so a slow site cannot double the load on the domain controllers.
+ */
+class DcLatencyTracker
+{
+  public:
+    static DcLatencyTracker& instance()
+    {
+        static DcLatencyTracker tracker;
+        return tracker;
+    }
+
+    /**
+     * Records the latency of a successful request
+     * @param dc - Like 'dc01.contoso.com'
+     * @param latency - time until the answer
+     */
+    void record( const std::string& dc, std::chrono::milliseconds latency )
+    {
+        std::lock_guard<std::mutex> lock( tracker_mutex );
+        std::deque<int64_t>& samples = latencies[dc];
+        samples.push_back( latency.count() );
+        if ( samples.size() > DC_LATENCY_SAMPLES )
+        {
+            samples.pop_front();
+        }
+    }
+
+    /**
+     * How long to wait for a domain controller before hedging
+     * @param dc - Like 'dc01.contoso.com'
+     * @return - observed p95 latency, the default until enough samples are recorded
+     */
+    std::chrono::milliseconds get_hedge_delay( const std::string& dc )
+    {
+        std::lock_guard<std::mutex> lock( tracker_mutex );
+        auto it = latencies.find( dc );
+        if ( it == latencies.end() || it->second.size() < DC_LATENCY_MIN_SAMPLES )
+        {
+            return std::chrono::milliseconds( DC_HEDGE_DEFAULT_DELAY_MS );
+        }
+        int64_t p95 = std::max<int64_t>( DC_HEDGE_MIN_DELAY_MS,
+                                          std::min<int64_t>( get_p95( it->second ),
+                                                             DC_HEDGE_MAX_DELAY_MS ) );
+        return std::chrono::milliseconds( p95 );
+    }
+
+    /**
+     * Orders the domain controllers of a domain fastest first and remembers the order
+     * @param domain_name - Like 'contoso.com'
+     * @param dcs - domain controllers in DNS order
+     * @return - dcs by observed p95 latency, the ones without samples last in DNS order
+     */
+    std::vector<std::string> rank( const std::string& domain_name, std::vector<std::string> dcs )
+    {
+        std::lock_guard<std::mutex> lock( tracker_mutex );
+        std::map<std::string, int64_t> p95s;
+        for ( auto& dc : dcs )
+        {
+            auto it = latencies.find( dc );
+            if ( it != latencies.end() && !it->second.empty() )
+            {
+                p95s[dc] = get_p95( it->second );
+            }
+        }
+        std::stable_sort( dcs.begin(), dcs.end(),
+                          [&p95s]( const std::string& a, const std::string& b ) {
+                              auto a_it = p95s.find( a );
+                              auto b_it = p95s.find( b );
+                              if ( a_it == p95s.end() || b_it == p95s.end() )
+                              {
+                                  return a_it != p95s.end() && b_it == p95s.end();
+                              }
+                              return a_it->second < b_it->second;
+                          } );
+        ranked_dcs[get_domain_key( domain_name )] = dcs;
+        return dcs;
+    }
+
+    /**
+     * Domain controller the next request of a domain goes to, without a DNS lookup
+     * @param domain_name - Like 'contoso.com'
+     * @return - fastest domain controller of the last ranking, empty if never ranked
+     */
+    std::string get_primary_dc( const std::string& domain_name )
+    {
+        std::lock_guard<std::mutex> lock( tracker_mutex );
+        auto it = ranked_dcs.find( get_domain_key( domain_name ) );
+        if ( it == ranked_dcs.end() || it->second.empty() )
+        {
+            return "";
+        }
+        // samples recorded since the ranking may have changed the order
+        std::string primary = it->second.front();
+        int64_t primary_p95 = -1;
+        for ( auto& dc : it->second )
+        {
+            auto samples = latencies.find( dc );
+            if ( samples == latencies.end() || samples->second.empty() )
+            {
+                continue;
+            }
+            int64_t p95 = get_p95( samples->second );
+            if ( primary_p95 < 0 || p95 < primary_p95 )
+            {
+                primary = dc;
+                primary_p95 = p95;
+            }
+        }
+        return primary;
+    }
+
+    /**
+     * Accounts for a primary request, which earns budget for later hedges
+     */
+    void add_request()
+    {
+        std::lock_guard<std::mutex> lock( tracker_mutex );
+        hedge_budget = std::min( hedge_budget + DC_HEDGE_BUDGET_PER_REQUEST, DC_HEDGE_MAX_BUDGET );
+    }
+
+    /**
+     * Claims a hedge, must be paired with release_hedge() when granted
+     * @return - true if the hedge may be sent
+     */
+    bool try_acquire_hedge()
+    {
+        std::lock_guard<std::mutex> lock( tracker_mutex );
+        if ( hedges_in_flight >= DC_HEDGE_MAX_IN_FLIGHT || hedge_budget < 1.0 )
+        {
+            return false;
+        }
+        hedge_budget -= 1.0;
+        hedges_in_flight++;
+        return true;
+    }
+
+    void release_hedge()
+    {
+        std::lock_guard<std::mutex> lock( tracker_mutex );
+        if ( hedges_in_flight > 0 )
+        {
+            hedges_in_flight--;
+        }
+    }
+
+    DcLatencyTracker( const DcLatencyTracker& ) = delete;
+    DcLatencyTracker& operator=( const DcLatencyTracker& ) = delete;
+
+  private:
+    DcLatencyTracker() = default;
+
+    static int64_t get_p95( const std::deque<int64_t>& samples )
+    {
+        std::vector<int64_t> sorted( samples.begin(), samples.end() );
+        size_t p95_index = ( sorted.size() * 95 + 99 ) / 100 - 1;
+        std::nth_element( sorted.begin(), sorted.begin() + p95_index, sorted.end() );
+        return sorted[p95_index];
+    }
+
+    static std::string get_domain_key( std::string domain_name )
+    {
+        std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
+                        []( unsigned char c ) { return std::tolower( c ); } );
+        return domain_name;
+    }
+
+    std::map<std::string, std::deque<int64_t>> latencies;
+    // domain -> domain controllers of the last rank()
+    std::map<std::string, std::vector<std::string>> ranked_dcs;
+    // A full budget lets the first slow requests after startup be hedged
+    double hedge_budget = DC_HEDGE_MAX_BUDGET;
+    int hedges_in_flight = 0;
+    std::mutex tracker_mutex;
+};
+
+#endif // _dc_latency_tracker_hpp_
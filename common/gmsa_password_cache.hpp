@@ -0,0 +1,334 @@
+#ifndef _gmsa_password_cache_hpp_
+#define _gmsa_password_cache_hpp_
+
+#include "daemon.h"
+#include "secure_arena.hpp"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <string>
+#include <vector>
+
+// msDS-ManagedPassword intervals are expressed in 100ns ticks
+#define GMSA_INTERVAL_TICKS_PER_SECOND 10000000LL
+// refresh a cached password this long before AD is due to rotate it
+#define GMSA_PASSWORD_REFRESH_MARGIN_SECS ( 30 * 60 )
+
+/**
+ * GmsaPasswordCache - in-memory cache of current gMSA passwords
+ *
+ * AD rotates a gMSA password every ManagedPasswordIntervalInDays (30 by default) and
+ * tells the caller how long the current password stays valid through the
+ * QueryPasswordInterval field of the msDS-ManagedPassword blob. Entries are kept until
+ * that point minus GMSA_PASSWORD_REFRESH_MARGIN_SECS so kinit can skip the ldapsearch, but
+ * never refreshed before the UnchangedPasswordInterval the password is guaranteed to last.
+ *
+ * Passwords are held AES-256-GCM encrypted under a per-process random key that lives in
+ * the SecureArena; plaintext is only ever decrypted into caller supplied arena memory.
+ * Every password change for an account bumps its generation counter.
+ */
+class GmsaPasswordCache
+{
+  public:
+    static GmsaPasswordCache& instance()
+    {
+        static GmsaPasswordCache cache;
+        return cache;
+    }
+
+    /**
+     * Reads a 64-bit interval out of a msDS-ManagedPassword blob
+     * @param blob - base64 decoded blob
+     * @param blob_len - length of the decoded blob
+     * @param offset - query_password_interval_offset or unchanged_password_interval_offset
+     * @return - interval in seconds, -1 if the offset is absent or out of bounds
+     */
+    static int64_t get_password_interval_secs( const blob_t* blob, size_t blob_len,
+                                               uint16_t offset )
+    {
+        int64_t ticks = 0;
+        if ( blob == nullptr || offset == 0 || (size_t)offset + sizeof( ticks ) > blob_len )
+        {
+            return -1;
+        }
+        memcpy( &ticks, (const uint8_t*)blob + offset, sizeof( ticks ) );
+        if ( ticks < 0 )
+        {
+            return -1;
+        }
+        return ticks / GMSA_INTERVAL_TICKS_PER_SECOND;
+    }
+
+    /**
+     * Caches the current password of a freshly fetched blob
+     * @param domain_name - Like 'contoso.com'
+     * @param gmsa_account_name - Like 'webapp01'
+     * @param blob - base64 decoded msDS-ManagedPassword blob
+     * @param blob_len - length of the decoded blob
+     * @param generation - optional, set to the password generation
+     * @return - true if the password was cached
+     */
+    bool put( const std::string& domain_name, const std::string& gmsa_account_name,
+              const blob_t* blob, size_t blob_len, uint64_t* generation = nullptr )
+    {
+        if ( key == nullptr || blob == nullptr ||
+             offsetof( blob_t, current_password ) + GMSA_PASSWORD_SIZE > blob_len )
+        {
+            return false;
+        }
+
+        int64_t query_interval_secs = std::max<int64_t>(
+            get_password_interval_secs( blob, blob_len, blob->query_password_interval_offset ),
+            0 );
+        // -1 when the blob does not carry it
+        int64_t unchanged_interval_secs = get_password_interval_secs(
+            blob, blob_len, blob->unchanged_password_interval_offset );
+
+        std::string cache_key = get_cache_key( domain_name, gmsa_account_name );
+        cache_entry_t entry;
+        if ( !encrypt( cache_key, blob->current_password, entry ) )
+        {
+            return false;
+        }
+        time_t now = time( nullptr );
+        entry.rotate_at = now + query_interval_secs;
+        // With rotation imminent the password is refreshed once AD has rotated it, an older
+        // entry whose refresh time already passed must not stay behind
+        entry.refresh_at = query_interval_secs > GMSA_PASSWORD_REFRESH_MARGIN_SECS
+                               ? entry.rotate_at - GMSA_PASSWORD_REFRESH_MARGIN_SECS
+                               : entry.rotate_at;
+        // A refetch cannot return a new password while AD keeps the current one unchanged
+        if ( unchanged_interval_secs > 0 )
+        {
+            entry.refresh_at = std::max( entry.refresh_at,
+                                         std::min( now + (time_t)unchanged_interval_secs,
+                                                   entry.rotate_at ) );
+        }
+
+        std::lock_guard<std::mutex> lock( cache_mutex );
+        auto it = cache.find( cache_key );
+        if ( it == cache.end() )
+        {
+            entry.generation = 1;
+        }
+        else
+        {
+            entry.generation = it->second.generation;
+            if ( !same_password( cache_key, it->second, blob->current_password ) )
+            {
+                entry.generation++;
+            }
+        }
+        cache[cache_key] = entry;
+        if ( generation != nullptr )
+        {
+            *generation = entry.generation;
+        }
+        return true;
+    }
+
+    /**
+     * Decrypts a cached password that is not yet due for refresh
+     * @param domain_name - Like 'contoso.com'
+     * @param gmsa_account_name - Like 'webapp01'
+     * @param password - GMSA_PASSWORD_SIZE bytes of SecureArena memory
+     * @param generation - optional, set to the password generation
+     * @return - true on cache hit
+     */
+    bool get( const std::string& domain_name, const std::string& gmsa_account_name,
+              uint8_t* password, uint64_t* generation = nullptr )
+    {
+        if ( password == nullptr )
+        {
+            return false;
+        }
+        std::string cache_key = get_cache_key( domain_name, gmsa_account_name );
+
+        std::lock_guard<std::mutex> lock( cache_mutex );
+        auto it = cache.find( cache_key );
+        if ( it == cache.end() || time( nullptr ) >= it->second.refresh_at )
+        {
+            return false;
+        }
+        if ( !decrypt( cache_key, it->second, password ) )
+        {
+            cache.erase( it );
+            return false;
+        }
+        if ( generation != nullptr )
+        {
+            *generation = it->second.generation;
+        }
+        return true;
+    }
+
+    /**
+     * Checks if a cached password is about to be rotated by AD
+     * @param domain_name - Like 'contoso.com'
+     * @param gmsa_account_name - Like 'webapp01'
+     * @return - true if the account is cached and inside the refresh margin
+     */
+    bool needs_refresh( const std::string& domain_name, const std::string& gmsa_account_name )
+    {
+        std::lock_guard<std::mutex> lock( cache_mutex );
+        auto it = cache.find( get_cache_key( domain_name, gmsa_account_name ) );
+        return it != cache.end() && time( nullptr ) >= it->second.refresh_at;
+    }
+
+    /**
+     * Checks if the current password of an account is cached and not yet due for refresh
+     * @param domain_name - Like 'contoso.com'
+     * @param gmsa_account_name - Like 'webapp01'
+     * @return - true if get() would hit
+     */
+    bool is_current( const std::string& domain_name, const std::string& gmsa_account_name )
+    {
+        std::lock_guard<std::mutex> lock( cache_mutex );
+        auto it = cache.find( get_cache_key( domain_name, gmsa_account_name ) );
+        return it != cache.end() && time( nullptr ) < it->second.refresh_at;
+    }
+
+    /**
+     * When a cached password is due for refresh ahead of its rotation
+     * @param domain_name - Like 'contoso.com'
+     * @param gmsa_account_name - Like 'webapp01'
+     * @return - refresh time, 0 if the account is not cached
+     */
+    time_t get_refresh_at( const std::string& domain_name, const std::string& gmsa_account_name )
+    {
+        std::lock_guard<std::mutex> lock( cache_mutex );
+        auto it = cache.find( get_cache_key( domain_name, gmsa_account_name ) );
+        return it == cache.end() ? 0 : it->second.refresh_at;
+    }
+
+    /**
+     * Drops a cached password, for example after the KDC rejected it
+     * @param domain_name - Like 'contoso.com'
+     * @param gmsa_account_name - Like 'webapp01'
+     */
+    void invalidate( const std::string& domain_name, const std::string& gmsa_account_name )
+    {
+        std::lock_guard<std::mutex> lock( cache_mutex );
+        auto it = cache.find( get_cache_key( domain_name, gmsa_account_name ) );
+        if ( it != cache.end() )
+        {
+            // Force a refetch but keep the generation so a new password is still detected
+            it->second.refresh_at = 0;
+        }
+    }
+
+    GmsaPasswordCache( const GmsaPasswordCache& ) = delete;
+    GmsaPasswordCache& operator=( const GmsaPasswordCache& ) = delete;
+
+  private:
+    static const int IV_SIZE = 12;
+    static const int TAG_SIZE = 16;
+    static const int KEY_SIZE = 32;
+
+    typedef struct cache_entry_t_
+    {
+        uint8_t iv[IV_SIZE];
+        uint8_t tag[TAG_SIZE];
+        uint8_t ciphertext[GMSA_PASSWORD_SIZE];
+        time_t rotate_at = 0;
+        time_t refresh_at = 0;
+        uint64_t generation = 0;
+    } cache_entry_t;
+
+    GmsaPasswordCache()
+    {
+        key = (uint8_t*)SecureArena::instance().allocate( KEY_SIZE );
+        if ( key != nullptr && RAND_bytes( key, KEY_SIZE ) != 1 )
+        {
+            SecureArena::instance().release( key );
+            key = nullptr;
+        }
+    }
+
+    ~GmsaPasswordCache()
+    {
+        SecureArena::instance().release( key );
+    }
+
+    static std::string get_cache_key( std::string domain_name, std::string gmsa_account_name )
+    {
+        std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
+                        []( unsigned char c ) { return std::tolower( c ); } );
+        std::transform( gmsa_account_name.begin(), gmsa_account_name.end(),
+                        gmsa_account_name.begin(),
+                        []( unsigned char c ) { return std::tolower( c ); } );
+        return domain_name + "|" + gmsa_account_name;
+    }
+
+    bool encrypt( const std::string& cache_key, const uint8_t* password, cache_entry_t& entry )
+    {
+        if ( RAND_bytes( entry.iv, IV_SIZE ) != 1 )
+        {
+            return false;
+        }
+        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+        if ( ctx == nullptr )
+        {
+            return false;
+        }
+        int len = 0;
+        // The cache key is bound to the ciphertext as additional authenticated data
+        bool ok = EVP_EncryptInit_ex( ctx, EVP_aes_256_gcm(), nullptr, key, entry.iv ) == 1 &&
+                  EVP_EncryptUpdate( ctx, nullptr, &len, (const uint8_t*)cache_key.data(),
+                                     (int)cache_key.size() ) == 1 &&
+                  EVP_EncryptUpdate( ctx, entry.ciphertext, &len, password,
+                                     GMSA_PASSWORD_SIZE ) == 1 &&
+                  EVP_EncryptFinal_ex( ctx, entry.ciphertext + len, &len ) == 1 &&
+                  EVP_CIPHER_CTX_ctrl( ctx, EVP_CTRL_GCM_GET_TAG, TAG_SIZE, entry.tag ) == 1;
+        EVP_CIPHER_CTX_free( ctx );
+        return ok;
+    }
+
+    bool decrypt( const std::string& cache_key, cache_entry_t& entry, uint8_t* password )
+    {
+        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+        if ( ctx == nullptr )
+        {
+            return false;
+        }
+        int len = 0;
+        bool ok = EVP_DecryptInit_ex( ctx, EVP_aes_256_gcm(), nullptr, key, entry.iv ) == 1 &&
+                  EVP_DecryptUpdate( ctx, nullptr, &len, (const uint8_t*)cache_key.data(),
+                                     (int)cache_key.size() ) == 1 &&
+                  EVP_DecryptUpdate( ctx, password, &len, entry.ciphertext,
+                                     GMSA_PASSWORD_SIZE ) == 1 &&
+                  EVP_CIPHER_CTX_ctrl( ctx, EVP_CTRL_GCM_SET_TAG, TAG_SIZE, entry.tag ) == 1 &&
+                  EVP_DecryptFinal_ex( ctx, password + len, &len ) == 1;
+        EVP_CIPHER_CTX_free( ctx );
+        if ( !ok )
+        {
+            OPENSSL_cleanse( password, GMSA_PASSWORD_SIZE );
+        }
+        return ok;
+    }
+
+    bool same_password( const std::string& cache_key, cache_entry_t& entry,
+                        const uint8_t* password )
+    {
+        uint8_t* cached_password = (uint8_t*)SecureArena::instance().allocate( GMSA_PASSWORD_SIZE );
+        if ( cached_password == nullptr )
+        {
+            return false;
+        }
+        bool same = decrypt( cache_key, entry, cached_password ) &&
+                    CRYPTO_memcmp( cached_password, password, GMSA_PASSWORD_SIZE ) == 0;
+        SecureArena::instance().release( cached_password );
+        return same;
+    }
+
+    uint8_t* key = nullptr;
+    std::map<std::string, cache_entry_t> cache;
+    std::mutex cache_mutex;
+};
+
+#endif // _gmsa_password_cache_hpp_
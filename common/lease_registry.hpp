@@ -0,0 +1,480 @@
+#ifndef _lease_registry_hpp_
+#define _lease_registry_hpp_
+
+#include "daemon.h"
+#include "symbol_table.hpp"
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * LeaseRegistry - authoritative in-memory view of the leases and their tickets
+ *
+ * The lease store under krb_files_dir is replayed once at startup; afterwards the registry
+ * is updated on create, renew and delete and records every create and delete in the store,
+ * so renew RPCs and the renewal scheduler look up the tickets they need in memory.
+ * Tickets are keyed by their ccache path with secondary indexes by lease id, domainless
+ * user, credspec ARN and (domain, service account). The domain, service account, domainless
+ * user and credential ARN of a ticket are kept as SymbolTable ids, shared by all tickets
+ * that name them, and the user and service account indexes are keyed by those ids.
+ */
+class LeaseRegistry
+{
+  public:
+    static LeaseRegistry& instance()
+    {
+        static LeaseRegistry registry;
+        return registry;
+    }
+
+    /**
+     * Loads the leases persisted by a previous run, only the first call reads the store
+     * The directory is created if needed, so leases created before any lease directory
+     * exists are persisted too.
+     * @param krb_files_dir - Like '/var/credentials_fetcher/krbdir'
+     */
+    void load( const std::string& krb_files_dir )
+    {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        if ( loaded || krb_files_dir.empty() )
+        {
+            return;
+        }
+        loaded = true;
+        store_dir = krb_files_dir;
+        std::error_code ec;
+        std::filesystem::create_directories( krb_files_dir, ec );
+        if ( ec )
+        {
+            // Writes are retried with every lease change, in case the directory shows up
+            std::cerr << "ERROR: cannot create " << krb_files_dir << ", leases are not persisted: "
+                      << ec.message() << std::endl;
+            return;
+        }
+        for ( auto& lease : load_lease_store( krb_files_dir ) )
+        {
+            for ( auto& krb_ticket : lease.second )
+            {
+                add_locked( lease.first, krb_ticket );
+            }
+        }
+    }
+
+    /**
+     * Brings one lease in line with its directory: forgotten if the directory is gone,
+     * registered from a metadata file if other tooling wrote one in the directory
+     * @param krb_files_dir - Like '/var/credentials_fetcher/krbdir'
+     * @param lease_id - lease directory name
+     * @return - ccache paths of the tickets that were forgotten
+     */
+    std::vector<std::string> sync_lease( const std::string& krb_files_dir,
+                                         const std::string& lease_id )
+    {
+        std::string lease_dir = krb_files_dir + "/" + lease_id;
+        if ( !std::filesystem::exists( lease_dir ) )
+        {
+            return remove_lease( lease_id );
+        }
+        std::string file_path = lease_dir + "/" + lease_id + "_metadata.json";
+        if ( !std::filesystem::exists( file_path ) )
+        {
+            return {};
+        }
+
+        std::vector<krb_ticket_info_t> krb_ticket_info_list = read_meta_data_json( file_path );
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        std::set<std::string> registered;
+        for ( auto& krb_ticket : krb_ticket_info_list )
+        {
+            // Unchanged tickets keep their place in the addition sequence
+            auto it = tickets.find( krb_ticket.krb_file_path );
+            if ( it == tickets.end() || it->second.lease_id != lease_id )
+            {
+                add_locked( lease_id, krb_ticket );
+            }
+            registered.insert( krb_ticket.krb_file_path );
+        }
+        std::vector<std::string> removed;
+        auto range = by_lease_id.equal_range( lease_id );
+        for ( auto it = range.first; it != range.second; ++it )
+        {
+            if ( !registered.count( it->second ) )
+            {
+                removed.push_back( it->second );
+            }
+        }
+        for ( auto& krb_cc_name : removed )
+        {
+            remove_locked( krb_cc_name );
+        }
+        // the store takes over from the metadata file
+        if ( persist_locked( lease_id ) == 0 )
+        {
+            std::filesystem::remove( file_path );
+        }
+        return removed;
+    }
+
+    /**
+     * Ids of the registered leases
+     * @return - distinct lease ids
+     */
+    std::vector<std::string> get_lease_ids()
+    {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        std::vector<std::string> lease_ids;
+        for ( auto it = by_lease_id.begin(); it != by_lease_id.end();
+              it = by_lease_id.upper_bound( it->first ) )
+        {
+            lease_ids.push_back( it->first );
+        }
+        return lease_ids;
+    }
+
+    /**
+     * Registers the tickets of a new lease
+     * @param lease_id - lease of the tickets
+     * @param krb_ticket_info_list - tickets, krb_file_path is the lease ccache
+     */
+    void add_lease( const std::string& lease_id,
+                    const std::vector<krb_ticket_info_t>& krb_ticket_info_list )
+    {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        for ( auto& krb_ticket : krb_ticket_info_list )
+        {
+            add_locked( lease_id, krb_ticket );
+        }
+        persist_locked( lease_id );
+    }
+
+    /**
+     * Forgets a lease
+     * @param lease_id - lease to remove
+     * @return - ccache paths of the removed tickets
+     */
+    std::vector<std::string> remove_lease( const std::string& lease_id )
+    {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        std::vector<std::string> removed;
+        auto range = by_lease_id.equal_range( lease_id );
+        for ( auto it = range.first; it != range.second; ++it )
+        {
+            removed.push_back( it->second );
+        }
+        for ( auto& krb_cc_name : removed )
+        {
+            remove_locked( krb_cc_name );
+        }
+        if ( !removed.empty() )
+        {
+            persist_locked( lease_id );
+        }
+        return removed;
+    }
+
+    /**
+     * Replaces the stored info of a ticket after it was renewed
+     * @param krb_ticket - ticket, matched by krb_file_path
+     */
+    void update_ticket( const krb_ticket_info_t& krb_ticket )
+    {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        auto it = tickets.find( krb_ticket.krb_file_path );
+        if ( it != tickets.end() )
+        {
+            std::string lease_id = it->second.lease_id;
+            remove_locked( krb_ticket.krb_file_path );
+            add_locked( lease_id, krb_ticket );
+        }
+    }
+
+    /**
+     * Looks up a ticket
+     * @param krb_cc_name - ccache path of the ticket
+     * @param krb_ticket - receives a copy of the ticket info
+     * @return - true if the ticket is registered
+     */
+    bool get_ticket( const std::string& krb_cc_name, krb_ticket_info_t* krb_ticket )
+    {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        auto it = tickets.find( krb_cc_name );
+        if ( it == tickets.end() )
+        {
+            return false;
+        }
+        *krb_ticket = get_krb_ticket( it->second );
+        return true;
+    }
+
+    bool contains( const std::string& krb_cc_name )
+    {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        return tickets.count( krb_cc_name ) != 0;
+    }
+
+    bool contains_lease( const std::string& lease_id )
+    {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        return by_lease_id.count( lease_id ) != 0;
+    }
+
+    std::vector<krb_ticket_info_t> find_by_lease_id( const std::string& lease_id )
+    {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        return collect_locked( by_lease_id, lease_id );
+    }
+
+    std::vector<krb_ticket_info_t> find_by_domainless_user( const std::string& domainless_user )
+    {
+        symbol_id_t user_id = SymbolTable::instance().find( domainless_user );
+        if ( user_id == SYMBOL_ID_EMPTY )
+        {
+            return {};
+        }
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        return collect_locked( by_domainless_user, user_id );
+    }
+
+    std::vector<krb_ticket_info_t> find_by_credspec_arn( const std::string& credspec_arn )
+    {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        return collect_locked( by_credspec_arn, credspec_arn );
+    }
+
+    std::vector<krb_ticket_info_t> find_by_service_account( const std::string& domain_name,
+                                                            const std::string& account_name )
+    {
+        uint64_t key = 0;
+        if ( !find_service_account_key( domain_name, account_name, &key ) )
+        {
+            return {};
+        }
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        return collect_locked( by_service_account, key );
+    }
+
+    /**
+     * Credspec ARNs of the leases created through AddKerberosArnLease
+     * @return - distinct ARNs
+     */
+    std::vector<std::string> get_credspec_arns()
+    {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        std::vector<std::string> arns;
+        for ( auto it = by_credspec_arn.begin(); it != by_credspec_arn.end();
+              it = by_credspec_arn.upper_bound( it->first ) )
+        {
+            arns.push_back( it->first );
+        }
+        return arns;
+    }
+
+    /**
+     * Tickets registered after a cursor, for consumers that track new leases incrementally
+     * @param cursor - 0 on the first call, advanced past the returned tickets
+     * @return - tickets added or updated since the cursor
+     */
+    std::vector<krb_ticket_info_t> get_added_since( uint64_t* cursor )
+    {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        std::vector<krb_ticket_info_t> added;
+        for ( auto it = by_sequence.upper_bound( *cursor ); it != by_sequence.end(); ++it )
+        {
+            added.push_back( get_krb_ticket( tickets[it->second] ) );
+            *cursor = it->first;
+        }
+        return added;
+    }
+
+    LeaseRegistry( const LeaseRegistry& ) = delete;
+    LeaseRegistry& operator=( const LeaseRegistry& ) = delete;
+
+  private:
+    typedef struct lease_ticket_t_
+    {
+        std::string lease_id;
+        uint64_t sequence = 0;
+        symbol_id_t domain_name = SYMBOL_ID_EMPTY;
+        symbol_id_t service_account_name = SYMBOL_ID_EMPTY;
+        symbol_id_t domainless_user = SYMBOL_ID_EMPTY;
+        symbol_id_t credential_arn = SYMBOL_ID_EMPTY;
+        // case-insensitive (domain, service account) key of by_service_account
+        uint64_t service_account_key = 0;
+        // the interned fields are left empty here
+        krb_ticket_info_t krb_ticket;
+    } lease_ticket_t;
+
+    typedef std::multimap<std::string, std::string> ticket_index_t;
+    typedef std::multimap<symbol_id_t, std::string> symbol_index_t;
+    typedef std::multimap<uint64_t, std::string> service_account_index_t;
+
+    LeaseRegistry() = default;
+
+    static std::string to_lower( std::string value )
+    {
+        std::transform( value.begin(), value.end(), value.begin(),
+                        []( unsigned char c ) { return std::tolower( c ); } );
+        return value;
+    }
+
+    static uint64_t get_service_account_key( const std::string& domain_name,
+                                             const std::string& account_name )
+    {
+        SymbolTable& symbols = SymbolTable::instance();
+        return ( (uint64_t)symbols.intern( to_lower( domain_name ) ) << 32 ) |
+               symbols.intern( to_lower( account_name ) );
+    }
+
+    /**
+     * Index key of a service account, without interning names no ticket uses
+     * @return - false if no ticket was registered for the service account
+     */
+    static bool find_service_account_key( const std::string& domain_name,
+                                          const std::string& account_name, uint64_t* key )
+    {
+        SymbolTable& symbols = SymbolTable::instance();
+        symbol_id_t domain_id = symbols.find( to_lower( domain_name ) );
+        symbol_id_t account_id = symbols.find( to_lower( account_name ) );
+        *key = ( (uint64_t)domain_id << 32 ) | account_id;
+        return domain_id != SYMBOL_ID_EMPTY && account_id != SYMBOL_ID_EMPTY;
+    }
+
+    static krb_ticket_info_t get_krb_ticket( const lease_ticket_t& entry )
+    {
+        SymbolTable& symbols = SymbolTable::instance();
+        krb_ticket_info_t krb_ticket = entry.krb_ticket;
+        krb_ticket.domain_name = symbols.lookup( entry.domain_name );
+        krb_ticket.service_account_name = symbols.lookup( entry.service_account_name );
+        krb_ticket.domainless_user = symbols.lookup( entry.domainless_user );
+        krb_ticket.credential_arn = symbols.lookup( entry.credential_arn );
+        return krb_ticket;
+    }
+
+    template <typename index_t>
+    static void erase_from_index( index_t& index, const typename index_t::key_type& key,
+                                  const std::string& krb_cc_name )
+    {
+        auto range = index.equal_range( key );
+        for ( auto it = range.first; it != range.second; ++it )
+        {
+            if ( it->second == krb_cc_name )
+            {
+                index.erase( it );
+                return;
+            }
+        }
+    }
+
+    void add_locked( const std::string& lease_id, const krb_ticket_info_t& krb_ticket )
+    {
+        const std::string& krb_cc_name = krb_ticket.krb_file_path;
+        if ( krb_cc_name.empty() )
+        {
+            return;
+        }
+        if ( tickets.count( krb_cc_name ) )
+        {
+            remove_locked( krb_cc_name );
+        }
+
+        SymbolTable& symbols = SymbolTable::instance();
+        lease_ticket_t entry;
+        entry.lease_id = lease_id;
+        entry.sequence = ++last_sequence;
+        entry.domain_name = symbols.intern( krb_ticket.domain_name );
+        entry.service_account_name = symbols.intern( krb_ticket.service_account_name );
+        entry.domainless_user = symbols.intern( krb_ticket.domainless_user );
+        entry.credential_arn = symbols.intern( krb_ticket.credential_arn );
+        entry.service_account_key =
+            get_service_account_key( krb_ticket.domain_name, krb_ticket.service_account_name );
+        entry.krb_ticket = krb_ticket;
+        entry.krb_ticket.domain_name.clear();
+        entry.krb_ticket.service_account_name.clear();
+        entry.krb_ticket.domainless_user.clear();
+        entry.krb_ticket.credential_arn.clear();
+        by_sequence[entry.sequence] = krb_cc_name;
+        by_lease_id.emplace( lease_id, krb_cc_name );
+        by_service_account.emplace( entry.service_account_key, krb_cc_name );
+        if ( entry.domainless_user != SYMBOL_ID_EMPTY )
+        {
+            by_domainless_user.emplace( entry.domainless_user, krb_cc_name );
+        }
+        if ( !krb_ticket.credspec_info.empty() )
+        {
+            by_credspec_arn.emplace( krb_ticket.credspec_info, krb_cc_name );
+        }
+        tickets[krb_cc_name] = std::move( entry );
+    }
+
+    void remove_locked( const std::string& krb_cc_name )
+    {
+        auto it = tickets.find( krb_cc_name );
+        if ( it == tickets.end() )
+        {
+            return;
+        }
+        const lease_ticket_t& entry = it->second;
+        by_sequence.erase( entry.sequence );
+        erase_from_index( by_lease_id, entry.lease_id, krb_cc_name );
+        erase_from_index( by_service_account, entry.service_account_key, krb_cc_name );
+        erase_from_index( by_domainless_user, entry.domainless_user, krb_cc_name );
+        erase_from_index( by_credspec_arn, entry.krb_ticket.credspec_info, krb_cc_name );
+        tickets.erase( it );
+    }
+
+    /**
+     * Records all tickets of a lease in the lease store, logs when it cannot
+     * @param lease_id - lease to record
+     * @return - 0 on success, -1 if the store cannot be written or was never loaded
+     */
+    int persist_locked( const std::string& lease_id )
+    {
+        if ( store_dir.empty() )
+        {
+            std::cerr << "ERROR: lease store is not loaded, lease " << lease_id
+                      << " is not persisted" << std::endl;
+            return -1;
+        }
+        std::vector<krb_ticket_info_t> krb_tickets = collect_locked( by_lease_id, lease_id );
+        int status = krb_tickets.empty() ? delete_lease_record( store_dir, lease_id )
+                                         : put_lease_record( store_dir, lease_id, krb_tickets );
+        if ( status != 0 )
+        {
+            std::cerr << "ERROR: cannot write lease " << lease_id << " to the lease store in "
+                      << store_dir << std::endl;
+        }
+        return status;
+    }
+
+    template <typename index_t>
+    std::vector<krb_ticket_info_t> collect_locked( const index_t& index,
+                                                   const typename index_t::key_type& key )
+    {
+        std::vector<krb_ticket_info_t> found;
+        auto range = index.equal_range( key );
+        for ( auto it = range.first; it != range.second; ++it )
+        {
+            found.push_back( get_krb_ticket( tickets[it->second] ) );
+        }
+        return found;
+    }
+
+    bool loaded = false;
+    // krb_files_dir of the lease store, empty until load()
+    std::string store_dir;
+    uint64_t last_sequence = 0;
+    // ccache path -> ticket
+    std::map<std::string, lease_ticket_t> tickets;
+    // secondary indexes, values are ccache paths
+    std::map<uint64_t, std::string> by_sequence;
+    ticket_index_t by_lease_id;
+    symbol_index_t by_domainless_user;
+    ticket_index_t by_credspec_arn;
+    service_account_index_t by_service_account;
+    std::mutex registry_mutex;
+};
+
+#endif // _lease_registry_hpp_
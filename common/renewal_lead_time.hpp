@@ -0,0 +1,138 @@
+#ifndef _renewal_lead_time_hpp_
+#define _renewal_lead_time_hpp_
+
+#include "constants.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// acquisitions kept per domain
+#define RENEWAL_LEAD_SAMPLES 100
+// acquisitions needed before the lead time follows the domain instead of RENEW_TICKET_HOURS
+#define RENEWAL_LEAD_MIN_SAMPLES 10
+// older acquisitions no longer describe the health of the domain
+#define RENEWAL_LEAD_SAMPLE_MAX_AGE_SECS ( 6 * SECONDS_IN_HOUR )
+#define RENEWAL_LEAD_MIN_SECS 600
+#define RENEWAL_LEAD_MAX_SECS ( 6 * SECONDS_IN_HOUR )
+// a domain failing every acquisition still gets a bounded lead time
+#define RENEWAL_LEAD_MAX_FAILURE_RATE 0.9
+
+/**
+ * RenewalLeadTime - how long before expiry the tickets of a domain are renewed
+ *
+ * Every gMSA ticket acquisition is recorded with its latency and outcome. The lead time of
+ * a domain leaves room for the first attempt plus the retry budget, with every failed
+ * attempt costing the retry interval and the retries inflated by the recent failure rate:
+ *
+ *     lead = ( 1 + retry_budget / ( 1 - failure_rate ) ) * ( p99 latency + retry_interval )
+ *
+ * A healthy domain renews a few minutes ahead of expiry, a struggling one hours ahead.
+ */
+class RenewalLeadTime
+{
+  public:
+    static RenewalLeadTime& instance()
+    {
+        static RenewalLeadTime lead_time;
+        return lead_time;
+    }
+
+    /**
+     * Records a gMSA ticket acquisition
+     * @param domain_name - Like 'contoso.com'
+     * @param latency - time the acquisition took
+     * @param succeeded - false if no ticket was acquired
+     */
+    void record( const std::string& domain_name, std::chrono::milliseconds latency,
+                 bool succeeded )
+    {
+        std::lock_guard<std::mutex> lock( lead_time_mutex );
+        std::deque<acquisition_t>& samples = acquisitions[get_domain_key( domain_name )];
+        samples.push_back( { time( nullptr ), latency.count(), succeeded } );
+        if ( samples.size() > RENEWAL_LEAD_SAMPLES )
+        {
+            samples.pop_front();
+        }
+    }
+
+    /**
+     * Lead time of a domain
+     * @param domain_name - Like 'contoso.com'
+     * @param retry_budget - retries a renewal may need before the ticket expires
+     * @param retry_interval - seconds between a failed renewal and its retry
+     * @return - seconds before expiry, RENEW_TICKET_HOURS until enough acquisitions are known
+     */
+    time_t get_lead_time( const std::string& domain_name, int retry_budget,
+                          time_t retry_interval )
+    {
+        std::lock_guard<std::mutex> lock( lead_time_mutex );
+        auto it = acquisitions.find( get_domain_key( domain_name ) );
+        if ( it == acquisitions.end() )
+        {
+            return RENEW_TICKET_HOURS * SECONDS_IN_HOUR;
+        }
+
+        std::deque<acquisition_t>& samples = it->second;
+        time_t oldest = time( nullptr ) - RENEWAL_LEAD_SAMPLE_MAX_AGE_SECS;
+        while ( !samples.empty() && samples.front().at < oldest )
+        {
+            samples.pop_front();
+        }
+        if ( samples.size() < RENEWAL_LEAD_MIN_SAMPLES )
+        {
+            return RENEW_TICKET_HOURS * SECONDS_IN_HOUR;
+        }
+
+        std::vector<int64_t> latencies;
+        for ( auto& sample : samples )
+        {
+            latencies.push_back( sample.latency_ms );
+        }
+        size_t p99_index = ( latencies.size() * 99 + 99 ) / 100 - 1;
+        std::nth_element( latencies.begin(), latencies.begin() + p99_index, latencies.end() );
+        double attempt_secs = latencies[p99_index] / 1000.0 + (double)retry_interval;
+
+        size_t failures = std::count_if( samples.begin(), samples.end(),
+                                         []( const acquisition_t& sample ) {
+                                             return !sample.succeeded;
+                                         } );
+        double failure_rate = std::min( (double)failures / samples.size(),
+                                        RENEWAL_LEAD_MAX_FAILURE_RATE );
+        double attempts = 1.0 + std::max( retry_budget, 0 ) / ( 1.0 - failure_rate );
+
+        double lead_time = std::ceil( attempts * attempt_secs );
+        return (time_t)std::max<double>( RENEWAL_LEAD_MIN_SECS,
+                                         std::min<double>( lead_time, RENEWAL_LEAD_MAX_SECS ) );
+    }
+
+    RenewalLeadTime( const RenewalLeadTime& ) = delete;
+    RenewalLeadTime& operator=( const RenewalLeadTime& ) = delete;
+
+  private:
+    typedef struct acquisition_t_
+    {
+        time_t at;
+        int64_t latency_ms;
+        bool succeeded;
+    } acquisition_t;
+
+    RenewalLeadTime() = default;
+
+    static std::string get_domain_key( std::string domain_name )
+    {
+        std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
+                        []( unsigned char c ) { return std::tolower( c ); } );
+        return domain_name;
+    }
+
+    std::map<std::string, std::deque<acquisition_t>> acquisitions;
+    std::mutex lead_time_mutex;
+};
+
+#endif // _renewal_lead_time_hpp_
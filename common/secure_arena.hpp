@@ -0,0 +1,183 @@
+#ifndef _secure_arena_hpp_
+#define _secure_arena_hpp_
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <openssl/crypto.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * SecureArena - fixed-size slab of memory for gMSA password blobs and other secrets
+ *
+ * The arena is a single anonymous mapping laid out as
+ *     [guard][slot 0][guard][slot 1][guard] ... [slot N-1][guard]
+ * where every slot is one page and every guard page is PROT_NONE, so an overrun
+ * out of a slot faults instead of silently reading a neighbouring secret.
+ * The whole mapping is mlock'd (never written to swap), excluded from core dumps
+ * and wiped in forked children (popen of ldapsearch/kinit).
+ * Allocation and release are O(1) pops/pushes on a free list; release zeroizes the slot.
+ */
+class SecureArena
+{
+  public:
+    static const size_t NUM_SLOTS = 64;
+
+    /**
+     * Process-wide arena, mapped on first use
+     * @return - the arena
+     */
+    static SecureArena& instance()
+    {
+        static SecureArena arena;
+        return arena;
+    }
+
+    /**
+     * Hands out one slot
+     * @param size - bytes needed, must not exceed slot_size()
+     * @return - zeroed slot or nullptr if the request does not fit or the arena is exhausted
+     */
+    void* allocate( size_t size )
+    {
+        if ( base == nullptr || size == 0 || size > page_size )
+        {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock( arena_mutex );
+        if ( free_slots.empty() )
+        {
+            std::cerr << "ERROR: secure arena exhausted" << std::endl;
+            return nullptr;
+        }
+        size_t slot = free_slots.back();
+        free_slots.pop_back();
+        return slot_address( slot );
+    }
+
+    /**
+     * Zeroizes a slot and returns it to the free list, nullptr is ignored
+     * @param ptr - pointer returned by allocate()
+     */
+    void release( void* ptr )
+    {
+        if ( ptr == nullptr || !owns( ptr ) )
+        {
+            return;
+        }
+
+        size_t slot = ( (uint8_t*)ptr - ( base + page_size ) ) / ( 2 * page_size );
+        OPENSSL_cleanse( slot_address( slot ), page_size );
+
+        std::lock_guard<std::mutex> lock( arena_mutex );
+        free_slots.push_back( slot );
+    }
+
+    /**
+     * @param ptr - any pointer
+     * @return - true if ptr is the start of a slot in this arena
+     */
+    bool owns( const void* ptr ) const
+    {
+        const uint8_t* p = (const uint8_t*)ptr;
+        if ( base == nullptr || p < base + page_size || p >= base + mapping_size - page_size )
+        {
+            return false;
+        }
+        return ( ( p - ( base + page_size ) ) % ( 2 * page_size ) ) == 0;
+    }
+
+    /**
+     * @return - largest allocation the arena can satisfy
+     */
+    size_t slot_size() const
+    {
+        return page_size;
+    }
+
+    /**
+     * @return - number of slots currently free
+     */
+    size_t available()
+    {
+        std::lock_guard<std::mutex> lock( arena_mutex );
+        return free_slots.size();
+    }
+
+    SecureArena( const SecureArena& ) = delete;
+    SecureArena& operator=( const SecureArena& ) = delete;
+
+  private:
+    SecureArena()
+    {
+        page_size = (size_t)sysconf( _SC_PAGESIZE );
+        mapping_size = ( 2 * NUM_SLOTS + 1 ) * page_size;
+
+        void* mem = mmap( nullptr, mapping_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( mem == MAP_FAILED )
+        {
+            std::cerr << "ERROR: secure arena mmap failed" << std::endl;
+            return;
+        }
+        base = (uint8_t*)mem;
+
+        for ( size_t slot = 0; slot < NUM_SLOTS; slot++ )
+        {
+            if ( mprotect( slot_address( slot ), page_size, PROT_READ | PROT_WRITE ) != 0 )
+            {
+                std::cerr << "ERROR: secure arena mprotect failed" << std::endl;
+                munmap( base, mapping_size );
+                base = nullptr;
+                return;
+            }
+        }
+
+        // Not fatal: RLIMIT_MEMLOCK may be too small outside of systemd
+        if ( mlock( base, mapping_size ) != 0 )
+        {
+            std::cerr << "WARNING: secure arena mlock failed, secrets may be swapped" << std::endl;
+        }
+#ifdef MADV_DONTDUMP
+        madvise( base, mapping_size, MADV_DONTDUMP );
+#endif
+#ifdef MADV_WIPEONFORK
+        madvise( base, mapping_size, MADV_WIPEONFORK );
+#endif
+
+        free_slots.reserve( NUM_SLOTS );
+        for ( size_t slot = NUM_SLOTS; slot > 0; slot-- )
+        {
+            free_slots.push_back( slot - 1 );
+        }
+    }
+
+    ~SecureArena()
+    {
+        if ( base != nullptr )
+        {
+            for ( size_t slot = 0; slot < NUM_SLOTS; slot++ )
+            {
+                OPENSSL_cleanse( slot_address( slot ), page_size );
+            }
+            munlock( base, mapping_size );
+            munmap( base, mapping_size );
+        }
+    }
+
+    uint8_t* slot_address( size_t slot ) const
+    {
+        return base + ( 2 * slot + 1 ) * page_size;
+    }
+
+    uint8_t* base = nullptr;
+    size_t page_size = 0;
+    size_t mapping_size = 0;
+    std::vector<size_t> free_slots;
+    std::mutex arena_mutex;
+};
+
+#endif // _secure_arena_hpp_
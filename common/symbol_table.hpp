@@ -0,0 +1,96 @@
+#ifndef _symbol_table_hpp_
+#define _symbol_table_hpp_
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+typedef uint32_t symbol_id_t;
+
+// id of the empty string
+#define SYMBOL_ID_EMPTY 0
+
+/**
+ * SymbolTable - interned strings shared by the lease records
+ *
+ * Thousands of tickets name a handful of domains, service accounts, domainless users and
+ * credential ARNs. Each distinct string is stored once and the records keep its 32-bit id,
+ * so grouping and index lookups compare integers. Symbols are never released, the set of
+ * distinct names is bounded by the directory and secrets the host is configured for.
+ */
+class SymbolTable
+{
+  public:
+    static SymbolTable& instance()
+    {
+        static SymbolTable table;
+        return table;
+    }
+
+    /**
+     * Id of a string, added to the table on first use
+     * @param value - string to intern
+     * @return - id, SYMBOL_ID_EMPTY for the empty string
+     */
+    symbol_id_t intern( const std::string& value )
+    {
+        if ( value.empty() )
+        {
+            return SYMBOL_ID_EMPTY;
+        }
+        std::lock_guard<std::mutex> lock( table_mutex );
+        auto it = ids.find( value );
+        if ( it != ids.end() )
+        {
+            return it->second;
+        }
+        // deque elements never move, the views keyed in ids stay valid
+        symbols.push_back( value );
+        symbol_id_t id = (symbol_id_t)symbols.size();
+        ids.emplace( symbols.back(), id );
+        return id;
+    }
+
+    /**
+     * Id of a string that was interned before
+     * @param value - string to look up
+     * @return - id, SYMBOL_ID_EMPTY if the string was never interned
+     */
+    symbol_id_t find( const std::string& value )
+    {
+        std::lock_guard<std::mutex> lock( table_mutex );
+        auto it = ids.find( value );
+        return it == ids.end() ? SYMBOL_ID_EMPTY : it->second;
+    }
+
+    /**
+     * String of an id
+     * @param id - from intern()
+     * @return - copy of the string, empty for SYMBOL_ID_EMPTY or an unknown id
+     */
+    std::string lookup( symbol_id_t id )
+    {
+        std::lock_guard<std::mutex> lock( table_mutex );
+        if ( id == SYMBOL_ID_EMPTY || id > symbols.size() )
+        {
+            return std::string();
+        }
+        return symbols[id - 1];
+    }
+
+    SymbolTable( const SymbolTable& ) = delete;
+    SymbolTable& operator=( const SymbolTable& ) = delete;
+
+  private:
+    SymbolTable() = default;
+
+    // id - 1 -> string
+    std::deque<std::string> symbols;
+    std::unordered_map<std::string_view, symbol_id_t> ids;
+    std::mutex table_mutex;
+};
+
+#endif // _symbol_table_hpp_
@@ -1,5 +1,7 @@
 #include "constants.h"
 #include "daemon.h"
+#include "secure_arena.hpp"
+#include <arpa/inet.h>
 #include <cstdio>
 #include <fstream>
 #include <iostream>
@@ -268,6 +270,14 @@ class Util
             {
                 return value;
             }
+
+            if ( ( key.compare( ENV_CF_TICKET_LIFETIME ) == 0 ||
+                   key.compare( ENV_CF_RENEW_LIFETIME ) == 0 ||
+                   key.compare( ENV_CF_RENEWAL_SPREAD ) == 0 ) &&
+                 ecs_variable_name.compare( key ) == 0 )
+            {
+                return value;
+            }
         }
 
         return "";
@@ -398,6 +408,23 @@ class Util
             return EXIT_FAILURE;
         }
 
+        // In-process conversion used for keytab derivation must match decode.exe
+        uint8_t* utf8_password =
+            (uint8_t*)SecureArena::instance().allocate( 3 * GMSA_PASSWORD_SIZE / 2 );
+        if ( utf8_password == nullptr ||
+             utf16le_to_utf8( ( (blob_t*)base64_decoded_password_blob.second )->current_password,
+                              GMSA_PASSWORD_SIZE, utf8_password ) <
+                 sizeof( test_gmsa_utf8_password ) ||
+             memcmp( test_gmsa_utf8_password, utf8_password, sizeof( test_gmsa_utf8_password ) ) !=
+                 0 )
+        {
+            std::cerr << Util::getCurrentTime() << '\t' << "Self test failed" << std::endl;
+            SecureArena::instance().release( utf8_password );
+            SecureArena::instance().release( base64_decoded_password_blob.second );
+            return EXIT_FAILURE;
+        }
+        SecureArena::instance().release( utf8_password );
+
         struct stat st;
         std::string decode_exe_path;
 
@@ -418,18 +445,14 @@ class Util
         if ( fp == nullptr )
         {
             std::cerr << Util::getCurrentTime() << '\t' << "Self test failed" << std::endl;
-            OPENSSL_cleanse( base64_decoded_password_blob.second,
-                             base64_decoded_password_blob.first );
-            OPENSSL_free( base64_decoded_password_blob.second );
+            SecureArena::instance().release( base64_decoded_password_blob.second );
             return EXIT_FAILURE;
         }
         fwrite( blob->current_password, 1, GMSA_PASSWORD_SIZE, fp );
         if ( pclose( fp ) < 0 )
         {
             std::cerr << Util::getCurrentTime() << '\t' << "Self test failed" << std::endl;
-            OPENSSL_cleanse( base64_decoded_password_blob.second,
-                             base64_decoded_password_blob.first );
-            OPENSSL_free( base64_decoded_password_blob.second );
+            SecureArena::instance().release( base64_decoded_password_blob.second );
             return EXIT_FAILURE;
         }
 
@@ -437,9 +460,7 @@ class Util
         if ( fp == nullptr )
         {
             std::cerr << Util::getCurrentTime() << '\t' << "Self test failed" << std::endl;
-            OPENSSL_cleanse( base64_decoded_password_blob.second,
-                             base64_decoded_password_blob.first );
-            OPENSSL_free( base64_decoded_password_blob.second );
+            SecureArena::instance().release( base64_decoded_password_blob.second );
             return EXIT_FAILURE;
         }
         fread( test_password_buf, 1, GMSA_PASSWORD_SIZE, fp );
@@ -448,22 +469,19 @@ class Util
         {
             // utf16->utf8 conversion works as expected
             std::cerr << Util::getCurrentTime() << '\t' << "Self test is successful" << std::endl;
-            OPENSSL_cleanse( base64_decoded_password_blob.second,
-                             base64_decoded_password_blob.first );
-            OPENSSL_free( base64_decoded_password_blob.second );
+            SecureArena::instance().release( base64_decoded_password_blob.second );
             unlink( decoded_password_file.c_str() );
             return EXIT_SUCCESS;
         }
 
         std::cerr << Util::getCurrentTime() << '\t' << "Self test failed" << std::endl;
-        OPENSSL_cleanse( base64_decoded_password_blob.second, base64_decoded_password_blob.first );
-        OPENSSL_free( base64_decoded_password_blob.second );
+        SecureArena::instance().release( base64_decoded_password_blob.second );
         unlink( decoded_password_file.c_str() );
         return EXIT_FAILURE;
     }
 
     /**
-     * base64_decode - Decodes base64 encoded string
+     * base64_decode - Decodes base64 encoded string straight into secure arena memory
      * @param password - base64 encoded password
      * @param base64_decode_len - Length after decode
      * @return buffer with base64 decoded contents
@@ -476,30 +494,94 @@ class Util
         }
 
         *base64_decode_len = 0;
-        guchar* result = g_base64_decode( password.c_str(), base64_decode_len );
-        if ( result == nullptr || *base64_decode_len <= 0 )
+        SecureArena& arena = SecureArena::instance();
+        // g_base64_decode_step() may write up to (len / 4) * 3 + 3 bytes
+        if ( ( password.length() / 4 ) * 3 + 3 > arena.slot_size() )
         {
             return nullptr;
         }
 
-        void* secure_mem = OPENSSL_malloc( *base64_decode_len );
+        guchar* secure_mem = (guchar*)arena.allocate( arena.slot_size() );
         if ( secure_mem == nullptr )
         {
-            g_free( result );
             return nullptr;
         }
 
-        memcpy( secure_mem, result, *base64_decode_len );
-
-        memset( result, 0, *base64_decode_len );
-        g_free( result );
+        gint state = 0;
+        guint save = 0;
+        *base64_decode_len =
+            g_base64_decode_step( password.c_str(), password.length(), secure_mem, &state, &save );
+        if ( *base64_decode_len == 0 )
+        {
+            arena.release( secure_mem );
+            return nullptr;
+        }
 
         /**
-         * secure_mem must be freed later
+         * secure_mem must be released later with SecureArena::instance().release()
          */
         return (uint8_t*)secure_mem;
     }
 
+    /**
+     * utf16le_to_utf8 - Converts a UTF-16LE gMSA password to UTF-8 like .NET Encoding.Convert,
+     * unpaired surrogates are replaced with U+FFFD
+     * @param utf16 - UTF-16LE input
+     * @param utf16_len - input length in bytes
+     * @param utf8 - output buffer, must hold 3 bytes per UTF-16 code unit
+     * @return number of bytes written to utf8
+     */
+    static size_t utf16le_to_utf8( const uint8_t* utf16, size_t utf16_len, uint8_t* utf8 )
+    {
+        size_t num_units = utf16_len / 2;
+        size_t out = 0;
+        for ( size_t i = 0; i < num_units; i++ )
+        {
+            uint32_t code_point = utf16[2 * i] | ( utf16[2 * i + 1] << 8 );
+            if ( code_point >= 0xD800 && code_point <= 0xDFFF )
+            {
+                uint32_t low = 0;
+                if ( code_point <= 0xDBFF && i + 1 < num_units )
+                {
+                    low = utf16[2 * i + 2] | ( utf16[2 * i + 3] << 8 );
+                }
+                if ( low >= 0xDC00 && low <= 0xDFFF )
+                {
+                    code_point = 0x10000 + ( ( code_point - 0xD800 ) << 10 ) + ( low - 0xDC00 );
+                    i++;
+                }
+                else
+                {
+                    code_point = 0xFFFD;
+                }
+            }
+
+            if ( code_point < 0x80 )
+            {
+                utf8[out++] = (uint8_t)code_point;
+            }
+            else if ( code_point < 0x800 )
+            {
+                utf8[out++] = (uint8_t)( 0xC0 | ( code_point >> 6 ) );
+                utf8[out++] = (uint8_t)( 0x80 | ( code_point & 0x3F ) );
+            }
+            else if ( code_point < 0x10000 )
+            {
+                utf8[out++] = (uint8_t)( 0xE0 | ( code_point >> 12 ) );
+                utf8[out++] = (uint8_t)( 0x80 | ( ( code_point >> 6 ) & 0x3F ) );
+                utf8[out++] = (uint8_t)( 0x80 | ( code_point & 0x3F ) );
+            }
+            else
+            {
+                utf8[out++] = (uint8_t)( 0xF0 | ( code_point >> 18 ) );
+                utf8[out++] = (uint8_t)( 0x80 | ( ( code_point >> 12 ) & 0x3F ) );
+                utf8[out++] = (uint8_t)( 0x80 | ( ( code_point >> 6 ) & 0x3F ) );
+                utf8[out++] = (uint8_t)( 0x80 | ( code_point & 0x3F ) );
+            }
+        }
+        return out;
+    }
+
     static std::pair<int, std::string> get_base_dn( std::string domain_name )
     {
         if ( !domain_name.empty() )
@@ -518,7 +600,8 @@ class Util
     }
 
     static std::pair<int, std::string> find_dn( std::string gmsa_account_name, std::string base_dn,
-                                                std::string fqdn )
+                                                std::string fqdn, std::string krb5_config = "",
+                                                std::string krb_cc_name = "" )
     {
         /**
          *  ldapsearch  -H ldap://ip-xxxxxxxx.activedirectory1.com
@@ -528,7 +611,8 @@ class Util
         std::string distinguished_name;
         std::string search_string = " -s sub '(CN=" + gmsa_account_name + ")' distinguishedName";
         std::pair<int, std::string> ldap_search_result =
-            Util::execute_ldapsearch( gmsa_account_name, base_dn, fqdn, search_string );
+            Util::execute_ldapsearch( gmsa_account_name, base_dn, fqdn, search_string,
+                                      krb5_config, krb_cc_name );
         if ( ldap_search_result.first == 0 && !ldap_search_result.second.empty() )
         {
             std::size_t start_pos = ldap_search_result.second.find( "distinguishedName:" );
@@ -585,6 +669,11 @@ class Util
         if ( password_found )
         {
             blob_base64_decoded = base64_decode( password, &base64_decode_len );
+            clearString( password );
+            for ( auto& result : results )
+            {
+                clearString( result );
+            }
             if ( blob_base64_decoded == nullptr )
             {
                 std::cerr << Util::getCurrentTime() << '\t' << "ERROR: base64 buffer is null"
@@ -596,15 +685,37 @@ class Util
         return std::make_pair( base64_decode_len, blob_base64_decoded );
     }
 
+    /**
+     * Runs ldapsearch over kerberos against one domain controller
+     * @param krb5_config - optional KRB5_CONFIG from get_krb5_config_for_domain()
+     * @param krb_cc_name - optional ccache with the bootstrap ticket, from
+     *                      get_bootstrap_ccache_path()
+     */
     static std::pair<int, std::string> execute_ldapsearch( std::string gmsa_account_name,
                                                            std::string distinguished_name,
                                                            std::string fqdn,
-                                                           std::string search_string )
+                                                           std::string search_string,
+                                                           std::string krb5_config = "",
+                                                           std::string krb_cc_name = "" )
     {
         std::string cmd;
         std::pair<int, std::string> ldap_search_result;
 
-        cmd = std::string( "ldapsearch -o ldif_wrap=no -LLL -Y GSSAPI -H ldap://" ) + fqdn;
+        if ( !krb5_config.empty() )
+        {
+            cmd = "KRB5_CONFIG=" + krb5_config + " ";
+        }
+        if ( !krb_cc_name.empty() )
+        {
+            cmd += "KRB5CCNAME=FILE:" + krb_cc_name + " ";
+        }
+        cmd += std::string( "ldapsearch -o ldif_wrap=no -LLL -Y GSSAPI" );
+        if ( !krb5_config.empty() && !is_ip_address( fqdn ) )
+        {
+            // The DC host name is already canonical, skip the reverse lookup
+            cmd += " -N";
+        }
+        cmd += std::string( " -H ldap://" ) + fqdn;
         cmd += std::string( " -b '" ) + distinguished_name + std::string( "' " ) + search_string;
 
         std::cerr << Util::getCurrentTime() << '\t' << "INFO: " << cmd << std::endl;
@@ -706,12 +817,33 @@ class Util
         return fqdns;
     }
 
-    static std::pair<int, std::string> execute_kinit_in_domain_joined_case( std::string principal )
+    /**
+     * Checks for an IPv4 or IPv6 address literal
+     * @param host - Like '10.0.0.10' or 'dc01.contoso.com'
+     * @return - true if host is an address
+     */
+    static bool is_ip_address( const std::string& host )
+    {
+        struct in6_addr addr;
+        return inet_pton( AF_INET, host.c_str(), &addr ) == 1 ||
+               inet_pton( AF_INET6, host.c_str(), &addr ) == 1;
+    }
+
+    static std::pair<int, std::string> execute_kinit_in_domain_joined_case(
+        std::string principal, std::string krb5_config = "", std::string krb_cc_name = "" )
     {
         // kinit -k 'EC2AMAZ-8L8GWS$@CONTOSO.COM'
         std::transform( principal.begin(), principal.end(), principal.begin(),
                         []( unsigned char c ) { return std::toupper( c ); } );
         std::string kinit_cmd = "kinit -kt /etc/krb5.keytab " + principal;
+        if ( !krb_cc_name.empty() )
+        {
+            kinit_cmd = "kinit -c " + krb_cc_name + " -kt /etc/krb5.keytab " + principal;
+        }
+        if ( !krb5_config.empty() )
+        {
+            kinit_cmd = "KRB5_CONFIG=" + krb5_config + " " + kinit_cmd;
+        }
         std::pair<int, std::string> result = exec_shell_cmd( kinit_cmd );
         return result;
     }
@@ -848,6 +980,9 @@ class Util
             cf_logger.logger( LOG_ERR, err_msg.c_str() );
         }
 
+        std::string krb5_config = get_krb5_config_for_domain( domain_name );
+        std::string krb_cc_name = get_bootstrap_ccache_path(
+            domain_name, "awsdomainlessusersecret:" + aws_sm_secret_name );
         std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
                         []( unsigned char c ) { return std::toupper( c ); } );
 
@@ -858,7 +993,8 @@ class Util
         username = username + "@" + domain_name;
         kinit_argv[1] = (char*)username.c_str();
         kinit_argv[2] = (char*)password.c_str();
-        int ret = my_kinit_main( 2, kinit_argv );
+        int ret =
+            my_kinit_main_with_options( 2, kinit_argv, krb5_config.c_str(), krb_cc_name.c_str() );
 #if 0
     /* The old way */
     std::string kinit_cmd = "echo '"  + password +  "' | kinit -V " + username + "@" +
@@ -904,6 +1040,8 @@ class Util
             return result;
         }
 
+        std::string krb5_config = get_krb5_config_for_domain( domain_name );
+        std::string krb_cc_name = get_bootstrap_ccache_path( domain_name, username );
         std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
                         []( unsigned char c ) { return std::toupper( c ); } );
 
@@ -914,7 +1052,8 @@ class Util
         username = username + "@" + domain_name;
         kinit_argv[1] = (char*)username.c_str();
         kinit_argv[2] = (char*)password.c_str();
-        int ret = my_kinit_main( 2, kinit_argv );
+        int ret =
+            my_kinit_main_with_options( 2, kinit_argv, krb5_config.c_str(), krb_cc_name.c_str() );
         Util::clearString( username );
         Util::clearString( password );
 
@@ -2,8 +2,10 @@
 #include <iostream>
 #include <libgen.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <chrono>
+#include "lease_registry.hpp"
 #include "util.hpp"
 
 Daemon cf_daemon;
@@ -21,6 +23,13 @@ static void systemd_shutdown_signal_catcher( int signo )
 {
     printf("Credentials-fetcher shutdown: Caught signo %d\n", signo);
     cf_daemon.got_systemd_shutdown_signal = 1;
+    cf_daemon.wake_renewal_thread();
+}
+
+static void config_reload_signal_catcher( int signo )
+{
+    cf_daemon.got_config_reload_signal = 1;
+    cf_daemon.wake_renewal_thread();
 }
 
 #define handle_error_en( en, msg )                                                                 \
@@ -228,16 +237,29 @@ int main( int argc, const char* argv[] )
     {
         exit(  read_meta_data_json_test() ||
               read_meta_data_invalid_json_test() || renewal_failure_krb_dir_not_found_test() ||
-              write_meta_data_json_test() );
+              write_meta_data_json_test() || read_meta_data_json_rss_test() ||
+              gmsa_password_cache_test() || renewal_lead_time_test() || lease_store_test() ||
+              lease_registry_symbols_test() );
+    }
+
+    /* Shutdown, reload and renewal requests wake the renewal thread through this eventfd */
+    cf_daemon.renewal_event_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( cf_daemon.renewal_event_fd < 0 )
+    {
+        perror( "eventfd" );
+        return EXIT_FAILURE;
     }
 
     struct sigaction sa;
+    struct sigaction reload_sa;
     cf_daemon.got_systemd_shutdown_signal = 0;
     memset( &sa, 0, sizeof( struct sigaction ) );
     sa.sa_handler = &systemd_shutdown_signal_catcher;
+    memset( &reload_sa, 0, sizeof( struct sigaction ) );
+    reload_sa.sa_handler = &config_reload_signal_catcher;
     if ( ( sigaction( SIGTERM, &sa, NULL ) == -1 ) ||
          ( sigaction( SIGINT, &sa, NULL ) == -1 ) ||
-         ( sigaction( SIGHUP, &sa, NULL ) == -1 ) )
+         ( sigaction( SIGHUP, &reload_sa, NULL ) == -1 ) )
     {
         perror( "sigaction" );
         return EXIT_FAILURE;
@@ -248,6 +270,9 @@ int main( int argc, const char* argv[] )
     // 2. grpc server
     // 3. timer to run every 45 min
 
+    // leases of a previous run are renewed and served from the in-memory registry
+    LeaseRegistry::instance().load( cf_daemon.krb_files_dir );
+
     if ( !cf_daemon.cred_file.empty() ) {
         cf_daemon.cf_logger.logger( LOG_INFO, "Credential file exists %s", cf_daemon.cred_file.c_str() );
         
@@ -334,6 +359,7 @@ int main( int argc, const char* argv[] )
           if (S_ISREG(st.st_mode))
           {
              cf_daemon.got_systemd_shutdown_signal = 1;
+             cf_daemon.wake_renewal_thread();
           }
        }
 #endif
@@ -0,0 +1,398 @@
+#include "daemon.h"
+#include "util.hpp"
+#include <credentialsfetcher.pb.h>
+#include <sys/mman.h>
+
+/**
+ * Lease store
+ *
+ * All leases are kept in one append-only file under krb_files_dir instead of a JSON
+ * metadata file per lease. Every create appends the lease with all of its tickets and
+ * every delete appends a tombstone; at startup the file is mapped and replayed, the last
+ * record of a lease wins. Once most records are superseded the live leases are rewritten
+ * to a new file that replaces the old one.
+ *
+ *     "CFLEASE1"                                   file header
+ *     <uint32 length> <uint32 crc32> <payload>     LeaseStoreRecord, repeated
+ *
+ * A record torn by a crash fails its length or crc check and is cut off with everything
+ * after it. Lease metadata JSON files written by older versions are imported on first
+ * start and then removed.
+ */
+#define LEASE_STORE_FILE_NAME ".lease_store"
+#define LEASE_STORE_MAGIC "CFLEASE1"
+#define LEASE_STORE_MAGIC_LENGTH 8
+#define LEASE_STORE_MAX_RECORD_LENGTH ( 16 * 1024 * 1024 )
+// compact once the file holds this many records and more than twice the live leases
+#define LEASE_STORE_COMPACT_MIN_RECORDS 1024
+
+typedef std::map<std::string, std::vector<krb_ticket_info_t>> lease_map_t;
+
+static std::mutex lease_store_mutex;
+static std::string lease_store_path;
+static int lease_store_fd = -1;
+// records in the file and the leases they keep alive
+static size_t lease_store_records = 0;
+static std::set<std::string> live_lease_ids;
+
+static uint32_t get_crc32( const uint8_t* data, size_t length )
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for ( size_t i = 0; i < length; i++ )
+    {
+        crc ^= data[i];
+        for ( int bit = 0; bit < 8; bit++ )
+        {
+            crc = ( crc >> 1 ) ^ ( 0xEDB88320 & ( 0 - ( crc & 1 ) ) );
+        }
+    }
+    return ~crc;
+}
+
+static void to_lease_record( const std::string& lease_id,
+                             const std::vector<krb_ticket_info_t>& krb_tickets,
+                             credentialsfetcher::LeaseStoreRecord* record )
+{
+    record->set_lease_id( lease_id );
+    record->set_deleted( false );
+    for ( auto& krb_ticket : krb_tickets )
+    {
+        credentialsfetcher::LeaseStoreTicket* ticket = record->add_tickets();
+        ticket->set_krb_file_path( krb_ticket.krb_file_path );
+        ticket->set_service_account_name( krb_ticket.service_account_name );
+        ticket->set_domain_name( krb_ticket.domain_name );
+        ticket->set_domainless_user( krb_ticket.domainless_user );
+        ticket->set_credspec_info( krb_ticket.credspec_info );
+        ticket->set_distinguished_name( krb_ticket.distinguished_name );
+        for ( auto& spn : krb_ticket.prefetch_spns )
+        {
+            ticket->add_prefetch_spns( spn );
+        }
+        ticket->set_ticket_lifetime( krb_ticket.ticket_lifetime );
+        ticket->set_renew_lifetime( krb_ticket.renew_lifetime );
+        ticket->set_keytab_output( krb_ticket.keytab_output );
+    }
+}
+
+static krb_ticket_info_t from_lease_ticket( const credentialsfetcher::LeaseStoreTicket& ticket )
+{
+    krb_ticket_info_t krb_ticket;
+    krb_ticket.krb_file_path = ticket.krb_file_path();
+    krb_ticket.service_account_name = ticket.service_account_name();
+    krb_ticket.domain_name = ticket.domain_name();
+    krb_ticket.domainless_user = ticket.domainless_user();
+    krb_ticket.credspec_info = ticket.credspec_info();
+    krb_ticket.distinguished_name = ticket.distinguished_name();
+    krb_ticket.prefetch_spns.assign( ticket.prefetch_spns().begin(), ticket.prefetch_spns().end() );
+    krb_ticket.ticket_lifetime = ticket.ticket_lifetime();
+    krb_ticket.renew_lifetime = ticket.renew_lifetime();
+    krb_ticket.keytab_output = ticket.keytab_output();
+    return krb_ticket;
+}
+
+/**
+ * Replays the store file through a read-only mapping
+ * @param file_path - store file
+ * @param leases - receives the live leases
+ * @param records - receives the number of valid records
+ * @return - length of the valid part of the file, 0 if it has no valid header
+ */
+static off_t replay_lease_store( const std::string& file_path, lease_map_t* leases,
+                                 size_t* records )
+{
+    *records = 0;
+    int fd = open( file_path.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 )
+    {
+        return 0;
+    }
+    struct stat file_stat;
+    if ( fstat( fd, &file_stat ) != 0 || file_stat.st_size < LEASE_STORE_MAGIC_LENGTH )
+    {
+        close( fd );
+        return 0;
+    }
+    size_t file_length = (size_t)file_stat.st_size;
+    void* mapping = mmap( nullptr, file_length, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( mapping == MAP_FAILED )
+    {
+        perror( "mmap" );
+        return 0;
+    }
+    const uint8_t* data = (const uint8_t*)mapping;
+    if ( memcmp( data, LEASE_STORE_MAGIC, LEASE_STORE_MAGIC_LENGTH ) != 0 )
+    {
+        munmap( mapping, file_length );
+        return 0;
+    }
+
+    size_t offset = LEASE_STORE_MAGIC_LENGTH;
+    credentialsfetcher::LeaseStoreRecord record;
+    while ( offset + 2 * sizeof( uint32_t ) <= file_length )
+    {
+        uint32_t length;
+        uint32_t crc;
+        memcpy( &length, data + offset, sizeof( length ) );
+        memcpy( &crc, data + offset + sizeof( length ), sizeof( crc ) );
+        const uint8_t* payload = data + offset + 2 * sizeof( uint32_t );
+        if ( length > LEASE_STORE_MAX_RECORD_LENGTH ||
+             length > file_length - offset - 2 * sizeof( uint32_t ) ||
+             get_crc32( payload, length ) != crc || !record.ParseFromArray( payload, length ) )
+        {
+            break;
+        }
+        if ( record.deleted() )
+        {
+            leases->erase( record.lease_id() );
+        }
+        else
+        {
+            std::vector<krb_ticket_info_t>& krb_tickets = ( *leases )[record.lease_id()];
+            krb_tickets.clear();
+            for ( auto& ticket : record.tickets() )
+            {
+                krb_tickets.push_back( from_lease_ticket( ticket ) );
+            }
+        }
+        ( *records )++;
+        offset += 2 * sizeof( uint32_t ) + length;
+    }
+    munmap( mapping, file_length );
+    return (off_t)offset;
+}
+
+static int write_lease_record( int fd, const credentialsfetcher::LeaseStoreRecord& record )
+{
+    std::string payload;
+    if ( !record.SerializeToString( &payload ) )
+    {
+        return -1;
+    }
+    uint32_t length = (uint32_t)payload.size();
+    uint32_t crc = get_crc32( (const uint8_t*)payload.data(), payload.size() );
+    std::string buffer( (const char*)&length, sizeof( length ) );
+    buffer.append( (const char*)&crc, sizeof( crc ) );
+    buffer.append( payload );
+    // one write per record, O_APPEND keeps records whole
+    return write( fd, buffer.data(), buffer.size() ) == (ssize_t)buffer.size() ? 0 : -1;
+}
+
+/**
+ * Rewrites the store with only the live leases
+ * @param leases - live leases
+ * @return - 0 on success
+ */
+static int compact_lease_store_locked( const lease_map_t& leases )
+{
+    std::string staging_path = lease_store_path + ".new";
+    int fd = open( staging_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                   0600 );
+    if ( fd < 0 )
+    {
+        perror( "open lease store" );
+        return -1;
+    }
+    bool written = write( fd, LEASE_STORE_MAGIC, LEASE_STORE_MAGIC_LENGTH ) ==
+                   LEASE_STORE_MAGIC_LENGTH;
+    for ( auto& lease : leases )
+    {
+        credentialsfetcher::LeaseStoreRecord record;
+        to_lease_record( lease.first, lease.second, &record );
+        written = written && write_lease_record( fd, record ) == 0;
+    }
+    if ( !written || fdatasync( fd ) != 0 || rename( staging_path.c_str(),
+                                                     lease_store_path.c_str() ) != 0 )
+    {
+        std::cerr << Util::getCurrentTime() << '\t'
+                  << "ERROR: cannot compact lease store " << lease_store_path << std::endl;
+        close( fd );
+        unlink( staging_path.c_str() );
+        return -1;
+    }
+
+    if ( lease_store_fd >= 0 )
+    {
+        close( lease_store_fd );
+    }
+    lease_store_fd = fd;
+    lease_store_records = leases.size();
+    live_lease_ids.clear();
+    for ( auto& lease : leases )
+    {
+        live_lease_ids.insert( lease.first );
+    }
+    return 0;
+}
+
+/**
+ * Imports the metadata JSON files of older versions
+ * @param krb_files_dir - path of the dir for kerberos tickets
+ * @param leases - live leases, the imported ones are added
+ * @return - metadata files that can be removed
+ */
+static std::vector<std::string> import_meta_data_files( const std::string& krb_files_dir,
+                                                        lease_map_t* leases )
+{
+    std::vector<std::string> imported;
+    for ( auto& file_path : get_meta_data_file_paths( krb_files_dir ) )
+    {
+        // Metadata files are '<krb_files_dir>/<lease_id>/<lease_id>_metadata.json'
+        std::string lease_id = std::filesystem::path( file_path ).parent_path().filename();
+        if ( leases->count( lease_id ) )
+        {
+            // imported before a crash kept the file from being removed
+            imported.push_back( file_path );
+            continue;
+        }
+        std::vector<krb_ticket_info_t> krb_tickets = read_meta_data_json( file_path );
+        if ( !krb_tickets.empty() )
+        {
+            ( *leases )[lease_id] = krb_tickets;
+            imported.push_back( file_path );
+        }
+    }
+    return imported;
+}
+
+/**
+ * Opens the store of a krb directory, replaying it and importing older metadata files
+ * @param krb_files_dir - path of the dir for kerberos tickets
+ * @param leases - receives the live leases
+ * @return - 0 on success
+ */
+static int open_lease_store_locked( const std::string& krb_files_dir, lease_map_t* leases )
+{
+    if ( lease_store_fd >= 0 )
+    {
+        close( lease_store_fd );
+        lease_store_fd = -1;
+    }
+    lease_store_path = krb_files_dir + "/" + LEASE_STORE_FILE_NAME;
+    off_t valid_length = replay_lease_store( lease_store_path, leases, &lease_store_records );
+    std::vector<std::string> imported = import_meta_data_files( krb_files_dir, leases );
+
+    // A new store, imported leases or a torn tail are written out as a fresh file
+    struct stat file_stat;
+    if ( valid_length == 0 || !imported.empty() ||
+         ( stat( lease_store_path.c_str(), &file_stat ) == 0 &&
+           file_stat.st_size != valid_length ) ||
+         lease_store_records > 2 * leases->size() + LEASE_STORE_COMPACT_MIN_RECORDS )
+    {
+        if ( compact_lease_store_locked( *leases ) != 0 )
+        {
+            return -1;
+        }
+        for ( auto& file_path : imported )
+        {
+            std::cout << Util::getCurrentTime() << '\t' << "INFO: imported lease metadata "
+                      << file_path << std::endl;
+            std::filesystem::remove( file_path );
+        }
+        return 0;
+    }
+
+    lease_store_fd = open( lease_store_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC );
+    if ( lease_store_fd < 0 )
+    {
+        perror( "open lease store" );
+        return -1;
+    }
+    live_lease_ids.clear();
+    for ( auto& lease : *leases )
+    {
+        live_lease_ids.insert( lease.first );
+    }
+    return 0;
+}
+
+/**
+ * Appends a record and compacts the store once most of its records are superseded
+ * @param krb_files_dir - path of the dir for kerberos tickets
+ * @param record - lease or tombstone
+ * @return - 0 on success
+ */
+static int append_lease_record( const std::string& krb_files_dir,
+                                const credentialsfetcher::LeaseStoreRecord& record )
+{
+    std::lock_guard<std::mutex> lock( lease_store_mutex );
+    if ( lease_store_path != krb_files_dir + "/" + LEASE_STORE_FILE_NAME || lease_store_fd < 0 )
+    {
+        lease_map_t leases;
+        if ( open_lease_store_locked( krb_files_dir, &leases ) != 0 )
+        {
+            return -1;
+        }
+    }
+    if ( write_lease_record( lease_store_fd, record ) != 0 )
+    {
+        std::cerr << Util::getCurrentTime() << '\t' << "ERROR: cannot append to lease store "
+                  << lease_store_path << std::endl;
+        return -1;
+    }
+    lease_store_records++;
+    if ( record.deleted() )
+    {
+        live_lease_ids.erase( record.lease_id() );
+    }
+    else
+    {
+        live_lease_ids.insert( record.lease_id() );
+    }
+
+    if ( lease_store_records > 2 * live_lease_ids.size() + LEASE_STORE_COMPACT_MIN_RECORDS )
+    {
+        lease_map_t leases;
+        size_t records = 0;
+        replay_lease_store( lease_store_path, &leases, &records );
+        compact_lease_store_locked( leases );
+    }
+    return 0;
+}
+
+/**
+ * Loads the leases of a krb directory
+ * @param krb_files_dir - path of the dir for kerberos tickets
+ * @return - lease id -> tickets
+ */
+std::map<std::string, std::vector<krb_ticket_info_t>> load_lease_store(
+    const std::string& krb_files_dir )
+{
+    std::lock_guard<std::mutex> lock( lease_store_mutex );
+    lease_map_t leases;
+    if ( open_lease_store_locked( krb_files_dir, &leases ) != 0 )
+    {
+        std::cerr << Util::getCurrentTime() << '\t' << "ERROR: cannot open lease store in "
+                  << krb_files_dir << std::endl;
+    }
+    return leases;
+}
+
+/**
+ * Records a lease with all of its tickets, replacing an earlier record of the lease
+ * @param krb_files_dir - path of the dir for kerberos tickets
+ * @param lease_id - lease of the tickets
+ * @param krb_tickets - all tickets of the lease
+ * @return - 0 on success
+ */
+int put_lease_record( const std::string& krb_files_dir, const std::string& lease_id,
+                      const std::vector<krb_ticket_info_t>& krb_tickets )
+{
+    credentialsfetcher::LeaseStoreRecord record;
+    to_lease_record( lease_id, krb_tickets, &record );
+    return append_lease_record( krb_files_dir, record );
+}
+
+/**
+ * Records that a lease was deleted
+ * @param krb_files_dir - path of the dir for kerberos tickets
+ * @param lease_id - deleted lease
+ * @return - 0 on success
+ */
+int delete_lease_record( const std::string& krb_files_dir, const std::string& lease_id )
+{
+    credentialsfetcher::LeaseStoreRecord record;
+    record.set_lease_id( lease_id );
+    record.set_deleted( true );
+    return append_lease_record( krb_files_dir, record );
+}
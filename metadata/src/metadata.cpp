@@ -32,9 +32,9 @@ bool contains_invalid_characters( const std::string& path )
  * @param krb_files_dir - path of the dir for kerberos tickets
  * @return vector of kerberos ticket info
  */
-std::list<krb_ticket_info_t *> read_meta_data_json( std::string file_path )
+std::vector<krb_ticket_info_t> read_meta_data_json( std::string file_path )
 {
-    std::list<krb_ticket_info_t *> krb_ticket_info_list;
+    std::vector<krb_ticket_info_t> krb_ticket_info_list;
     try
     {
         if ( file_path.empty() )
@@ -57,34 +57,55 @@ std::list<krb_ticket_info_t *> read_meta_data_json( std::string file_path )
 
             for ( const Json::Value& krb_info : child_tree_krb_info )
             {
-                krb_ticket_info_t * krb_ticket_info =
-                    new krb_ticket_info_t ;
+                krb_ticket_info_t krb_ticket_info;
                 std::string krb_file_path = krb_info["krb_file_path"].asString();
 
                 if ( contains_invalid_characters( krb_file_path ) )
                 {
                     std::cout << Util::getCurrentTime() << '\t' << "ERROR: krb file path contains invalid characters"  <<
                         std::endl;
-                    delete ( krb_ticket_info );
                     break;
                 }
 
                 // only add path if it exists
                 if ( std::filesystem::exists( krb_file_path ) )
                 {
-                    krb_ticket_info->krb_file_path = krb_file_path;
-                    krb_ticket_info->service_account_name =
+                    krb_ticket_info.krb_file_path = krb_file_path;
+                    krb_ticket_info.service_account_name =
                         krb_info["service_account_name"].asString();
-                    krb_ticket_info->domain_name = krb_info["domain_name"].asString();
-                    krb_ticket_info->domainless_user = krb_info["domainless_user"].asString();
+                    krb_ticket_info.domain_name = krb_info["domain_name"].asString();
+                    krb_ticket_info.domainless_user = krb_info["domainless_user"].asString();
                     if(krb_info.isMember("distinguished_name"))
                     {
-                        krb_ticket_info->distinguished_name = krb_info["distinguished_name"].asString();
+                        krb_ticket_info.distinguished_name = krb_info["distinguished_name"].asString();
                     }
 
                     if(krb_info.isMember("credspec_info"))
                     {
-                        krb_ticket_info->credspec_info = krb_info["credspec_info"].asString();
+                        krb_ticket_info.credspec_info = krb_info["credspec_info"].asString();
+                    }
+
+                    if(krb_info.isMember("prefetch_spns"))
+                    {
+                        for ( const Json::Value& spn : krb_info["prefetch_spns"] )
+                        {
+                            krb_ticket_info.prefetch_spns.push_back( spn.asString() );
+                        }
+                    }
+
+                    if(krb_info.isMember("ticket_lifetime"))
+                    {
+                        krb_ticket_info.ticket_lifetime = krb_info["ticket_lifetime"].asUInt();
+                    }
+
+                    if(krb_info.isMember("renew_lifetime"))
+                    {
+                        krb_ticket_info.renew_lifetime = krb_info["renew_lifetime"].asUInt();
+                    }
+
+                    if(krb_info.isMember("keytab_output"))
+                    {
+                        krb_ticket_info.keytab_output = krb_info["keytab_output"].asBool();
                     }
 
                     krb_ticket_info_list.push_back( krb_ticket_info );
@@ -114,7 +135,11 @@ std::list<krb_ticket_info_t *> read_meta_data_json( std::string file_path )
             "service_account_name": "WebApp01",
             "domain_name": "contoso.com",
             "domainless_user": "user1",
-            "distinguished_name": "CN=webapp01,CN=Managed Service Accounts,DC=contoso,DC=com"
+            "distinguished_name": "CN=webapp01,CN=Managed Service Accounts,DC=contoso,DC=com",
+            "prefetch_spns": [ "MSSQLSvc/sql01.contoso.com:1433" ],
+            "ticket_lifetime": 36000,
+            "renew_lifetime": 604800,
+            "keytab_output": true
         }
     ]
 }
@@ -125,14 +150,11 @@ std::list<krb_ticket_info_t *> read_meta_data_json( std::string file_path )
  * @return 0 or 1 for successful or failed writes
  */
 
-int write_meta_data_json( krb_ticket_info_t* krb_ticket_info,
+int write_meta_data_json( const krb_ticket_info_t& krb_ticket_info,
                           std::string lease_id, std::string krb_files_dir )
 {
-    std::list<krb_ticket_info_t *> krb_ticket_info_list;
-
-    krb_ticket_info_list.push_back(krb_ticket_info);
-    
-    return write_meta_data_json(krb_ticket_info_list, lease_id, krb_files_dir);
+    return write_meta_data_json( std::vector<krb_ticket_info_t>{ krb_ticket_info }, lease_id,
+                                 krb_files_dir );
 }
 
 /* @param krb_ticket_info_list - info of the kerberos tickets created
@@ -140,7 +162,7 @@ int write_meta_data_json( krb_ticket_info_t* krb_ticket_info,
  * @param krb_files_dir - path of the dir for kerberos tickets
  * @return 0 or 1 for successful or failed writes
  */
-int write_meta_data_json( std::list<krb_ticket_info_t*> krb_ticket_info_list,
+int write_meta_data_json( const std::vector<krb_ticket_info_t>& krb_ticket_info_list,
                           std::string lease_id, std::string krb_files_dir )
 {
     try
@@ -156,15 +178,36 @@ int write_meta_data_json( std::list<krb_ticket_info_t*> krb_ticket_info_list,
         Json::Value root;
         Json::Value krb_ticket_info_parent;
 
-        for ( auto krb_ticket_info : krb_ticket_info_list )
+        for ( auto& krb_ticket_info : krb_ticket_info_list )
         {
             Json::Value ticket_info;
-            ticket_info["krb_file_path"] = krb_ticket_info->krb_file_path;
-            ticket_info["service_account_name"] = krb_ticket_info->service_account_name;
-            ticket_info["domain_name"] = krb_ticket_info->domain_name;
-            ticket_info["domainless_user"] = krb_ticket_info->domainless_user;
-            ticket_info["credspec_info"] = krb_ticket_info->credspec_info;
-            ticket_info["distinguished_name"] = krb_ticket_info->distinguished_name;
+            ticket_info["krb_file_path"] = krb_ticket_info.krb_file_path;
+            ticket_info["service_account_name"] = krb_ticket_info.service_account_name;
+            ticket_info["domain_name"] = krb_ticket_info.domain_name;
+            ticket_info["domainless_user"] = krb_ticket_info.domainless_user;
+            ticket_info["credspec_info"] = krb_ticket_info.credspec_info;
+            ticket_info["distinguished_name"] = krb_ticket_info.distinguished_name;
+            if ( !krb_ticket_info.prefetch_spns.empty() )
+            {
+                Json::Value prefetch_spns( Json::arrayValue );
+                for ( auto& spn : krb_ticket_info.prefetch_spns )
+                {
+                    prefetch_spns.append( spn );
+                }
+                ticket_info["prefetch_spns"] = prefetch_spns;
+            }
+            if ( krb_ticket_info.ticket_lifetime > 0 )
+            {
+                ticket_info["ticket_lifetime"] = krb_ticket_info.ticket_lifetime;
+            }
+            if ( krb_ticket_info.renew_lifetime > 0 )
+            {
+                ticket_info["renew_lifetime"] = krb_ticket_info.renew_lifetime;
+            }
+            if ( krb_ticket_info.keytab_output )
+            {
+                ticket_info["keytab_output"] = true;
+            }
 
             krb_ticket_info_parent.append( ticket_info );
         }
@@ -23,9 +23,10 @@ int read_meta_data_json_test()
         }
     }
 
-    std::list<krb_ticket_info_t*> result = read_meta_data_json( metadata_file_path );
+    std::vector<krb_ticket_info_t> result = read_meta_data_json( metadata_file_path );
 
-    if ( result.empty() || result.size() != 2 )
+    if ( result.empty() || result.size() != 2 || !result.front().prefetch_spns.empty() ||
+         result.back().prefetch_spns.size() != 1 )
     {
         std::cout << "reading meta data file test is failed" << std::endl;
         for ( auto file_path : paths )
@@ -47,7 +48,7 @@ int read_meta_data_invalid_json_test()
 {
     std::string metadata_file_path = "metadata_invalid_sample.json";
 
-    std::list<krb_ticket_info_t*> result = read_meta_data_json( metadata_file_path );
+    std::vector<krb_ticket_info_t> result = read_meta_data_json( metadata_file_path );
 
     if ( result.empty() )
     {
@@ -79,8 +80,7 @@ int write_meta_data_json_test()
         }
     }
 
-    std::list<krb_ticket_info_t *> test_ticket_info =
-        read_meta_data_json( metadata_file_path );
+    std::vector<krb_ticket_info_t> test_ticket_info = read_meta_data_json( metadata_file_path );
 
     std::string krb_files_dir = "/usr/share/credentials-fetcher/krbdir";
     std::string test_lease_id = "test1234567890";
@@ -107,3 +107,108 @@ int write_meta_data_json_test()
     }
     return EXIT_SUCCESS;
 }
+
+static long get_resident_set_kb()
+{
+    long pages = 0;
+    std::ifstream statm( "/proc/self/statm" );
+    statm >> pages >> pages;
+    return pages * ( sysconf( _SC_PAGESIZE ) / 1024 );
+}
+
+int read_meta_data_json_rss_test()
+{
+    std::string metadata_file_path = "metadata_sample.json";
+
+    std::vector<std::string> paths = {
+        "/usr/share/credentials-fetcher/krbdir/73099acdb5807b4bbf91/ccname_WebApp01_7K4PEM",
+        "/usr/share/credentials-fetcher/krbdir/73099acdb5807b4bbf91/ccname_WebApp03_53Yg4I" };
+
+    for ( auto file_path : paths )
+    {
+        std::filesystem::create_directories( std::filesystem::path( file_path ).parent_path() );
+        std::ofstream file( file_path );
+    }
+
+    // every cycle reads the tickets of a lease like a renewal pass used to, nothing may be left
+    // behind once the tickets go out of scope
+    auto run_cycles = [&]( int cycles ) {
+        size_t tickets = 0;
+        for ( int i = 0; i < cycles; i++ )
+        {
+            tickets += read_meta_data_json( metadata_file_path ).size();
+        }
+        return tickets;
+    };
+    size_t tickets = run_cycles( 1000 );
+    long rss_before = get_resident_set_kb();
+    tickets += run_cycles( 20000 );
+    long rss_after = get_resident_set_kb();
+
+    for ( auto file_path : paths )
+    {
+        std::filesystem::remove_all( file_path );
+    }
+    // a leak of the two tickets per cycle would add more than 10 MB
+    if ( tickets != 2 * 21000 || rss_after - rss_before > 1024 )
+    {
+        std::cout << "meta data memory test is failed, rss grew by " << rss_after - rss_before
+                  << " kB" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "meta data memory test is successful" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int lease_store_test()
+{
+    std::string krb_files_dir = std::filesystem::temp_directory_path().string() +
+                                "/credentials_fetcher_lease_store_test";
+    std::string store_path = krb_files_dir + "/.lease_store";
+    std::filesystem::remove_all( krb_files_dir );
+    std::filesystem::create_directories( krb_files_dir );
+
+    krb_ticket_info_t krb_ticket;
+    krb_ticket.krb_file_path = krb_files_dir + "/lease1/ccname_WebApp01_7K4PEM";
+    krb_ticket.service_account_name = "WebApp01";
+    krb_ticket.domain_name = "contoso.com";
+    krb_ticket.prefetch_spns = { "MSSQLSvc/sql01.contoso.com:1433" };
+    krb_ticket.ticket_lifetime = 36000;
+    krb_ticket_info_t other_ticket = krb_ticket;
+    other_ticket.krb_file_path = krb_files_dir + "/lease2/ccname_WebApp03_53Yg4I";
+    other_ticket.service_account_name = "WebApp03";
+
+    bool passed = put_lease_record( krb_files_dir, "lease1", { krb_ticket } ) == 0;
+    size_t record_size = std::filesystem::file_size( store_path ) - 8;
+    passed = passed && put_lease_record( krb_files_dir, "lease2", { other_ticket } ) == 0 &&
+             put_lease_record( krb_files_dir, "lease3", { krb_ticket, other_ticket } ) == 0 &&
+             delete_lease_record( krb_files_dir, "lease3" ) == 0;
+
+    // a record torn by a crash is dropped on the next load
+    {
+        std::ofstream store( store_path, std::ios::binary | std::ios::app );
+        store.write( "\x40\x00\x00\x00torn", 8 );
+    }
+    auto leases = load_lease_store( krb_files_dir );
+    passed = passed && leases.size() == 2 && leases["lease1"].size() == 1 &&
+             leases["lease1"][0].prefetch_spns == krb_ticket.prefetch_spns &&
+             leases["lease1"][0].ticket_lifetime == 36000 &&
+             leases["lease2"][0].service_account_name == "WebApp03";
+
+    // superseded records are compacted away
+    for ( int i = 0; i < 3000; i++ )
+    {
+        passed = passed && put_lease_record( krb_files_dir, "lease1", { krb_ticket } ) == 0;
+    }
+    passed = passed && std::filesystem::file_size( store_path ) < 2000 * record_size &&
+             load_lease_store( krb_files_dir ).size() == 2;
+
+    std::filesystem::remove_all( krb_files_dir );
+    if ( !passed )
+    {
+        std::cout << "lease store test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "lease store test is successful" << std::endl;
+    return EXIT_SUCCESS;
+}
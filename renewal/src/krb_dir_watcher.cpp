@@ -0,0 +1,214 @@
+#include "daemon.h"
+#include "lease_registry.hpp"
+#include "util.hpp"
+#include <map>
+#include <sys/inotify.h>
+
+/**
+ * krb directory watcher
+ *
+ * Lease directories can be created or removed under krb_files_dir by other tooling, e.g.
+ * the ECS agent cleaning up after a task. The directory is watched with inotify and every
+ * create or delete event is applied to the lease registry right away, so a removed lease
+ * leaves the renewal schedule without waiting for a rescan.
+ *
+ *     <krb_files_dir>                     lease directories created, deleted or moved
+ *     <krb_files_dir>/<lease_id>          metadata file written or moved in by other tooling
+ *
+ * Leases created by the daemon itself are recorded in the lease store, a metadata file found
+ * in a lease directory is imported into the store. Only lease directories the registry does
+ * not know are watched, until their metadata file is imported, so the daemon's own leases
+ * neither use up inotify watches nor wake the renewal thread when their ccache or keytab is
+ * rewritten. Hidden entries (the lease store, the shared and bootstrap ccache stores) are
+ * not leases.
+ */
+#define KRB_DIR_WATCH_MASK ( IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR )
+#define LEASE_DIR_WATCH_MASK ( IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR )
+#define METADATA_FILE_SUFFIX "_metadata.json"
+
+// watch descriptor -> lease id, the watch of krb_files_dir maps to an empty id
+static std::map<int, std::string> krb_dir_watches;
+
+/**
+ * Stops watching the directories of the leases that are now in the registry
+ * @param inotify_fd - from watch_krb_files_dir()
+ */
+static void unwatch_known_lease_dirs( int inotify_fd )
+{
+    for ( auto watch = krb_dir_watches.begin(); watch != krb_dir_watches.end(); )
+    {
+        if ( watch->second.empty() || !LeaseRegistry::instance().contains_lease( watch->second ) )
+        {
+            watch++;
+            continue;
+        }
+        inotify_rm_watch( inotify_fd, watch->first );
+        watch = krb_dir_watches.erase( watch );
+    }
+}
+
+/**
+ * Starts watching a lease directory unknown to the registry for its metadata file, and
+ * registers the lease if the file was written before the watch was in place
+ * @param inotify_fd - from watch_krb_files_dir()
+ * @param krb_files_dir - path of the dir for kerberos tickets
+ * @param lease_id - lease directory name
+ */
+static void watch_lease_dir( int inotify_fd, const std::string& krb_files_dir,
+                             const std::string& lease_id )
+{
+    if ( LeaseRegistry::instance().contains_lease( lease_id ) )
+    {
+        // Created by the daemon, the lease store already has it
+        return;
+    }
+    std::string lease_dir = krb_files_dir + "/" + lease_id;
+    int wd = inotify_add_watch( inotify_fd, lease_dir.c_str(), LEASE_DIR_WATCH_MASK );
+    if ( wd >= 0 )
+    {
+        krb_dir_watches[wd] = lease_id;
+    }
+    else if ( errno != ENOENT )
+    {
+        // e.g. ENOSPC when fs.inotify.max_user_watches is reached
+        std::cerr << Util::getCurrentTime() << '\t' << "WARNING: cannot watch " << lease_dir
+                  << ", its metadata file is only imported on reload: " << strerror( errno )
+                  << std::endl;
+    }
+    LeaseRegistry::instance().sync_lease( krb_files_dir, lease_id );
+}
+
+/**
+ * Brings the registry in line with the directory after events were lost
+ * @param krb_files_dir - path of the dir for kerberos tickets
+ */
+void resync_krb_files_dir( const std::string& krb_files_dir )
+{
+    for ( auto& lease_id : LeaseRegistry::instance().get_lease_ids() )
+    {
+        LeaseRegistry::instance().sync_lease( krb_files_dir, lease_id );
+    }
+    std::error_code ec;
+    for ( auto& entry : std::filesystem::directory_iterator( krb_files_dir, ec ) )
+    {
+        std::string lease_id = entry.path().filename().string();
+        if ( entry.is_directory() && !lease_id.empty() && lease_id[0] != '.' )
+        {
+            LeaseRegistry::instance().sync_lease( krb_files_dir, lease_id );
+        }
+    }
+}
+
+/**
+ * Starts watching the krb directory
+ * @param krb_files_dir - path of the dir for kerberos tickets
+ * @return - non-blocking inotify descriptor to poll, -1 on error
+ */
+int watch_krb_files_dir( const std::string& krb_files_dir )
+{
+    int inotify_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    if ( inotify_fd < 0 )
+    {
+        perror( "inotify_init1" );
+        return -1;
+    }
+
+    krb_dir_watches.clear();
+    int wd = inotify_add_watch( inotify_fd, krb_files_dir.c_str(), KRB_DIR_WATCH_MASK );
+    if ( wd < 0 )
+    {
+        perror( "inotify_add_watch" );
+        close( inotify_fd );
+        return -1;
+    }
+    krb_dir_watches[wd] = "";
+    return inotify_fd;
+}
+
+/**
+ * Applies the pending events of the krb directory to the lease registry
+ * @param inotify_fd - from watch_krb_files_dir()
+ * @param krb_files_dir - path of the dir for kerberos tickets
+ * @return - ccache paths of the leases that were removed behind the daemon's back
+ */
+std::vector<std::string> apply_krb_files_dir_events( int inotify_fd,
+                                                     const std::string& krb_files_dir )
+{
+    std::vector<std::string> removed;
+    bool check_watches = false;
+    alignas( struct inotify_event ) char buffer[4096];
+    ssize_t length;
+    while ( ( length = read( inotify_fd, buffer, sizeof( buffer ) ) ) > 0 )
+    {
+        for ( char* ptr = buffer; ptr < buffer + length;
+              ptr += sizeof( struct inotify_event ) + ( (struct inotify_event*)ptr )->len )
+        {
+            const struct inotify_event* event = (const struct inotify_event*)ptr;
+            if ( event->mask & IN_Q_OVERFLOW )
+            {
+                std::cerr << Util::getCurrentTime() << '\t'
+                          << "WARNING: krb directory events lost, rescanning " << krb_files_dir
+                          << std::endl;
+                resync_krb_files_dir( krb_files_dir );
+                continue;
+            }
+            auto watch = krb_dir_watches.find( event->wd );
+            if ( watch == krb_dir_watches.end() )
+            {
+                continue;
+            }
+            if ( event->mask & IN_IGNORED )
+            {
+                krb_dir_watches.erase( watch );
+                continue;
+            }
+            std::string name = event->len > 0 ? std::string( event->name ) : "";
+            std::string lease_id = watch->second;
+
+            if ( lease_id.empty() )
+            {
+                // event on krb_files_dir, name is a lease directory
+                if ( name.empty() || name[0] == '.' || !( event->mask & IN_ISDIR ) )
+                {
+                    continue;
+                }
+                if ( event->mask & ( IN_CREATE | IN_MOVED_TO ) )
+                {
+                    watch_lease_dir( inotify_fd, krb_files_dir, name );
+                    check_watches = true;
+                }
+                else
+                {
+                    for ( auto& krb_cc_name : LeaseRegistry::instance().remove_lease( name ) )
+                    {
+                        std::cout << Util::getCurrentTime() << '\t' << "INFO: lease ccache "
+                                  << krb_cc_name << " was removed" << std::endl;
+                        forget_gmsa_keytab_file( get_lease_keytab_path( krb_cc_name ) );
+                        removed.push_back( krb_cc_name );
+                    }
+                }
+            }
+            else
+            {
+                if ( name == lease_id + METADATA_FILE_SUFFIX )
+                {
+                    // metadata file of a lease written
+                    for ( auto& krb_cc_name :
+                          LeaseRegistry::instance().sync_lease( krb_files_dir, lease_id ) )
+                    {
+                        removed.push_back( krb_cc_name );
+                    }
+                }
+                // a ccache written by the daemon also tells that its lease is registered
+                check_watches = true;
+            }
+        }
+    }
+    if ( check_watches )
+    {
+        // A watch is only needed until the lease is registered, from its metadata file or by
+        // the daemon after the directory event was read
+        unwatch_known_lease_dirs( inotify_fd );
+    }
+    return removed;
+}
@@ -1,14 +1,748 @@
 #include "daemon.h"
+#include "dc_latency_tracker.hpp"
+#include "gmsa_password_cache.hpp"
+#include "lease_registry.hpp"
+#include "renewal_lead_time.hpp"
+#include "symbol_table.hpp"
 #include "util.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <fstream>
+#include <list>
+#include <map>
+#include <openssl/sha.h>
+#include <poll.h>
+#include <queue>
+#include <set>
 #include <stdlib.h>
+#include <sys/timerfd.h>
+#include <thread>
+#include <tuple>
 
-int krb_ticket_renew_handler( Daemon cf_daemon )
+// retry a failed renewal after this many seconds
+#define RENEWAL_RETRY_SECS 300
+// spread factor when CF_RENEWAL_SPREAD_FACTOR is not set
+#define DEFAULT_RENEWAL_SPREAD_FACTOR 0.25
+// retry budget when CF_RENEWAL_RETRY_BUDGET is not set
+#define DEFAULT_RENEWAL_RETRY_BUDGET 2
+#define MAX_RENEWAL_RETRY_BUDGET 20
+// renewal worker threads, and how many of them may work on one domain at a time
+#define RENEWAL_MAX_WORKERS 16
+#define RENEWAL_MAX_WORKERS_PER_DOMAIN 4
+// longest renewal forecast, in hours
+#define RENEWAL_FORECAST_MAX_HOURS ( 30 * 24 )
+// default msDS-ManagedPasswordInterval, rotations after the cached password are assumed to
+// follow it
+#define GMSA_DEFAULT_PASSWORD_INTERVAL_SECS ( 30 * 24 * 3600 )
+
+/**
+ * A lease ccache in the renewal schedule
+ */
+typedef struct renewal_entry_t_
+{
+    time_t renew_at = 0;
+    // entries superseded by an on-demand renewal have an older generation than the schedule
+    uint64_t generation = 0;
+    krb_ticket_info_t krb_ticket;
+
+    bool operator>( const struct renewal_entry_t_& other ) const
+    {
+        return renew_at > other.renew_at;
+    }
+} renewal_entry_t;
+
+typedef std::priority_queue<renewal_entry_t, std::vector<renewal_entry_t>,
+                            std::greater<renewal_entry_t>>
+    renewal_queue_t;
+
+// lease ccache -> generation of its current entry in the renewal queue
+typedef std::map<std::string, uint64_t> renewal_schedule_t;
+
+/**
+ * Generation of a new schedule entry, unique for the life of the process so that entries
+ * handed back by the renewal workers after a reload are told apart from the new schedule
+ * @return - next generation, only called on the renewal thread
+ */
+static uint64_t get_next_renewal_generation()
+{
+    static uint64_t generation = 0;
+    return ++generation;
+}
+
+// Daemon context of the running renewal thread, null while it is not running
+static std::atomic<Daemon*> renewal_context( nullptr );
+static std::mutex renewal_requests_mutex;
+static std::set<std::string> renewal_requests;
+
+/**
+ * Renewals awaited through renew_leases_async(), guarded by renewal_requests_mutex
+ */
+typedef struct renewal_outcome_t_
+{
+    // renewals finished since the first waiter, and whether the last one succeeded
+    uint64_t completed = 0;
+    bool renewed = false;
+    int waiters = 0;
+} renewal_outcome_t;
+
+/**
+ * A caller of renew_leases_async() waiting for its renewals, guarded by renewal_requests_mutex
+ */
+typedef struct renewal_waiter_t_
+{
+    // lease ccache -> completed count of its outcome once the awaited renewal finished
+    std::map<std::string, uint64_t> awaited;
+    // leases still unfinished at this time are reported pending
+    time_t deadline = 0;
+    lease_renewal_callback_t on_done;
+} renewal_waiter_t;
+
+static std::set<std::string> renewals_in_flight;
+// lease ccache -> outcome, only while someone waits for it
+static std::map<std::string, renewal_outcome_t> renewal_outcomes;
+static std::list<renewal_waiter_t> renewal_waiters;
+
+/**
+ * Fraction of the usable ticket lifetime over which renewals are spread
+ * @return - CF_RENEWAL_SPREAD_FACTOR from the shell or /etc/ecs/ecs.config, clamped to [0, 1]
+ */
+static double get_renewal_spread_factor()
+{
+    // Read once, renewal workers call this concurrently
+    static const double spread_factor = []() {
+        const char* env_value = getenv( ENV_CF_RENEWAL_SPREAD );
+        std::string value = env_value != nullptr
+                                ? std::string( env_value )
+                                : Util::retrieve_variable_from_ecs_config( ENV_CF_RENEWAL_SPREAD );
+        char* end = nullptr;
+        double parsed = strtod( value.c_str(), &end );
+        if ( value.empty() || end == value.c_str() || *end != '\0' )
+        {
+            return DEFAULT_RENEWAL_SPREAD_FACTOR;
+        }
+        return std::min( 1.0, std::max( 0.0, parsed ) );
+    }();
+    return spread_factor;
+}
+
+/**
+ * Retries a renewal should be able to make before the ticket expires
+ * @return - CF_RENEWAL_RETRY_BUDGET from the shell or /etc/ecs/ecs.config
+ */
+static int get_renewal_retry_budget()
+{
+    // Read once, renewal workers call this concurrently
+    static const int retry_budget = []() {
+        const char* env_value = getenv( ENV_CF_RENEWAL_RETRY_BUDGET );
+        std::string value =
+            env_value != nullptr
+                ? std::string( env_value )
+                : Util::retrieve_variable_from_ecs_config( ENV_CF_RENEWAL_RETRY_BUDGET );
+        char* end = nullptr;
+        long parsed = strtol( value.c_str(), &end, 10 );
+        if ( value.empty() || end == value.c_str() || *end != '\0' )
+        {
+            return DEFAULT_RENEWAL_RETRY_BUDGET;
+        }
+        return (int)std::min( (long)MAX_RENEWAL_RETRY_BUDGET, std::max( 0L, parsed ) );
+    }();
+    return retry_budget;
+}
+
+/**
+ * How long before its TGT expires a lease of a domain is renewed, adapted to the latency
+ * and failure rate of the recent acquisitions in the domain
+ * @param domain_name - Like 'contoso.com'
+ * @return - lead time in seconds
+ */
+time_t get_renewal_lead_time( const std::string& domain_name )
+{
+    return RenewalLeadTime::instance().get_lead_time( domain_name, get_renewal_retry_budget(),
+                                                      RENEWAL_RETRY_SECS );
+}
+
+/**
+ * Deterministic position of a lease in the spread window, different on every host so that
+ * leases created in the same burst across the fleet do not renew together
+ * @param krb_cc_name - lease ccache
+ * @return - value in [0, 1)
+ */
+static double get_renewal_jitter( const std::string& krb_cc_name )
+{
+    static const std::string host_id = []() {
+        std::string id;
+        std::ifstream machine_id_file( "/etc/machine-id" );
+        std::getline( machine_id_file, id );
+        if ( id.empty() )
+        {
+            char host_name[HOST_NAME_MAX + 1] = { 0 };
+            gethostname( host_name, HOST_NAME_MAX );
+            id = host_name;
+        }
+        return id;
+    }();
+
+    std::string key = host_id + "|" + krb_cc_name;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256( (const unsigned char*)key.c_str(), key.length(), digest );
+    uint64_t bits = 0;
+    memcpy( &bits, digest, sizeof( bits ) );
+    return (double)( bits >> 11 ) / (double)( 1ULL << 53 );
+}
+
+/**
+ * When a lease is due for renewal: the lead time of its domain before its TGT expires, or when
+ * its cached gMSA password is due for refresh ahead of a rotation, whichever is first.
+ * Leases in keytab output mode only follow the password.
+ * The TGT renewal is moved earlier by a per-lease jitter of up to the spread factor times
+ * the lifetime left before the safety margin, so the renewals of a burst of leases are
+ * spread over their lifetime instead of hitting the domain controllers together.
+ *
+ * @param krb_ticket - lease ticket info
+ * @return - renewal time, 0 if the lease is due now
+ */
+static time_t get_renew_at( const krb_ticket_info_t& krb_ticket )
+{
+    time_t refresh_at = GmsaPasswordCache::instance().get_refresh_at(
+        krb_ticket.domain_name, krb_ticket.service_account_name );
+    if ( krb_ticket.keytab_output )
+    {
+        return std::filesystem::exists( get_lease_keytab_path( krb_ticket.krb_file_path ) )
+                   ? refresh_at
+                   : 0;
+    }
+
+    krb5_ticket_times times;
+    if ( !get_tgt_times( krb_ticket.krb_file_path, &times ) )
+    {
+        return 0;
+    }
+    time_t starttime = times.starttime != 0 ? (time_t)times.starttime : (time_t)times.authtime;
+    // At most half of the lifetime, so a struggling domain cannot keep a short ticket renewing
+    time_t lead_time = std::min( get_renewal_lead_time( krb_ticket.domain_name ),
+                                 ( (time_t)times.endtime - starttime ) / 2 );
+    time_t renew_at = (time_t)times.endtime - lead_time;
+    if ( renew_at > starttime )
+    {
+        renew_at -= (time_t)( ( renew_at - starttime ) * get_renewal_spread_factor() *
+                              get_renewal_jitter( krb_ticket.krb_file_path ) );
+    }
+    if ( refresh_at != 0 && refresh_at < renew_at )
+    {
+        renew_at = refresh_at;
+    }
+    return renew_at;
+}
+
+/**
+ * Only leases that the daemon can renew on its own (machine keytab or secret vault
+ * bootstrap) are scheduled, domainless user leases are renewed through the API
+ * @param krb_ticket - lease ticket info
+ * @return - true if the renewal thread renews the lease
+ */
+bool is_scheduled_lease( const krb_ticket_info_t& krb_ticket )
+{
+    return krb_ticket.domainless_user.empty() ||
+           krb_ticket.domainless_user.find( "awsdomainlessusersecret" ) != std::string::npos;
+}
+
+/**
+ * Adds the leases registered since the last call
+ * @param registry_cursor - position in the lease registry, advanced past the new leases
+ * @param scheduled - lease ccaches in the schedule
+ * @param renewal_queue - schedule to add to
+ */
+static void schedule_new_leases( uint64_t* registry_cursor, renewal_schedule_t& scheduled,
+                                 renewal_queue_t& renewal_queue )
+{
+    for ( auto& krb_ticket : LeaseRegistry::instance().get_added_since( registry_cursor ) )
+    {
+        if ( is_scheduled_lease( krb_ticket ) && !scheduled.count( krb_ticket.krb_file_path ) )
+        {
+            renewal_entry_t entry;
+            entry.generation = get_next_renewal_generation();
+            scheduled[krb_ticket.krb_file_path] = entry.generation;
+            entry.krb_ticket = krb_ticket;
+            entry.renew_at = get_renew_at( entry.krb_ticket );
+            renewal_queue.push( entry );
+        }
+    }
+}
+
+/**
+ * Asks the renewal thread to renew a lease now, regardless of its renewal time
+ * @param krb_cc_name - lease ccache
+ * @return - false if the renewal thread is not running
+ */
+bool request_lease_renewal( const std::string& krb_cc_name )
+{
+    Daemon* cf_daemon = renewal_context.load();
+    if ( cf_daemon == nullptr )
+    {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock( renewal_requests_mutex );
+        renewal_requests.insert( krb_cc_name );
+    }
+    cf_daemon->wake_renewal_thread();
+    return true;
+}
+
+/**
+ * Releases a waiter and sorts its leases by outcome, called with renewal_requests_mutex held
+ * @param waiter - waiter to release
+ * @param renewed - receives the leases for which a new ticket was acquired
+ * @param pending - receives the leases whose renewal has not finished yet
+ */
+static void release_renewal_waiter( const renewal_waiter_t& waiter, std::set<std::string>* renewed,
+                                    std::set<std::string>* pending )
+{
+    for ( auto& lease : waiter.awaited )
+    {
+        renewal_outcome_t& outcome = renewal_outcomes[lease.first];
+        if ( outcome.completed < lease.second )
+        {
+            pending->insert( lease.first );
+        }
+        else if ( outcome.renewed )
+        {
+            renewed->insert( lease.first );
+        }
+        if ( --outcome.waiters == 0 )
+        {
+            renewal_outcomes.erase( lease.first );
+        }
+    }
+}
+
+/**
+ * Releases the waiters matching a condition and runs their callbacks
+ * The callbacks run without renewal_requests_mutex held, they may call back into this module.
+ * @param is_done - tells from a waiter whether it is released
+ */
+static void complete_renewal_waiters( std::function<bool( const renewal_waiter_t& )> is_done )
+{
+    std::vector<std::tuple<lease_renewal_callback_t, std::set<std::string>, std::set<std::string>>>
+        completed;
+    {
+        std::lock_guard<std::mutex> lock( renewal_requests_mutex );
+        for ( auto waiter = renewal_waiters.begin(); waiter != renewal_waiters.end(); )
+        {
+            if ( !is_done( *waiter ) )
+            {
+                waiter++;
+                continue;
+            }
+            std::set<std::string> renewed;
+            std::set<std::string> pending;
+            release_renewal_waiter( *waiter, &renewed, &pending );
+            completed.emplace_back( std::move( waiter->on_done ), renewed, pending );
+            waiter = renewal_waiters.erase( waiter );
+        }
+    }
+    for ( auto& waiter : completed )
+    {
+        std::get<0>( waiter )( std::get<1>( waiter ), std::get<2>( waiter ) );
+    }
+}
+
+/**
+ * Records that a lease renewal finished and completes the callers waiting for it
+ * @param krb_cc_name - lease ccache
+ * @param renewed - true if a new ticket was acquired
+ */
+static void finish_lease_renewal( const std::string& krb_cc_name, bool renewed )
+{
+    {
+        std::lock_guard<std::mutex> lock( renewal_requests_mutex );
+        renewals_in_flight.erase( krb_cc_name );
+        auto outcome = renewal_outcomes.find( krb_cc_name );
+        if ( outcome == renewal_outcomes.end() )
+        {
+            return;
+        }
+        outcome->second.completed++;
+        outcome->second.renewed = renewed;
+    }
+    complete_renewal_waiters( []( const renewal_waiter_t& waiter ) {
+        for ( auto& lease : waiter.awaited )
+        {
+            if ( renewal_outcomes[lease.first].completed < lease.second )
+            {
+                return false;
+            }
+        }
+        return true;
+    } );
+}
+
+/**
+ * Completes the callers that waited past their deadline, their unfinished leases are pending
+ * @param expire_all - true to complete every caller, when the renewal thread exits
+ * @return - earliest deadline of the callers still waiting, 0 if there are none
+ */
+static time_t expire_renewal_waiters( bool expire_all )
+{
+    time_t now = time( nullptr );
+    complete_renewal_waiters( [now, expire_all]( const renewal_waiter_t& waiter ) {
+        return expire_all || waiter.deadline <= now;
+    } );
+
+    time_t next_deadline = 0;
+    std::lock_guard<std::mutex> lock( renewal_requests_mutex );
+    for ( auto& waiter : renewal_waiters )
+    {
+        if ( next_deadline == 0 || waiter.deadline < next_deadline )
+        {
+            next_deadline = waiter.deadline;
+        }
+    }
+    return next_deadline;
+}
+
+/**
+ * Renews leases now through the renewal thread without waiting for the outcome
+ * A lease that is being renewed when the call is made is not renewed again, the caller
+ * gets the result of the renewal in flight; concurrent callers share a single renewal.
+ * The callback runs once, on a renewal thread when the last lease is renewed or the
+ * timeout expires, or right away when there is nothing to renew.
+ *
+ * @param krb_cc_names - lease ccaches
+ * @param timeout_secs - how long to wait for the renewals before reporting them pending
+ * @param on_done - receives the leases renewed and the ones still pending
+ * @return - false if the renewal thread is not running, on_done is not called then
+ */
+bool renew_leases_async( const std::vector<std::string>& krb_cc_names, int timeout_secs,
+                         lease_renewal_callback_t on_done )
+{
+    Daemon* cf_daemon = nullptr;
+    {
+        // The renewal thread completes every registered waiter after it clears its context
+        std::lock_guard<std::mutex> lock( renewal_requests_mutex );
+        cf_daemon = renewal_context.load();
+        if ( cf_daemon == nullptr )
+        {
+            return false;
+        }
+        if ( !krb_cc_names.empty() )
+        {
+            renewal_waiter_t waiter;
+            waiter.deadline = time( nullptr ) + timeout_secs;
+            waiter.on_done = std::move( on_done );
+            for ( auto& krb_cc_name : krb_cc_names )
+            {
+                renewal_outcome_t& outcome = renewal_outcomes[krb_cc_name];
+                if ( waiter.awaited.emplace( krb_cc_name, outcome.completed + 1 ).second )
+                {
+                    outcome.waiters++;
+                }
+                if ( !renewals_in_flight.count( krb_cc_name ) )
+                {
+                    renewal_requests.insert( krb_cc_name );
+                }
+            }
+            renewal_waiters.push_back( std::move( waiter ) );
+        }
+    }
+    if ( krb_cc_names.empty() )
+    {
+        on_done( std::set<std::string>(), std::set<std::string>() );
+        return true;
+    }
+    // The renewal thread also arms its timer for the deadline
+    cf_daemon->wake_renewal_thread();
+    return true;
+}
+
+/**
+ * Re-acquires the gMSA ticket of a lease, bootstrapping the machine or secret vault
+ * ticket again if the first attempt fails
+ * @param krb_ticket - lease ticket info
+ * @param cf_logger - log to systemd daemon
+ * @return - true on success
+ */
+static bool renew_lease_ticket( krb_ticket_info_t* krb_ticket, CF_logger& cf_logger )
+{
+    std::pair<int, std::string> gmsa_ticket_result;
+    std::string krb_cc_name = krb_ticket->krb_file_path;
+    std::string domainless_user = krb_ticket->domainless_user;
+    int num_retries = 1;
+    for ( int i = 0; i <= num_retries; i++ )
+    {
+        gmsa_ticket_result = fetch_gmsa_password_and_create_krb_ticket(
+            krb_ticket->domain_name, krb_ticket, krb_cc_name, cf_logger );
+        if ( gmsa_ticket_result.first == 0 )
+        {
+            return true;
+        }
+
+        std::pair<int, std::string> status;
+        cf_logger.logger( LOG_ERR, "ERROR: Cannot get gMSA krb ticket using account %s",
+                          krb_ticket->service_account_name.c_str() );
+        if ( domainless_user.find( "awsdomainlessusersecret" ) != std::string::npos )
+        {
+            int pos = domainless_user.find( ":" );
+            std::string domainlessUser = domainless_user.substr( pos + 1 );
+            status = Util::generate_krb_ticket_using_secret_vault( krb_ticket->domain_name,
+                                                                   domainlessUser, cf_logger );
+        }
+        else
+        {
+            status = generate_krb_ticket_from_machine_keytab( krb_ticket->domain_name, cf_logger );
+        }
+        if ( status.first < 0 )
+        {
+            cf_logger.logger( LOG_ERR, "Error %d: Cannot get machine krb ticket", status.first );
+            break;
+        }
+    }
+    return false;
+}
+
+/**
+ * Renewal worker pool
+ *
+ * The renewal thread hands due leases to a fixed set of workers through a shared queue and
+ * goes back to polling, so shutdown, reload, directory events and on-demand renewals are
+ * handled while a large sweep is running. At most RENEWAL_MAX_WORKERS_PER_DOMAIN renewals
+ * run against one domain at a time, so a sweep does not pile onto the domain controllers
+ * of one domain. Finished entries are handed back to the renewal thread with their next
+ * renewal time.
+ */
+static std::mutex pool_mutex;
+static std::condition_variable pool_work;
+static std::vector<std::thread> pool_workers;
+static bool pool_stopping = false;
+// due entries in submission order, with the interned lowercase domain they count against
+static std::deque<std::pair<symbol_id_t, renewal_entry_t>> pool_pending;
+static std::map<symbol_id_t, int> pool_running_per_domain;
+// lease ccaches pending or being renewed
+static std::set<std::string> pool_leases;
+static std::vector<renewal_entry_t> pool_finished;
+
+static void renewal_pool_worker( Daemon* cf_daemon )
+{
+    std::unique_lock<std::mutex> lock( pool_mutex );
+    while ( true )
+    {
+        // Oldest due lease whose domain has a free slot
+        auto next = pool_pending.end();
+        pool_work.wait( lock, [&]() {
+            next = std::find_if( pool_pending.begin(), pool_pending.end(), []( auto& pending ) {
+                return pool_running_per_domain[pending.first] < RENEWAL_MAX_WORKERS_PER_DOMAIN;
+            } );
+            return pool_stopping || next != pool_pending.end();
+        } );
+        if ( pool_stopping )
+        {
+            return;
+        }
+        symbol_id_t domain_id = next->first;
+        renewal_entry_t entry = next->second;
+        pool_pending.erase( next );
+        pool_running_per_domain[domain_id]++;
+        lock.unlock();
+
+        std::string krb_cc_name = entry.krb_ticket.krb_file_path;
+        {
+            // Requests made from now on are answered by this renewal
+            std::lock_guard<std::mutex> requests_lock( renewal_requests_mutex );
+            renewals_in_flight.insert( krb_cc_name );
+            renewal_requests.erase( krb_cc_name );
+        }
+        std::cout << Util::getCurrentTime() << '\t' << "INFO: renewing " << krb_cc_name
+                  << std::endl;
+        bool renewed = renew_lease_ticket( &entry.krb_ticket, cf_daemon->cf_logger );
+        finish_lease_renewal( krb_cc_name, renewed );
+        entry.renew_at = renewed ? get_renew_at( entry.krb_ticket ) : 0;
+        // Never spin on a ticket that cannot be renewed
+        entry.renew_at = std::max( entry.renew_at, time( nullptr ) + RENEWAL_RETRY_SECS );
+
+        lock.lock();
+        pool_running_per_domain[domain_id]--;
+        pool_leases.erase( krb_cc_name );
+        pool_finished.push_back( entry );
+        pool_work.notify_all();
+        // The renewal thread puts the entry back in the schedule
+        cf_daemon->wake_renewal_thread();
+    }
+}
+
+static void start_renewal_pool( Daemon& cf_daemon )
+{
+    std::lock_guard<std::mutex> lock( pool_mutex );
+    pool_stopping = false;
+    for ( int i = 0; i < RENEWAL_MAX_WORKERS; i++ )
+    {
+        pool_workers.push_back( std::thread( renewal_pool_worker, &cf_daemon ) );
+    }
+}
+
+/**
+ * Stops the workers once their current renewal is done, pending leases are dropped
+ */
+static void stop_renewal_pool()
+{
+    std::vector<std::string> dropped;
+    {
+        std::lock_guard<std::mutex> lock( pool_mutex );
+        pool_stopping = true;
+        for ( auto& pending : pool_pending )
+        {
+            dropped.push_back( pending.second.krb_ticket.krb_file_path );
+        }
+        pool_pending.clear();
+        pool_work.notify_all();
+    }
+    for ( auto& worker_thread : pool_workers )
+    {
+        worker_thread.join();
+    }
+    pool_workers.clear();
+    pool_leases.clear();
+    pool_finished.clear();
+    pool_running_per_domain.clear();
+    for ( auto& krb_cc_name : dropped )
+    {
+        finish_lease_renewal( krb_cc_name, false );
+    }
+}
+
+/**
+ * Hands a due lease to the workers
+ * @param entry - due lease
+ * @return - false if the lease is already pending or being renewed
+ */
+static bool submit_lease_renewal( const renewal_entry_t& entry )
+{
+    std::string domain_name = entry.krb_ticket.domain_name;
+    std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
+                    []( unsigned char c ) { return std::tolower( c ); } );
+    symbol_id_t domain_id = SymbolTable::instance().intern( domain_name );
+
+    std::lock_guard<std::mutex> lock( pool_mutex );
+    if ( !pool_leases.insert( entry.krb_ticket.krb_file_path ).second )
+    {
+        return false;
+    }
+    pool_pending.emplace_back( domain_id, entry );
+    pool_work.notify_one();
+    return true;
+}
+
+/**
+ * Entries the workers finished since the last call
+ * @return - entries with their next renewal time
+ */
+static std::vector<renewal_entry_t> take_finished_renewals()
+{
+    std::vector<renewal_entry_t> finished;
+    std::lock_guard<std::mutex> lock( pool_mutex );
+    finished.swap( pool_finished );
+    return finished;
+}
+
+/**
+ * Whether a lease is pending in or being renewed by the workers
+ * @param krb_cc_name - lease ccache
+ */
+static bool is_pooled_lease( const std::string& krb_cc_name )
+{
+    std::lock_guard<std::mutex> lock( pool_mutex );
+    return pool_leases.count( krb_cc_name ) != 0;
+}
+
+/**
+ * Turns the pending on-demand renewals into due entries, their queued entries become stale
+ * Leases already handed to the renewal workers are left alone, the renewal pending or in
+ * flight answers the request.
+ * @param scheduled - lease ccaches in the schedule
+ * @return - leases to renew now
+ */
+static std::vector<renewal_entry_t> take_renewal_requests( renewal_schedule_t& scheduled )
+{
+    std::set<std::string> requests;
+    {
+        std::lock_guard<std::mutex> lock( renewal_requests_mutex );
+        requests.swap( renewal_requests );
+    }
+
+    std::vector<renewal_entry_t> due;
+    for ( auto& krb_cc_name : requests )
+    {
+        renewal_entry_t entry;
+        if ( !LeaseRegistry::instance().get_ticket( krb_cc_name, &entry.krb_ticket ) ||
+             !is_scheduled_lease( entry.krb_ticket ) )
+        {
+            // Nothing the renewal thread can do, do not keep a waiter until its timeout
+            finish_lease_renewal( krb_cc_name, false );
+            continue;
+        }
+        if ( is_pooled_lease( krb_cc_name ) )
+        {
+            continue;
+        }
+        entry.generation = get_next_renewal_generation();
+        scheduled[krb_cc_name] = entry.generation;
+        due.push_back( entry );
+    }
+    return due;
+}
+
+/**
+ * Clears a timerfd or eventfd that poll() reported readable
+ * @param fd - non-blocking descriptor
+ */
+static void clear_wakeup_fd( int fd )
+{
+    uint64_t count = 0;
+    if ( read( fd, &count, sizeof( count ) ) < 0 )
+    {
+        // The timer was re-armed or the clock jumped, the schedule is re-evaluated anyway
+    }
+}
+
+/**
+ * Arms the timer for an absolute wall clock time
+ * @param timer_fd - from timerfd_create( CLOCK_REALTIME )
+ * @param wake_at - unix time, times in the past fire immediately
+ */
+static void arm_renewal_timer( int timer_fd, time_t wake_at )
+{
+    struct itimerspec timer_spec;
+    memset( &timer_spec, 0, sizeof( timer_spec ) );
+    // A zero it_value would disarm the timer
+    timer_spec.it_value.tv_sec = std::max( wake_at, (time_t)1 );
+    timerfd_settime( timer_fd, TFD_TIMER_ABSTIME, &timer_spec, nullptr );
+}
+
+/**
+ * Renews every lease when it is due
+ * Leases are kept in a min-heap ordered by their renewal time and a timerfd wakes the
+ * thread when the earliest lease is due, so each ticket is looked at once per lifetime.
+ * Due leases are renewed by the worker pool while the thread keeps waiting for events,
+ * the workers wake it through the renewal eventfd to hand back the renewed leases.
+ * Leases are picked up from the lease registry as soon as krb_files_dir changes, and at
+ * least every krb_ticket_handle_interval minutes. Leases removed from the directory leave
+ * the registry and the schedule right away.
+ * Shutdown, reload (SIGHUP) and on-demand renewals wake the thread through the daemon's
+ * renewal eventfd.
+ *
+ * @param cf_daemon - daemon context, shared with the main and gRPC threads
+ * @return - -1 when the thread exits
+ */
+int krb_ticket_renew_handler( Daemon& cf_daemon )
 {
     std::string krb_files_dir = cf_daemon.krb_files_dir;
     int interval = cf_daemon.krb_ticket_handle_interval;
-    CF_logger cf_logger = cf_daemon.cf_logger;
+    CF_logger& cf_logger = cf_daemon.cf_logger;
 
     if ( krb_files_dir.empty() )
     {
@@ -16,93 +750,133 @@ int krb_ticket_renew_handler( Daemon cf_daemon )
         return -1;
     }
 
+    int timer_fd = timerfd_create( CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC );
+    if ( timer_fd < 0 )
+    {
+        perror( "timerfd_create" );
+        return -1;
+    }
+
+    // Without a watch, leases are only picked up every interval
+    int inotify_fd = watch_krb_files_dir( krb_files_dir );
+
+    renewal_queue_t renewal_queue;
+    renewal_schedule_t scheduled;
+    uint64_t registry_cursor = 0;
+    time_t next_scan_at = 0;
+    renewal_context.store( &cf_daemon );
+    start_renewal_pool( cf_daemon );
+
     while ( !cf_daemon.got_systemd_shutdown_signal )
     {
         try
         {
-            auto x = std::chrono::steady_clock::now() + std::chrono::minutes( interval );
-            std::this_thread::sleep_until( x );
-            std::cout << Util::getCurrentTime() << '\t' << "INFO: renewal started" << std::endl;
+            if ( cf_daemon.got_config_reload_signal )
+            {
+                cf_daemon.got_config_reload_signal = 0;
+                cf_logger.logger( LOG_INFO, "Reloading the lease renewal schedule" );
+                // Every lease is scheduled again from its current tickets
+                resync_krb_files_dir( krb_files_dir );
+                renewal_queue = renewal_queue_t();
+                scheduled.clear();
+                registry_cursor = 0;
+            }
+            if ( inotify_fd >= 0 )
+            {
+                for ( auto& krb_cc_name :
+                      apply_krb_files_dir_events( inotify_fd, krb_files_dir ) )
+                {
+                    scheduled.erase( krb_cc_name );
+                }
+            }
+            // The registry is in memory, new leases are picked up on every wake up
+            schedule_new_leases( &registry_cursor, scheduled, renewal_queue );
+            time_t now = time( nullptr );
+            if ( now >= next_scan_at )
+            {
+                next_scan_at = now + interval * 60;
+            }
 
-            // identify the metadata files in the krb directory
-            std::vector<std::string> metadatafiles;
-            for ( std::filesystem::recursive_directory_iterator end, dir( krb_files_dir );
-                  dir != end; ++dir )
+            // Renewed leases go back in the schedule unless they were removed, renewed on
+            // demand or rescheduled by a reload in the meantime
+            for ( auto& entry : take_finished_renewals() )
             {
-                auto path = dir->path();
-                if ( std::filesystem::is_regular_file( path ) )
+                auto schedule = scheduled.find( entry.krb_ticket.krb_file_path );
+                if ( schedule != scheduled.end() && schedule->second == entry.generation )
                 {
-                    // find the file with metadata extension
-                    std::string filename = path.filename().string();
-                    if ( !filename.empty() && filename.find( "_metadata" ) != std::string::npos )
-                    {
-                        std::string filepath = path.parent_path().string() + "/" + filename;
-                        metadatafiles.push_back( filepath );
-                    }
+                    renewal_queue.push( entry );
                 }
             }
 
-            // read the information of service account from the files
-            for ( auto file_path : metadatafiles )
+            std::vector<renewal_entry_t> due = take_renewal_requests( scheduled );
+            while ( !renewal_queue.empty() && renewal_queue.top().renew_at <= time( nullptr ) )
             {
-                std::list<krb_ticket_info_t*> krb_ticket_info_list =
-                    read_meta_data_json( file_path );
+                renewal_entry_t entry = renewal_queue.top();
+                renewal_queue.pop();
+                krb_ticket_info_t* krb_ticket = &entry.krb_ticket;
+                std::string krb_cc_name = krb_ticket->krb_file_path;
 
-                // refresh the kerberos tickets for the service accounts, if tickets ready for
-                // renewal
-                for ( auto krb_ticket : krb_ticket_info_list )
+                auto schedule = scheduled.find( krb_cc_name );
+                if ( schedule == scheduled.end() || schedule->second != entry.generation )
                 {
-                    std::pair<int, std::string> gmsa_ticket_result;
-                    std::string krb_cc_name = krb_ticket->krb_file_path;
-                    std::string domainless_user = krb_ticket->domainless_user;
-                    // check if the ticket is ready for renewal and not created in domainless mode
-                    if ( ( domainless_user.empty() ||
-                           domainless_user.find( "awsdomainlessusersecret" ) !=
-                               std::string::npos ) &&
-                         is_ticket_ready_for_renewal( krb_ticket, cf_daemon.cf_logger ) )
-                    {
-                        int num_retries = 1;
-                        for ( int i = 0; i <= num_retries; i++ )
-                        {
-                            gmsa_ticket_result = fetch_gmsa_password_and_create_krb_ticket(
-                                krb_ticket->domain_name, krb_ticket, krb_cc_name, cf_logger );
-                            if ( gmsa_ticket_result.first != 0 )
-                            {
-                                std::pair<int, std::string> status;
-                                cf_logger.logger(
-                                    LOG_ERR, "ERROR: Cannot get gMSA krb ticket using account %s",
-                                    krb_ticket->service_account_name.c_str() );
-                                if ( domainless_user.find( "awsdomainlessusersecret" ) !=
-                                     std::string::npos )
-                                {
-                                    int pos = domainless_user.find( ":" );
-                                    std::string domainlessUser = domainless_user.substr( pos + 1 );
-                                    status = Util::generate_krb_ticket_using_secret_vault(
-                                        krb_ticket->domain_name, domainlessUser, cf_logger );
-                                }
-                                else
-                                {
-                                    status = generate_krb_ticket_from_machine_keytab(
-                                        krb_ticket->domain_name, cf_logger );
-                                }
-                                if ( status.first < 0 )
-                                {
-                                    cf_logger.logger( LOG_ERR,
-                                                      "Error %d: Cannot get machine krb ticket",
-                                                      status );
-                                }
-                                else
-                                {
-                                    break;
-                                }
-                            }
-                        }
-                    }
-                    else
-                    {
-                        cf_logger.logger( LOG_INFO, "gMSA ticket is at %s", krb_cc_name.c_str() );
-                    }
+                    // Lease was removed or renewed on demand
+                    continue;
                 }
+                if ( !LeaseRegistry::instance().contains( krb_cc_name ) )
+                {
+                    // Lease was deleted
+                    scheduled.erase( schedule );
+                    continue;
+                }
+
+                // The ticket may have been renewed through the API in the meantime
+                time_t renew_at = get_renew_at( *krb_ticket );
+                if ( renew_at > time( nullptr ) )
+                {
+                    entry.renew_at = renew_at;
+                    renewal_queue.push( entry );
+                    continue;
+                }
+
+                due.push_back( entry );
+            }
+            for ( auto& entry : due )
+            {
+                if ( !submit_lease_renewal( entry ) )
+                {
+                    // Rescheduled by a reload while the workers still renew it
+                    entry.renew_at = time( nullptr ) + RENEWAL_RETRY_SECS;
+                    renewal_queue.push( entry );
+                }
+            }
+
+            time_t wake_at = next_scan_at;
+            time_t waiter_deadline = expire_renewal_waiters( false );
+            if ( waiter_deadline != 0 && waiter_deadline < wake_at )
+            {
+                wake_at = waiter_deadline;
+            }
+            if ( !renewal_queue.empty() && renewal_queue.top().renew_at < wake_at )
+            {
+                wake_at = renewal_queue.top().renew_at;
+            }
+            arm_renewal_timer( timer_fd, wake_at );
+
+            // poll() skips negative descriptors, e.g. when the directory is not watched
+            struct pollfd renewal_poll[3] = { { timer_fd, POLLIN, 0 },
+                                              { cf_daemon.renewal_event_fd, POLLIN, 0 },
+                                              { inotify_fd, POLLIN, 0 } };
+            if ( cf_daemon.got_systemd_shutdown_signal || poll( renewal_poll, 3, -1 ) <= 0 )
+            {
+                continue;
+            }
+            if ( renewal_poll[0].revents & POLLIN )
+            {
+                clear_wakeup_fd( timer_fd );
+            }
+            if ( renewal_poll[1].revents & POLLIN )
+            {
+                clear_wakeup_fd( cf_daemon.renewal_event_fd );
             }
         }
         catch ( const std::exception& ex )
@@ -116,5 +890,126 @@ int krb_ticket_renew_handler( Daemon cf_daemon )
             break;
         }
     }
+    {
+        std::lock_guard<std::mutex> lock( renewal_requests_mutex );
+        renewal_context.store( nullptr );
+    }
+    stop_renewal_pool();
+    // Nobody is left to renew what the callers still wait for
+    expire_renewal_waiters( true );
+    if ( inotify_fd >= 0 )
+    {
+        close( inotify_fd );
+    }
+    close( timer_fd );
     return -1;
 }
+
+/**
+ * Forecasts the renewals of the next hours from the lease registry and the ticket times
+ * Every scheduled lease is projected forward from its next renewal time, a renewal being
+ * followed by the next one a jittered ticket lifetime later. Leases sharing a ccache
+ * (same domain, account and bootstrap source) are acquired once per hour, the password
+ * is fetched over LDAP once per account and password period, starting when the cached
+ * one is due for refresh, and that LDAP query needs a bootstrap TGT.
+ * Renewals are attributed to the domain controller ranked first from the observed
+ * latencies, the one the next request goes to; no DNS lookup is made.
+ *
+ * @param hours - forecast horizon, at most RENEWAL_FORECAST_MAX_HOURS
+ * @return - hourly buckets per domain and domain controller, in time order
+ */
+std::vector<renewal_forecast_t> get_renewal_forecast( uint32_t hours )
+{
+    hours = std::min( std::max( hours, (uint32_t)1 ), (uint32_t)RENEWAL_FORECAST_MAX_HOURS );
+    time_t now = time( nullptr );
+    time_t horizon = now + (time_t)hours * SECONDS_IN_HOUR;
+
+    // (bucket start, domain, domain controller) -> bucket
+    std::map<std::tuple<time_t, std::string, std::string>, renewal_forecast_t> buckets;
+    std::set<std::string> acquisitions;
+    std::set<std::string> password_fetches;
+    std::set<std::string> bootstraps;
+
+    LeaseRegistry& registry = LeaseRegistry::instance();
+    uint64_t cursor = 0;
+    for ( auto& krb_ticket : registry.get_added_since( &cursor ) )
+    {
+        if ( !is_scheduled_lease( krb_ticket ) )
+        {
+            continue;
+        }
+        std::string domain_name = krb_ticket.domain_name;
+        std::transform( domain_name.begin(), domain_name.end(), domain_name.begin(),
+                        []( unsigned char c ) { return std::tolower( c ); } );
+        // empty until a request was made to the domain
+        std::string domain_controller = DcLatencyTracker::instance().get_primary_dc( domain_name );
+        std::string account_key = domain_name + "|" + krb_ticket.service_account_name;
+        time_t refresh_at =
+            GmsaPasswordCache::instance().get_refresh_at( domain_name,
+                                                          krb_ticket.service_account_name );
+        // the first fetch happens at the refresh, right away without a cached password
+        time_t first_fetch_at = refresh_at != 0 ? refresh_at : now;
+
+        // Renewals repeat after the usable part of the ticket lifetime
+        time_t period = 0;
+        krb5_ticket_times times;
+        if ( !krb_ticket.keytab_output && get_tgt_times( krb_ticket.krb_file_path, &times ) )
+        {
+            time_t starttime =
+                times.starttime != 0 ? (time_t)times.starttime : (time_t)times.authtime;
+            time_t lifetime = (time_t)times.endtime - starttime;
+            period = lifetime - std::min( get_renewal_lead_time( domain_name ), lifetime / 2 );
+            period -= (time_t)( period * get_renewal_spread_factor() *
+                                get_renewal_jitter( krb_ticket.krb_file_path ) );
+        }
+        if ( period <= 0 )
+        {
+            // Keytab leases only follow the password, which rotates after the horizon
+            period = horizon - now + 1;
+        }
+
+        for ( time_t renew_at = std::max( get_renew_at( krb_ticket ), now ); renew_at < horizon;
+              renew_at += std::max( period, (time_t)RENEWAL_RETRY_SECS ) )
+        {
+            time_t bucket_start = renew_at - renew_at % SECONDS_IN_HOUR;
+            renewal_forecast_t& bucket =
+                buckets[std::make_tuple( bucket_start, domain_name, domain_controller )];
+            bucket.domain_name = domain_name;
+            bucket.domain_controller = domain_controller;
+            bucket.bucket_start = bucket_start;
+            bucket.renewals++;
+
+            std::string bucket_key = std::to_string( bucket_start ) + "|";
+            if ( !acquisitions
+                      .insert( bucket_key + account_key + "|" + krb_ticket.domainless_user )
+                      .second )
+            {
+                continue;
+            }
+            if ( first_fetch_at <= renew_at &&
+                 password_fetches
+                     .insert( account_key + "|" +
+                              std::to_string( ( renew_at - first_fetch_at ) /
+                                              GMSA_DEFAULT_PASSWORD_INTERVAL_SECS ) )
+                     .second )
+            {
+                bucket.ldap_operations += krb_ticket.distinguished_name.empty() ? 2 : 1;
+                if ( bootstraps
+                         .insert( bucket_key + domain_name + "|" + krb_ticket.domainless_user )
+                         .second )
+                {
+                    bucket.kdc_operations++;
+                }
+            }
+            // gMSA TGT, then the service tickets prefetched with it
+            bucket.kdc_operations += 1 + (uint32_t)krb_ticket.prefetch_spns.size();
+        }
+    }
+
+    std::vector<renewal_forecast_t> forecast;
+    for ( auto& bucket : buckets )
+    {
+        forecast.push_back( bucket.second );
+    }
+    return forecast;
+}
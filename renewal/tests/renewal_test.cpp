@@ -1,4 +1,7 @@
 #include "daemon.h"
+#include "gmsa_password_cache.hpp"
+#include "lease_registry.hpp"
+#include "renewal_lead_time.hpp"
 #include <stdlib.h>
 
 int renewal_failure_krb_dir_not_found_test()
@@ -16,3 +19,161 @@ int renewal_failure_krb_dir_not_found_test()
     std::cout << "\nkrb dir not found test is successful" << std::endl;
     return EXIT_SUCCESS;
 }
+
+int gmsa_password_cache_test()
+{
+    std::string domain_name = "cachetest.contoso.com";
+    std::string gmsa_account_name = "webapp01";
+    GmsaPasswordCache& cache = GmsaPasswordCache::instance();
+
+    blob_t blob;
+    memset( &blob, 0, sizeof( blob ) );
+    blob.version = 1;
+    blob.current_password_offset = offsetof( blob_t, current_password );
+    blob.query_password_interval_offset = blob.current_password_offset + GMSA_PASSWORD_SIZE;
+    size_t blob_len = blob.query_password_interval_offset + sizeof( int64_t );
+    blob.length = blob_len;
+    memset( blob.current_password, 0x41, GMSA_PASSWORD_SIZE );
+
+    // 1 day until AD rotates the password
+    int64_t query_interval = 24 * 3600 * GMSA_INTERVAL_TICKS_PER_SECOND;
+    memcpy( (uint8_t*)&blob + blob.query_password_interval_offset, &query_interval,
+            sizeof( query_interval ) );
+
+    uint8_t* password = (uint8_t*)SecureArena::instance().allocate( GMSA_PASSWORD_SIZE );
+    uint64_t generation = 0;
+    if ( password == nullptr || !cache.put( domain_name, gmsa_account_name, &blob, blob_len ) ||
+         !cache.get( "CacheTest.Contoso.com", "WebApp01", password, &generation ) ||
+         memcmp( password, blob.current_password, GMSA_PASSWORD_SIZE ) != 0 ||
+         generation != 1 || cache.needs_refresh( domain_name, gmsa_account_name ) )
+    {
+        SecureArena::instance().release( password );
+        std::cout << "\ngMSA password cache hit test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // A rotated password bumps the generation
+    memset( blob.current_password, 0x42, GMSA_PASSWORD_SIZE );
+    cache.put( domain_name, gmsa_account_name, &blob, blob_len );
+    cache.get( domain_name, gmsa_account_name, password, &generation );
+    if ( generation != 2 )
+    {
+        SecureArena::instance().release( password );
+        std::cout << "\ngMSA password cache generation test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Invalidated entries are due for refresh and no longer served
+    cache.invalidate( domain_name, gmsa_account_name );
+    bool served = cache.get( domain_name, gmsa_account_name, password );
+    SecureArena::instance().release( password );
+    if ( served || !cache.needs_refresh( domain_name, gmsa_account_name ) )
+    {
+        std::cout << "\ngMSA password cache invalidate test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // A password fetched just before rotation stays fresh until AD rotates it
+    query_interval = 10 * 60 * GMSA_INTERVAL_TICKS_PER_SECOND;
+    memcpy( (uint8_t*)&blob + blob.query_password_interval_offset, &query_interval,
+            sizeof( query_interval ) );
+    if ( !cache.put( domain_name, gmsa_account_name, &blob, blob_len ) ||
+         cache.needs_refresh( domain_name, gmsa_account_name ) )
+    {
+        std::cout << "\ngMSA password cache imminent rotation test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Not refreshed while AD guarantees the password stays unchanged
+    query_interval = 24 * 3600 * GMSA_INTERVAL_TICKS_PER_SECOND;
+    int64_t unchanged_interval = query_interval;
+    blob.unchanged_password_interval_offset =
+        blob.query_password_interval_offset + sizeof( int64_t );
+    blob_len = blob.unchanged_password_interval_offset + sizeof( int64_t );
+    blob.length = blob_len;
+    memcpy( (uint8_t*)&blob + blob.query_password_interval_offset, &query_interval,
+            sizeof( query_interval ) );
+    memcpy( (uint8_t*)&blob + blob.unchanged_password_interval_offset, &unchanged_interval,
+            sizeof( unchanged_interval ) );
+    time_t rotate_at = time( nullptr ) + 24 * 3600;
+    if ( !cache.put( domain_name, gmsa_account_name, &blob, blob_len ) ||
+         cache.get_refresh_at( domain_name, gmsa_account_name ) < rotate_at )
+    {
+        std::cout << "\ngMSA password cache unchanged interval test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "\ngMSA password cache test is successful" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int renewal_lead_time_test()
+{
+    RenewalLeadTime& lead_time = RenewalLeadTime::instance();
+    time_t default_lead_time = RENEW_TICKET_HOURS * SECONDS_IN_HOUR;
+
+    // Unknown domains keep the default
+    if ( lead_time.get_lead_time( "unknown.contoso.com", 2, 300 ) != default_lead_time )
+    {
+        std::cout << "\nrenewal lead time default test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    for ( int i = 0; i < RENEWAL_LEAD_MIN_SAMPLES; i++ )
+    {
+        lead_time.record( "healthy.contoso.com", std::chrono::milliseconds( 200 ), true );
+        lead_time.record( "Degraded.Contoso.com", std::chrono::milliseconds( 20000 ), i % 2 == 0 );
+    }
+    time_t healthy_lead_time = lead_time.get_lead_time( "healthy.contoso.com", 2, 300 );
+    time_t degraded_lead_time = lead_time.get_lead_time( "degraded.contoso.com", 2, 300 );
+    if ( healthy_lead_time >= default_lead_time || degraded_lead_time <= healthy_lead_time )
+    {
+        std::cout << "\nrenewal lead time adaptation test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "\nrenewal lead time test is successful" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int lease_registry_symbols_test()
+{
+    SymbolTable& symbols = SymbolTable::instance();
+    symbol_id_t domain_id = symbols.intern( "contoso.com" );
+    if ( domain_id == SYMBOL_ID_EMPTY || symbols.intern( "contoso.com" ) != domain_id ||
+         symbols.intern( "" ) != SYMBOL_ID_EMPTY || symbols.lookup( domain_id ) != "contoso.com" )
+    {
+        std::cout << "\nsymbol table test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Tickets share the interned names and come back with them restored
+    LeaseRegistry& registry = LeaseRegistry::instance();
+    std::vector<krb_ticket_info_t> krb_tickets( 2 );
+    for ( size_t i = 0; i < krb_tickets.size(); i++ )
+    {
+        krb_tickets[i].krb_file_path = "/tmp/symbols_test_lease/ccname_" + std::to_string( i );
+        krb_tickets[i].domain_name = "Contoso.com";
+        krb_tickets[i].service_account_name = "WebApp01";
+        krb_tickets[i].domainless_user = "user1";
+        krb_tickets[i].credential_arn = "arn:aws:secretsmanager:us-west-2:123:secret:user1";
+    }
+    registry.add_lease( "symbols_test_lease", krb_tickets );
+    std::vector<krb_ticket_info_t> by_account =
+        registry.find_by_service_account( "contoso.com", "webapp01" );
+    std::vector<krb_ticket_info_t> by_user = registry.find_by_domainless_user( "user1" );
+    bool found = by_account.size() == 2 && by_user.size() == 2 &&
+                 by_account[0].domain_name == "Contoso.com" &&
+                 by_account[0].service_account_name == "WebApp01" &&
+                 by_user[1].credential_arn == krb_tickets[1].credential_arn &&
+                 registry.find_by_domainless_user( "unknown_user" ).empty();
+    registry.remove_lease( "symbols_test_lease" );
+    if ( !found || !registry.find_by_domainless_user( "user1" ).empty() )
+    {
+        std::cout << "\nlease registry symbols test is failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "\nlease registry symbols test is successful" << std::endl;
+    return EXIT_SUCCESS;
+}